@@ -0,0 +1,186 @@
+/********************************************************************************
+ * catalog.c : The tables of a database file and the catalog that lists them
+ *
+ * A database file holds any number of tables, each a tree of its own, which
+ * share the pager and its buffer pool. The catalog page maps the name of each
+ * table to the root of its tree and of its indexes. Roots never move, so the
+ * catalog only changes when a table or an index is created or dropped. It is
+ * read once when the file is opened, and written out whole after a change.
+ ********************************************************************************/
+#include "catalog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Adds a new empty table called NAME to DATABASE and returns it.
+ */
+static Table *database_add_table(Database *database, const char *name) {
+  Table *table = table_open(database->pager, create_tree(database->pager));
+  strcpy(table->name, name);
+  database->tables = realloc(database->tables,
+                             (database->num_tables + 1) * sizeof(Table *));
+  database->tables[database->num_tables++] = table;
+  return table;
+}
+
+/*
+ * Opens the tables listed in the catalog of DATABASE.
+ */
+static void catalog_load(Database *database) {
+  Pager *pager = database->pager;
+  Catalog *catalog = get_page(pager, database->catalog_page_num);
+  database->num_tables = catalog->num_tables;
+  database->tables = malloc(catalog->num_tables * sizeof(Table *));
+  for (uint32_t i = 0; i < catalog->num_tables; i++) {
+    CatalogEntry *entry = &catalog->entries[i];
+    Table *table = table_open(pager, entry->root_page_num);
+    strcpy(table->name, entry->name);
+    for (uint32_t j = 0; j < NUM_INDEXED_COLUMNS; j++) {
+      if (entry->index_root_page_nums[j] != 0) {
+        table->indexes[j] = table_open(pager, entry->index_root_page_nums[j]);
+      }
+    }
+    database->tables[i] = table;
+  }
+  unpin_page(pager, database->catalog_page_num);
+}
+
+/*
+ * Writes the tables of DATABASE and their indexes to the catalog page.
+ */
+void catalog_save(Database *database) {
+  Pager *pager = database->pager;
+  Catalog *catalog = get_page(pager, database->catalog_page_num);
+  catalog->num_tables = database->num_tables;
+  for (uint32_t i = 0; i < database->num_tables; i++) {
+    Table *table = database->tables[i];
+    CatalogEntry *entry = &catalog->entries[i];
+    memset(entry, 0, sizeof(CatalogEntry));
+    strcpy(entry->name, table->name);
+    entry->root_page_num = table->root_page_num;
+    for (uint32_t j = 0; j < NUM_INDEXED_COLUMNS; j++) {
+      if (table->indexes[j] != NULL) {
+        entry->index_root_page_nums[j] = table->indexes[j]->root_page_num;
+      }
+    }
+  }
+  mark_page_dirty(pager, database->catalog_page_num);
+  unpin_page(pager, database->catalog_page_num);
+}
+
+/*
+ * Opens a database connection. The pager is set up according to OPTIONS, and
+ * the tables in the catalog are opened. A new file gets a catalog with an
+ * empty default table.
+ */
+Database *db_open(const char *filename, PagerOptions options) {
+  Pager *pager = pager_open(filename, options);
+  initialize_node_layout();
+
+  Database *database = malloc(sizeof(Database));
+  database->pager = pager;
+  database->num_tables = 0;
+  database->tables = NULL;
+
+  FileHeader *header = get_page(pager, 0);
+  bool is_new = header->catalog_page_num == 0;
+  if (is_new) {
+    header->catalog_page_num = get_unused_page_num(pager, 0);
+    mark_page_dirty(pager, 0);
+  }
+  database->catalog_page_num = header->catalog_page_num;
+  unpin_page(pager, 0);
+
+  if (is_new) {
+    /* The catalog page has to be in the pool before the default table asks
+     * for a page, or both would get the same one. */
+    Catalog *catalog = get_page(pager, database->catalog_page_num);
+    catalog->num_tables = 0;
+    mark_page_dirty(pager, database->catalog_page_num);
+    unpin_page(pager, database->catalog_page_num);
+    database_add_table(database, DEFAULT_TABLE_NAME);
+    catalog_save(database);
+    pager_commit(pager);
+  } else {
+    catalog_load(database);
+  }
+  return database;
+}
+
+/*
+ * Closes the database connection.
+ * A transaction that is still open is rolled back. The pages in the memory
+ * are flushed and written to disk. Then the pager and table memories are
+ * freed.
+ */
+void db_close(Database *database) {
+  if (pager_in_transaction(database->pager)) {
+    pager_rollback(database->pager);
+    pager_end_write(database->pager);
+  }
+  pager_close(database->pager);
+  for (uint32_t i = 0; i < database->num_tables; i++) {
+    table_close(database->tables[i]);
+  }
+  free(database->tables);
+  free(database);
+}
+
+/*
+ * Returns the table of DATABASE called NAME, or NULL if there is none.
+ */
+Table *db_find_table(Database *database, const char *name) {
+  for (uint32_t i = 0; i < database->num_tables; i++) {
+    if (strcmp(database->tables[i]->name, name) == 0) {
+      return database->tables[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Executes a create table statement, which adds an empty table to the
+ * catalog.
+ */
+ExecuteResult execute_create_table(Statement *statement, Database *database) {
+  if (db_find_table(database, statement->table_name) != NULL) {
+    return EXECUTE_TABLE_EXISTS;
+  }
+  if (database->num_tables >= CATALOG_MAX_TABLES) {
+    return EXECUTE_CATALOG_FULL;
+  }
+  database_add_table(database, statement->table_name);
+  catalog_save(database);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * Executes a drop table statement. The table leaves the catalog, and the
+ * pages of its tree and its indexes go to the free list.
+ */
+ExecuteResult execute_drop_table(Statement *statement, Database *database) {
+  Table *table = db_find_table(database, statement->table_name);
+  if (table == NULL) {
+    return EXECUTE_TABLE_NOT_FOUND;
+  }
+
+  uint32_t index = 0;
+  while (database->tables[index] != table) {
+    index++;
+  }
+  memmove(database->tables + index, database->tables + index + 1,
+          (database->num_tables - index - 1) * sizeof(Table *));
+  database->num_tables--;
+  catalog_save(database);
+
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    if (table->indexes[i] != NULL) {
+      free_tree(database->pager, table->indexes[i]->root_page_num);
+    }
+  }
+  free_tree(database->pager, table->root_page_num);
+  table_close(table);
+  return EXECUTE_SUCCESS;
+}
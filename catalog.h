@@ -0,0 +1,56 @@
+/********************************************************************************
+ * catalog.h : The tables of a database file and the catalog that lists them
+ ********************************************************************************/
+#ifndef _CATALOG_H
+#define _CATALOG_H
+
+#include <stdint.h>
+
+#include "internals.h"
+#include "pager.h"
+#include "results.h"
+
+/* Statements that do not name a table work on this one. */
+#define DEFAULT_TABLE_NAME "main"
+
+/*
+ * A table in the catalog: its name and the roots of its tree and of the index
+ * on each column, or 0 for a column without one. Every table has the columns
+ * of a Row.
+ */
+typedef struct {
+  char name[TABLE_NAME_SIZE + 1];
+  uint32_t root_page_num;
+  uint32_t index_root_page_nums[NUM_INDEXED_COLUMNS];
+} CatalogEntry;
+
+/*
+ * The catalog takes up the page the file header points to. It lists the
+ * tables in the order they were created.
+ */
+typedef struct {
+  uint32_t num_tables;
+  CatalogEntry entries[];
+} Catalog;
+
+#define CATALOG_MAX_TABLES ((PAGE_SIZE - sizeof(Catalog)) / sizeof(CatalogEntry))
+
+/*
+ * An open database file. Its tables share the pager, and TABLES holds
+ * NUM_TABLES of them in catalog order.
+ */
+typedef struct {
+  Pager* pager;
+  uint32_t catalog_page_num;
+  uint32_t num_tables;
+  Table** tables;
+} Database;
+
+Database* db_open(const char* filename, PagerOptions options);
+void db_close(Database* database);
+Table* db_find_table(Database* database, const char* name);
+void catalog_save(Database* database);
+ExecuteResult execute_create_table(Statement* statement, Database* database);
+ExecuteResult execute_drop_table(Statement* statement, Database* database);
+
+#endif
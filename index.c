@@ -0,0 +1,436 @@
+/********************************************************************************
+ * index.c : Secondary indexes on the username and email columns
+ *
+ * An index is a B+ tree of its own in the database file, built from the same
+ * nodes as the table and going through the same pager. Its entries map a
+ * value of the column to the id of a row that has it.
+ * Keys in the tree are 64 bit integers, so the key of an entry is a hash of
+ * the value. Many rows can share a value, and different values can share a
+ * hash, so unlike in the table a key can appear more than once. Entries with
+ * the same key are ordered by the id of their row, which makes each entry
+ * unique. A lookup descends to the first entry with the hash of the value and
+ * reads on from there, skipping entries of other values with the same hash.
+ ********************************************************************************/
+#include "index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Index entry layout
+ *
+ * An entry is laid out like a serialized row, so the leaf code stores it as
+ * it is: the key, then the id of the row as an 8 byte field, then the value
+ * as a one byte length followed by that many bytes.
+ */
+#define INDEX_ENTRY_ID_LENGTH sizeof(uint64_t)
+#define INDEX_ENTRY_MAX_SIZE \
+  (sizeof(uint64_t) + 1 + INDEX_ENTRY_ID_LENGTH + 1 + COLUMN_EMAIL_SIZE)
+
+/*
+ * A value of the column and the id of its row, collected while building an
+ * index. The value is at OFFSET of the buffer that holds all of them.
+ */
+typedef struct {
+  uint64_t key;
+  uint64_t id;
+  uint32_t offset;
+  uint32_t length;
+} IndexBuildEntry;
+
+/*
+ * Returns the key of VALUE, which is LENGTH bytes long, in an index. It is the
+ * 64 bit FNV-1a hash of the bytes.
+ */
+static uint64_t index_key(const char *value, uint32_t length) {
+  uint64_t hash = 14695981039346656037UL;
+  for (uint32_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)value[i];
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+/*
+ * Writes the entry for the row with ID and VALUE of LENGTH bytes to
+ * DESTINATION and returns its size.
+ */
+static uint32_t index_entry_serialize(uint64_t id, const char *value,
+                                      uint32_t length, void *destination) {
+  uint8_t *out = destination;
+  uint64_t key = index_key(value, length);
+  memcpy(out, &key, sizeof(key));
+  out += sizeof(key);
+  *out++ = INDEX_ENTRY_ID_LENGTH;
+  memcpy(out, &id, INDEX_ENTRY_ID_LENGTH);
+  out += INDEX_ENTRY_ID_LENGTH;
+  *out++ = length;
+  memcpy(out, value, length);
+  out += length;
+  return out - (uint8_t *)destination;
+}
+
+/*
+ * Returns the id of the row of the entry at CELL.
+ */
+static uint64_t index_entry_id(void *cell) {
+  uint32_t length;
+  uint64_t id;
+  memcpy(&id, serialized_row_username(cell, &length), INDEX_ENTRY_ID_LENGTH);
+  return id;
+}
+
+/*
+ * Compares the entry at CELL with the entry with KEY and ID. Returns a
+ * negative number if CELL comes first, 0 if they are the same and a positive
+ * number otherwise.
+ */
+static int index_entry_compare(void *cell, uint64_t key, uint64_t id) {
+  uint64_t cell_key = serialized_row_id(cell);
+  if (cell_key != key) {
+    return cell_key < key ? -1 : 1;
+  }
+  uint64_t cell_id = index_entry_id(cell);
+  return (cell_id > id) - (cell_id < id);
+}
+
+/*
+ * Returns the value of COLUMN in ROW.
+ */
+static char *row_column(Row *row, Column column) {
+  return column == COLUMN_USERNAME ? row->username : row->email;
+}
+
+/*
+ * Returns the value of COLUMN in the serialized row at SOURCE, which is
+ * LENGTH bytes long.
+ */
+static char *serialized_row_column(void *source, Column column,
+                                   uint32_t *length) {
+  if (column == COLUMN_USERNAME) {
+    return serialized_row_username(source, length);
+  }
+  return serialized_row_email(source, length);
+}
+
+/*
+ * Creates an empty index on COLUMN of TABLE. The caller records its root in
+ * the catalog.
+ */
+static Table *index_create(Table *table, Column column) {
+  table->indexes[column] =
+      table_open(table->pager, create_tree(table->pager));
+  return table->indexes[column];
+}
+
+/*
+ * Returns a cursor on the first entry of INDEX that does not come before the
+ * entry with KEY and ID, or on the end of the leaf it would go to.
+ * The descent by KEY ends in the leftmost leaf that can hold KEY. Entries with
+ * the same key can go on in the leaves after it, so the cursor moves on as
+ * long as the next leaf starts with the entry or one before it.
+ */
+static Cursor *index_seek(Table *index, uint64_t key, uint64_t id) {
+  Pager *pager = index->pager;
+  Cursor *cursor = table_find(index, key);
+  while (true) {
+    void *node = get_page(pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+
+    /* Binary search */
+    uint32_t min_index = 0;
+    uint32_t max_index = num_cells;
+    while (min_index != max_index) {
+      uint32_t i = (min_index + max_index) / 2;
+      if (index_entry_compare(leaf_node_cell(node, i), key, id) < 0) {
+        min_index = i + 1;
+      } else {
+        max_index = i;
+      }
+    }
+    cursor->cell_num = min_index;
+    unpin_page(pager, cursor->page_num);
+    if (cursor->cell_num < num_cells || next_page_num == 0) {
+      return cursor;
+    }
+
+    void *next_node = get_page_latched(pager, next_page_num, LATCH_SHARED);
+    bool goes_on =
+        *leaf_node_num_cells(next_node) > 0 &&
+        index_entry_compare(leaf_node_cell(next_node, 0), key, id) <= 0;
+    unlatch_page(pager, next_page_num);
+    if (!goes_on) {
+      return cursor;
+    }
+    cursor_enter_leaf(cursor, next_page_num);
+  }
+}
+
+/*
+ * Adds the entry for the row with ID and VALUE of LENGTH bytes to INDEX.
+ */
+static void index_add_entry(Table *index, uint64_t id, const char *value,
+                            uint32_t length) {
+  uint8_t cell[INDEX_ENTRY_MAX_SIZE];
+  uint32_t size = index_entry_serialize(id, value, length, cell);
+  Cursor *cursor = index_seek(index, serialized_row_id(cell), id);
+  LatchedPath path;
+  table_latch_path(index, cursor->page_num, size, &path);
+  leaf_node_insert_cell(cursor, cell, size);
+  table_unlatch_path(index, &path);
+  cursor_close(cursor);
+}
+
+/*
+ * Removes the entry for the row with ID and VALUE of LENGTH bytes from INDEX,
+ * if it is there.
+ */
+static void index_remove_entry(Table *index, uint64_t id, const char *value,
+                               uint32_t length) {
+  uint64_t key = index_key(value, length);
+  Cursor *cursor = index_seek(index, key, id);
+  void *node = get_page(index->pager, cursor->page_num);
+  bool found = false;
+  if (cursor->cell_num < *leaf_node_num_cells(node)) {
+    void *cell = leaf_node_cell(node, cursor->cell_num);
+    found = index_entry_compare(cell, key, id) == 0;
+  }
+  unpin_page(index->pager, cursor->page_num);
+
+  if (found) {
+    LatchedPath path;
+    table_latch_path(index, cursor->page_num, 0, &path);
+    leaf_node_delete(index, cursor->page_num, cursor->cell_num, 1);
+    table_unlatch_path(index, &path);
+  }
+  cursor_close(cursor);
+}
+
+static int compare_build_entries(const void *a, const void *b) {
+  const IndexBuildEntry *entry_a = a;
+  const IndexBuildEntry *entry_b = b;
+  if (entry_a->key != entry_b->key) {
+    return (entry_a->key > entry_b->key) - (entry_a->key < entry_b->key);
+  }
+  return (entry_a->id > entry_b->id) - (entry_a->id < entry_b->id);
+}
+
+/*
+ * Fills the empty index on COLUMN of TABLE with the rows of the table.
+ * The entries are sorted before they go in, so each of them is appended to
+ * the rightmost leaf and the leaves end up full.
+ */
+void index_build(Table *table, Column column) {
+  Table *index = table->indexes[column];
+  uint32_t capacity = 1024;
+  uint32_t count = 0;
+  IndexBuildEntry *entries = malloc(capacity * sizeof(IndexBuildEntry));
+  size_t values_capacity = 64 * 1024;
+  size_t values_length = 0;
+  char *values = malloc(values_capacity);
+
+  Cursor *cursor = table_start(table);
+  while (!(cursor->end_of_table)) {
+    void *row = cursor_value(cursor);
+    uint32_t length;
+    char *value = serialized_row_column(row, column, &length);
+    if (count == capacity) {
+      capacity *= 2;
+      entries = realloc(entries, capacity * sizeof(IndexBuildEntry));
+    }
+    if (values_length + length > values_capacity) {
+      values_capacity *= 2;
+      values = realloc(values, values_capacity);
+    }
+    entries[count].key = index_key(value, length);
+    entries[count].id = serialized_row_id(row);
+    entries[count].offset = values_length;
+    entries[count].length = length;
+    memcpy(values + values_length, value, length);
+    values_length += length;
+    count++;
+    unpin_page(table->pager, cursor->page_num);
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+
+  qsort(entries, count, sizeof(IndexBuildEntry), compare_build_entries);
+  for (uint32_t i = 0; i < count; i++) {
+    index_add_entry(index, entries[i].id, values + entries[i].offset,
+                    entries[i].length);
+  }
+  free(entries);
+  free(values);
+}
+
+/*
+ * Executes a create index statement. The index is built from the rows that
+ * are in the table, and kept up to date by every statement after that.
+ */
+ExecuteResult execute_create_index(Statement *statement, Table *table) {
+  if (table->indexes[statement->column] != NULL) {
+    return EXECUTE_INDEX_EXISTS;
+  }
+  index_create(table, statement->column);
+  index_build(table, statement->column);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * Returns true if any column of TABLE has an index.
+ */
+bool table_has_indexes(Table *table) {
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    if (table->indexes[i] != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Adds ROW, which was inserted into TABLE, to the indexes of the table.
+ */
+void index_insert_row(Table *table, Row *row) {
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    if (table->indexes[i] != NULL) {
+      char *value = row_column(row, i);
+      index_add_entry(table->indexes[i], row->id, value, strlen(value));
+    }
+  }
+}
+
+/*
+ * Removes ROW, which was deleted from TABLE, from the indexes of the table.
+ */
+void index_remove_row(Table *table, Row *row) {
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    if (table->indexes[i] != NULL) {
+      char *value = row_column(row, i);
+      index_remove_entry(table->indexes[i], row->id, value, strlen(value));
+    }
+  }
+}
+
+/*
+ * Moves the entries of a row of TABLE that changed from OLD_ROW to NEW_ROW.
+ * Only the indexes on columns whose value changed are touched.
+ */
+void index_update_row(Table *table, Row *old_row, Row *new_row) {
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    char *old_value = row_column(old_row, i);
+    char *new_value = row_column(new_row, i);
+    if (table->indexes[i] == NULL || strcmp(old_value, new_value) == 0) {
+      continue;
+    }
+    index_remove_entry(table->indexes[i], old_row->id, old_value,
+                       strlen(old_value));
+    index_add_entry(table->indexes[i], new_row->id, new_value,
+                    strlen(new_value));
+  }
+}
+
+/*
+ * Appends to IDS the ids of the rows whose value in INDEX is VALUE, in
+ * ascending order. Returns the new count of IDS, which has room for CAPACITY
+ * and is grown as needed.
+ */
+static uint32_t index_find_ids(Table *index, const char *value,
+                               uint64_t **ids, uint32_t *capacity) {
+  Pager *pager = index->pager;
+  uint32_t length = strlen(value);
+  uint64_t key = index_key(value, length);
+  uint32_t count = 0;
+
+  Cursor *cursor = index_seek(index, key, 0);
+  while (true) {
+    void *node = get_page(pager, cursor->page_num);
+    if (cursor->cell_num >= *leaf_node_num_cells(node)) {
+      uint32_t next_page_num = *leaf_node_next_leaf(node);
+      unpin_page(pager, cursor->page_num);
+      if (next_page_num == 0) {
+        break;
+      }
+      cursor_enter_leaf(cursor, next_page_num);
+      continue;
+    }
+
+    void *cell = leaf_node_cell(node, cursor->cell_num);
+    if (serialized_row_id(cell) != key) {
+      unpin_page(pager, cursor->page_num);
+      break;
+    }
+    uint32_t cell_length;
+    char *cell_value = serialized_row_email(cell, &cell_length);
+    if (cell_length == length && memcmp(cell_value, value, length) == 0) {
+      if (count == *capacity) {
+        *capacity *= 2;
+        *ids = realloc(*ids, *capacity * sizeof(uint64_t));
+      }
+      (*ids)[count++] = index_entry_id(cell);
+    }
+    unpin_page(pager, cursor->page_num);
+    cursor->cell_num++;
+  }
+  cursor_close(cursor);
+  return count;
+}
+
+/*
+ * Writes the row at SOURCE to WRITER.
+ */
+static void write_row(ResultWriter *writer, void *source) {
+  uint32_t username_length;
+  uint32_t email_length;
+  char *username = serialized_row_username(source, &username_length);
+  char *email = serialized_row_email(source, &email_length);
+  result_writer_add_row(writer, serialized_row_id(source), username,
+                        username_length, email, email_length);
+}
+
+/*
+ * Executes a select of the rows whose column has a given value, in key order.
+ * With an index on the column, the ids of the rows come from the index and
+ * each row is then found by its id. Otherwise the whole table is scanned.
+ */
+ExecuteResult execute_select_by_column(Statement *statement, Table *table,
+                                       ResultWriter *writer) {
+  Column column = statement->column;
+  char *value = row_column(&statement->row_to_insert, column);
+  uint32_t length = strlen(value);
+  Table *index = table->indexes[column];
+
+  if (index == NULL) {
+    Cursor *cursor = table_start(table);
+    cursor->cold_scan = true;
+    while (!(cursor->end_of_table)) {
+      void *row = cursor_value(cursor);
+      uint32_t row_length;
+      char *row_value = serialized_row_column(row, column, &row_length);
+      if (row_length == length && memcmp(row_value, value, length) == 0) {
+        write_row(writer, row);
+      }
+      unpin_page(table->pager, cursor->page_num);
+      cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+    result_writer_end(writer);
+    return EXECUTE_SUCCESS;
+  }
+
+  uint32_t capacity = 16;
+  uint64_t *ids = malloc(capacity * sizeof(uint64_t));
+  uint32_t count = index_find_ids(index, value, &ids, &capacity);
+  for (uint32_t i = 0; i < count; i++) {
+    Row row;
+    if (table_lookup(table, ids[i], &row)) {
+      result_writer_add_row(writer, row.id, row.username,
+                            strlen(row.username), row.email, strlen(row.email));
+    }
+  }
+  free(ids);
+  result_writer_end(writer);
+  return EXECUTE_SUCCESS;
+}
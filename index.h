@@ -0,0 +1,24 @@
+/********************************************************************************
+ * index.h : Secondary indexes on the username and email columns
+ ********************************************************************************/
+#ifndef _INDEX_H
+#define _INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "internals.h"
+#include "output.h"
+#include "pager.h"
+#include "results.h"
+
+void index_build(Table* table, Column column);
+ExecuteResult execute_create_index(Statement* statement, Table* table);
+bool table_has_indexes(Table* table);
+void index_insert_row(Table* table, Row* row);
+void index_remove_row(Table* table, Row* row);
+void index_update_row(Table* table, Row* old_row, Row* new_row);
+ExecuteResult execute_select_by_column(Statement* statement, Table* table,
+                                       ResultWriter* writer);
+
+#endif
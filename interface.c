@@ -3,8 +3,10 @@
  ********************************************************************************/
 #include "interface.h"
 
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 /* 
  * Creates a new InputBuffer struct and initializes values.
@@ -34,6 +36,16 @@ void read_input(InputBuffer* input_buffer) {
   input_buffer->buffer[bytes_read - 1] = 0;
 }
 
+/*
+ * Returns true if more input can be read without waiting, which is the case
+ * when statements are piped in faster than they are executed. The end of input
+ * also counts, since it does not make the program wait either.
+ */
+bool input_pending() {
+  struct pollfd stdin_poll = {.fd = STDIN_FILENO, .events = POLLIN};
+  return poll(&stdin_poll, 1, 0) > 0;
+}
+
 /* 
  * Destroys a given InputBuffer and frees memory.
  */
@@ -46,10 +58,3 @@ void close_input_buffer(InputBuffer* input_buffer) {
  * Prompt for the database program.
  */
 void print_prompt() { printf("db > "); }
-
-/* 
- * Prints a given row.
- */
-void print_row(Row* row) {
-  printf("%d %s %s\n", row->id, row->username, row->email);
-}
@@ -4,6 +4,7 @@
 #ifndef _INTERFACE_H
 #define _INTERFACE_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 #include "internals.h"
@@ -21,9 +22,9 @@ typedef struct
 
 InputBuffer* new_input_buffer();
 void read_input(InputBuffer* input_buffer);
+bool input_pending();
 void close_input_buffer(InputBuffer* input_buffer);
 
 void print_prompt();
-void print_row(Row* row);
 
 #endif
@@ -12,20 +12,21 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "index.h"
 #include "interface.h"
 
 /*
  * Row layout
+ *
+ * Rows are stored in a compact form, key first: the id, then the username and
+ * the email, each as a one byte length followed by that many bytes. Neither
+ * string can be empty.
  */
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
-
-const uint32_t PAGE_SIZE = 4096; /* Arbitrary value */
+const uint32_t ROW_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t ROW_MIN_SIZE = ID_SIZE + 2 * (ROW_LENGTH_SIZE + 1);
+const uint32_t ROW_MAX_SIZE = ID_SIZE + ROW_LENGTH_SIZE + COLUMN_USERNAME_SIZE +
+                              ROW_LENGTH_SIZE + COLUMN_EMAIL_SIZE;
 
 /*
  * Common Node Header Layout
@@ -47,31 +48,27 @@ const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
     LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                       LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_CELL_CONTENT_START_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CELL_CONTENT_START_OFFSET =
+    LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE +
+    LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_CELL_CONTENT_START_SIZE;
 
 /*
  * Leaf Node Body Layout
  *
- * In the body of a leaf node, there will be an array of cells.
- * A cell is a key followed by its value.
- * (In this case, a serialized row)
- */
-const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET =
-    0; /* Offset 0 of the BODY, not counting the HEADER */
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET =
-    LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+ * The body is a slotted page. An array of cell pointers grows from the end of
+ * the header, one per cell in key order, each holding the offset of its cell
+ * in the page. The cells are packed from the end of the page towards the
+ * front, and cell_content_start is the offset of the lowest one.
+ * A cell is a serialized row, which starts with its key.
+ * The space for cells depends on the page size of the database file, so it is
+ * worked out by initialize_node_layout once the file is open.
+ */
+const uint32_t LEAF_NODE_CELL_POINTER_SIZE = sizeof(uint16_t);
+uint32_t LEAF_NODE_SPACE_FOR_CELLS;
+uint32_t LEAF_NODE_MAX_CELLS;
 
 /*
  * Internal Node Header Layout
@@ -80,287 +77,550 @@ const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
  * The cells go like [child, key],[child, key],.. etc. So the last remaining
  * child is tracked in the header. Internal nodes have 1 more child pointer than
  * the number of keys.
+ *
+ * Every key under an internal node lies between its fence keys, which are the
+ * keys its parent has to the left and to the right of it:
+ * lower_fence <= key <= upper_fence. The first and the last node of a level
+ * are bounded by 0 and UINT64_MAX instead. KEY_WIDTH is the number of bytes
+ * each key of the node is stored in.
  */
 const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
     INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
-const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                           INTERNAL_NODE_NUM_KEYS_SIZE +
-                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_LOWER_FENCE_SIZE = sizeof(uint64_t);
+const uint32_t INTERNAL_NODE_LOWER_FENCE_OFFSET =
+    INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_UPPER_FENCE_SIZE = sizeof(uint64_t);
+const uint32_t INTERNAL_NODE_UPPER_FENCE_OFFSET =
+    INTERNAL_NODE_LOWER_FENCE_OFFSET + INTERNAL_NODE_LOWER_FENCE_SIZE;
+const uint32_t INTERNAL_NODE_KEY_WIDTH_SIZE = sizeof(uint8_t);
+const uint32_t INTERNAL_NODE_KEY_WIDTH_OFFSET =
+    INTERNAL_NODE_UPPER_FENCE_OFFSET + INTERNAL_NODE_UPPER_FENCE_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE +
+    INTERNAL_NODE_RIGHT_CHILD_SIZE + INTERNAL_NODE_LOWER_FENCE_SIZE +
+    INTERNAL_NODE_UPPER_FENCE_SIZE + INTERNAL_NODE_KEY_WIDTH_SIZE;
 
 /*
  * Internal Node Body Layout
  *
  * It is an array of cells where each cell contains a child pointer and a key.
- * Key is the maximum key contained in the child to its left.
+ * No key in the child to the left of a key is larger than it, and every key
+ * in the children to its right is.
+ * A key is stored as its distance from the lower fence, in the fewest bytes
+ * that can hold the distance between the two fences. Nodes further down the
+ * tree cover narrower ranges of keys, so their keys are shorter and more
+ * children fit in them. INTERNAL_NODE_MAX_CELLS is the number of cells with
+ * keys of the full INTERNAL_NODE_KEY_SIZE.
  */
-const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint64_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE =
-    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
 
-/* Keeping this small for testing purposes */
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+uint32_t INTERNAL_NODE_MAX_CELLS;
+
+/*
+ * Returns the number of keys an internal node holds when they are KEY_WIDTH
+ * bytes each.
+ */
+static uint32_t internal_node_max_keys(uint32_t key_width) {
+  return (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE) /
+         (INTERNAL_NODE_CHILD_SIZE + key_width);
+}
+
+/*
+ * Sets the layout values that depend on PAGE_SIZE.
+ */
+void initialize_node_layout() {
+  LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+  LEAF_NODE_MAX_CELLS =
+      LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_CELL_POINTER_SIZE + ROW_MIN_SIZE);
+  INTERNAL_NODE_MAX_CELLS = internal_node_max_keys(INTERNAL_NODE_KEY_SIZE);
+}
 
 /* TODO : create a graphic illustrating the node memory structure */
 
 /*
  * Executes an insert statment, when the Statement and the Table is given.
+ * The row is added to the indexes of the table once it is in the table.
  */
 ExecuteResult execute_insert(Statement *statement, Table *table) {
-  void *node = get_page(table->pager, table->root_page_num);
-  uint32_t num_cells = (*leaf_node_num_cells(node));
-
   Row *row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  Cursor *cursor = table_find(table, key_to_insert);
+  uint64_t key_to_insert = row_to_insert->id;
+  uint32_t size = row_size(row_to_insert);
+  Cursor *cursor = table_find_append(table, key_to_insert, size);
+  if (cursor == NULL) {
+    cursor = table_find(table, key_to_insert);
+  }
+
+  void *node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = (*leaf_node_num_cells(node));
 
   if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+    uint64_t key_at_index = leaf_node_key(node, cursor->cell_num);
     if (key_at_index == key_to_insert) {
+      unpin_page(table->pager, cursor->page_num);
+      cursor_close(cursor);
       return EXECUTE_DUPLICATE_KEY;
     }
   }
+  unpin_page(table->pager, cursor->page_num);
 
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+  LatchedPath path;
+  table_latch_path(table, cursor->page_num, size, &path);
+  leaf_node_insert(cursor, row_to_insert);
+  table_unlatch_path(table, &path);
 
-  free(cursor);
+  cursor_close(cursor);
+  index_insert_row(table, row_to_insert);
 
   return EXECUTE_SUCCESS;
 }
 
 /*
  * Executes a select statement, when the Statement and Table is given.
+ * A select over the whole table starts a scan at the first leaf. Otherwise
+ * the cursor seeks to min_key and stops after max_key, so a lookup only reads
+ * the pages on the path to its key.
+ * Rows go to WRITER straight from the cells in the leaf pages, except for a
+ * select of a single id, which goes through table_lookup.
  */
-ExecuteResult execute_select(Statement *statement, Table *table) {
-  Row row;
-  Cursor *cursor = table_start(table);
+ExecuteResult execute_select(Statement *statement, Table *table,
+                             ResultWriter *writer) {
+  if (statement->match_column) {
+    return execute_select_by_column(statement, table, writer);
+  }
+
+  if (statement->min_key == statement->max_key) {
+    Row row;
+    if (table_lookup(table, statement->min_key, &row)) {
+      result_writer_add_row(writer, row.id, row.username,
+                            strlen(row.username), row.email, strlen(row.email));
+    }
+    result_writer_end(writer);
+    return EXECUTE_SUCCESS;
+  }
+
+  Cursor *cursor;
+  if (statement->min_key == 0) {
+    cursor = table_start(table);
+  } else {
+    cursor = table_seek(table, statement->min_key);
+  }
+  cursor->cold_scan = true;
 
   while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
+    void *value = cursor_value(cursor);
+    uint64_t id = serialized_row_id(value);
+    if (id > statement->max_key) {
+      unpin_page(table->pager, cursor->page_num);
+      break;
+    }
+    uint32_t username_length;
+    uint32_t email_length;
+    char *username = serialized_row_username(value, &username_length);
+    char *email = serialized_row_email(value, &email_length);
+    result_writer_add_row(writer, id, username, username_length, email,
+                          email_length);
+    unpin_page(table->pager, cursor->page_num);
+    if (id == statement->max_key) {
+      break;
+    }
     cursor_advance(cursor);
   }
 
-  free(cursor);
+  cursor_close(cursor);
+  result_writer_end(writer);
 
   return EXECUTE_SUCCESS;
 }
 
 /*
- * Opens a database connection. Intializes a table struct and its pager.
+ * Executes a delete statement, when the Statement and Table is given.
+ * The rows from min_key to max_key are deleted one leaf at a time, so each
+ * leaf is rebalanced once however many of its rows go. If the table has
+ * indexes, the rows are copied out first, so they can be removed from the
+ * indexes afterwards.
  */
-Table *db_open(const char *filename) {
-  Pager *pager = pager_open(filename);
+ExecuteResult execute_delete(Statement *statement, Table *table) {
+  uint64_t key = statement->min_key;
+  while (true) {
+    Cursor *cursor = table_seek(table, key);
+    if (cursor->end_of_table) {
+      cursor_close(cursor);
+      break;
+    }
 
-  /* There is no new_table method anymore. So this is where new tables are
-   * created. */
-  Table *table = malloc(sizeof(Table));
-  table->pager = pager;
-  table->root_page_num = 0;
+    void *node = get_page(table->pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t count = 0;
+    uint64_t last_key = 0;
+    while (cursor->cell_num + count < num_cells) {
+      uint64_t cell_key = leaf_node_key(node, cursor->cell_num + count);
+      if (cell_key > statement->max_key) {
+        break;
+      }
+      last_key = cell_key;
+      count++;
+    }
+    Row *rows = NULL;
+    if (count > 0 && table_has_indexes(table)) {
+      rows = malloc(count * sizeof(Row));
+      for (uint32_t i = 0; i < count; i++) {
+        deserialize_row(leaf_node_cell(node, cursor->cell_num + i), &rows[i]);
+      }
+    }
+    unpin_page(table->pager, cursor->page_num);
 
-  if (pager->num_pages == 0) {
-    // New database file. Page 0 should be a leaf node.
-    void *root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
+    if (count > 0) {
+      LatchedPath path;
+      table_latch_path(table, cursor->page_num, 0, &path);
+      leaf_node_delete(table, cursor->page_num, cursor->cell_num, count);
+      table_unlatch_path(table, &path);
+    }
+    if (rows != NULL) {
+      for (uint32_t i = 0; i < count; i++) {
+        index_remove_row(table, &rows[i]);
+      }
+      free(rows);
+    }
+    cursor_close(cursor);
+    if (count == 0 || last_key >= statement->max_key) {
+      break;
+    }
+    key = last_key + 1;
   }
 
-  return table;
+  return EXECUTE_SUCCESS;
 }
 
 /*
- * Closes the database connection.
- * The pages in the memory are flushed and written to disk.
- * Then the pager and table memories are freed.
+ * Executes an update statement, when the Statement and Table is given.
+ * The row is found with table_find and rewritten in its leaf, which is the
+ * only page that changes unless the row grew too large for the leaf. Then it
+ * is deleted and inserted again, which may split the leaf. With threads,
+ * readers may miss the row in between. Indexes on the columns that changed
+ * are updated afterwards.
  */
-void db_close(Table *table) {
-  Pager *pager = table->pager;
+ExecuteResult execute_update(Statement *statement, Table *table) {
+  Row *new_values = &(statement->row_to_insert);
+  Cursor *cursor = table_find(table, new_values->id);
+  uint32_t page_num = cursor->page_num;
+  uint32_t cell_num = cursor->cell_num;
+  void *node = get_page(table->pager, page_num);
 
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
-    }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+  if (cell_num >= *leaf_node_num_cells(node) ||
+      leaf_node_key(node, cell_num) != new_values->id) {
+    unpin_page(table->pager, page_num);
+    cursor_close(cursor);
+    return EXECUTE_KEY_NOT_FOUND;
   }
 
-  int result = close(pager->file_descriptor);
-  if (result == -1) {
-    /* TODO: move this error message elsewhere. */
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+  Row row;
+  deserialize_row(leaf_node_cell(node, cell_num), &row);
+  Row old_row = row;
+  if (statement->set_username) {
+    strcpy(row.username, new_values->username);
+  }
+  if (statement->set_email) {
+    strcpy(row.email, new_values->email);
   }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void *page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
-    }
+  uint32_t old_size = serialized_row_size(leaf_node_cell(node, cell_num));
+  if (leaf_node_free_space(node) + old_size >= row_size(&row)) {
+    leaf_node_replace_row(node, cell_num, &row);
+    mark_page_dirty(table->pager, page_num);
+    unpin_page(table->pager, page_num);
+  } else {
+    unpin_page(table->pager, page_num);
+    LatchedPath path;
+    table_latch_path(table, page_num, 0, &path);
+    leaf_node_delete(table, page_num, cell_num, 1);
+    table_unlatch_path(table, &path);
+    cursor_close(cursor);
+
+    cursor = table_find(table, row.id);
+    table_latch_path(table, cursor->page_num, row_size(&row), &path);
+    leaf_node_insert(cursor, &row);
+    table_unlatch_path(table, &path);
   }
-  free(pager);
-  free(table);
+
+  cursor_close(cursor);
+  index_update_row(table, &old_row, &row);
+  return EXECUTE_SUCCESS;
 }
 
 /*
- * Copies a given Row to memory.
+ * Opens the tree whose root is at ROOT_PAGE_NUM of PAGER as a Table. It has no
+ * name or indexes until the caller gives it some.
  */
-void serialize_row(Row *source, void *destination) {
-  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-  memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-  memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+Table *table_open(Pager *pager, uint32_t root_page_num) {
+  Table *table = malloc(sizeof(Table));
+  table->name[0] = '\0';
+  table->root_page_num = root_page_num;
+  table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+  table->pager = pager;
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    table->indexes[i] = NULL;
+  }
+  return table;
 }
 
 /*
- * Retrieves a Row from a given memory location.
+ * Frees TABLE and its indexes. Their pages stay as they are.
  */
-void deserialize_row(void *source, Row *destination) {
-  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+void table_close(Table *table) {
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    if (table->indexes[i] != NULL) {
+      table_close(table->indexes[i]);
+    }
+  }
+  free(table);
 }
 
 /*
- * Creates a pager and initializes its values.
- * All the pages in the pager are set to null.
- * They are only loaded to memory when requested, to keep resource usage low.
+ * Creates a new tree, whose root starts out as an empty leaf, and returns the
+ * page of the root. The root stays on that page for good.
  */
-Pager *pager_open(const char *filename) {
-  int fd = open(filename,
-                O_RDWR |     /* Read/Write mode */
-                    O_CREAT, /* Create file if it does not exist */
-                S_IWUSR |    /* User write permission */
-                    S_IRUSR  /* User read permission */
-
-  );
+uint32_t create_tree(Pager *pager) {
+  uint32_t root_page_num = get_unused_page_num(pager, 0);
+  void *root = get_page(pager, root_page_num);
+  initialize_leaf_node(root);
+  set_node_root(root, true);
+  mark_page_dirty(pager, root_page_num);
+  unpin_page(pager, root_page_num);
+  return root_page_num;
+}
 
-  /*
-   * TODO: move this error message elsewhere.
-   * Return an error from an enum and catch it in a switch like
-   * other errors.
-   */
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
+/*
+ * Puts every page of the tree under PAGE_NUM on the free list.
+ */
+void free_tree(Pager *pager, uint32_t page_num) {
+  void *node = get_page(pager, page_num);
+  uint32_t num_children = 0;
+  uint32_t *children = NULL;
+  if (get_node_type(node) == NODE_INTERNAL) {
+    num_children = *internal_node_num_keys(node) + 1;
+    children = malloc(num_children * sizeof(uint32_t));
+    for (uint32_t i = 0; i < num_children; i++) {
+      children[i] = *internal_node_child(node, i);
+    }
   }
+  unpin_page(pager, page_num);
 
-  off_t file_length = lseek(fd, 0, SEEK_END);
-
-  Pager *pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = (file_length / PAGE_SIZE);
-
-  if (file_length % PAGE_SIZE != 0) {
-    /* TODO: move this error message elsewhere */
-    printf("Partial page found. Db file should contain a whole number of "
-           "pages. Corrupted file.\n");
-    exit(EXIT_FAILURE);
+  for (uint32_t i = 0; i < num_children; i++) {
+    free_tree(pager, children[i]);
   }
+  free(children);
+  pager_free_page(pager, page_num);
+}
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
-  }
+/*
+ * Number of bytes the serialized form of ROW takes.
+ */
+uint32_t row_size(Row *row) {
+  return ID_SIZE + ROW_LENGTH_SIZE + strlen(row->username) + ROW_LENGTH_SIZE +
+         strlen(row->email);
+}
 
-  return pager;
+/*
+ * Copies a given Row to memory, in the compact form.
+ */
+void serialize_row(Row *source, void *destination) {
+  uint8_t username_length = strlen(source->username);
+  uint8_t email_length = strlen(source->email);
+  memcpy(destination, &(source->id), ID_SIZE);
+  destination += ID_SIZE;
+  *(uint8_t *)destination = username_length;
+  memcpy(destination + ROW_LENGTH_SIZE, source->username, username_length);
+  destination += ROW_LENGTH_SIZE + username_length;
+  *(uint8_t *)destination = email_length;
+  memcpy(destination + ROW_LENGTH_SIZE, source->email, email_length);
 }
 
 /*
- * Returns the page with the given page number from a pager.
- * If the page is not in the cache (in-memory), reads it from disk.
- * If the requested page number is not found in the file, it allocates a new
- * blank page. This blank page will not be persisted to the disk until
- * flushed.(eg: using db_close())
+ * Retrieves a Row from a given memory location.
  */
-void *get_page(Pager *pager, uint32_t page_num) {
-  /* TODO: Move this error message elsewhere */
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds: %d > %d\n", page_num,
-           TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
-  }
+void deserialize_row(void *source, Row *destination) {
+  uint32_t username_length;
+  uint32_t email_length;
+  char *username = serialized_row_username(source, &username_length);
+  char *email = serialized_row_email(source, &email_length);
+  destination->id = serialized_row_id(source);
+  memcpy(destination->username, username, username_length);
+  destination->username[username_length] = '\0';
+  memcpy(destination->email, email, email_length);
+  destination->email[email_length] = '\0';
+}
 
-  if (pager->pages[page_num] == NULL) {
-    /* Cache miss. Allocate memory for page and read from file. */
-    void *page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
-
-    /*
-     * There might be a partially filled page at the end of the file.
-     * It should be counted as well.
-     */
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
-
-    /*
-     * If the requested page has been used before, load it to memory.
-     * Otherwise we can return the already allocated blank page.
-     */
-    if (page_num <= num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read == -1) {
-        /* TODO: move this error message elsewhere */
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    }
+/*
+ * The fields of a serialized row at SOURCE can be read in place. The strings
+ * are not NUL terminated, their lengths are stored in LENGTH.
+ */
+uint64_t serialized_row_id(void *source) {
+  uint64_t id;
+  memcpy(&id, source, ID_SIZE);
+  return id;
+}
 
-    pager->pages[page_num] = page;
+char *serialized_row_username(void *source, uint32_t *length) {
+  *length = *(uint8_t *)(source + ID_SIZE);
+  return source + ID_SIZE + ROW_LENGTH_SIZE;
+}
 
-    /*
-     * If the requested page is a new page, update the pagers total accordingly.
-     */
-    if (page_num >= pager->num_pages) {
-      pager->num_pages = page_num + 1;
-    }
-  }
+char *serialized_row_email(void *source, uint32_t *length) {
+  uint32_t username_length = *(uint8_t *)(source + ID_SIZE);
+  void *email_field = source + ID_SIZE + ROW_LENGTH_SIZE + username_length;
+  *length = *(uint8_t *)email_field;
+  return email_field + ROW_LENGTH_SIZE;
+}
 
-  return pager->pages[page_num];
+/*
+ * Number of bytes the serialized row at SOURCE takes.
+ */
+uint32_t serialized_row_size(void *source) {
+  uint32_t email_length;
+  char *email = serialized_row_email(source, &email_length);
+  return (email - (char *)source) + email_length;
 }
 
 /*
- * New pages will be added at the end of file.
- * TODO: check for free pages and recycle.
+ * Creates a cursor on CELL_NUM of leaf PAGE_NUM.
  */
-uint32_t get_unused_page_num(Pager *pager) { return pager->num_pages; }
+static Cursor *create_cursor(Table *table, uint32_t page_num,
+                             uint32_t cell_num) {
+  Cursor *cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->page_num = page_num;
+  cursor->cell_num = cell_num;
+  cursor->end_of_table = false;
+  cursor->read_ahead = CURSOR_START_READ_AHEAD;
+  cursor->read_ahead_covered = 0;
+  cursor->wasted_reads_seen = pager_wasted_reads(table->pager);
+  cursor->cold_scan = false;
+  cursor->leaf_is_cold = false;
+  cursor->latched = false;
+  return cursor;
+}
 
 /*
- * Writes the PAGE_NUM of PAGER to file.
+ * Appends the children of internal NODE from FIRST_CHILD on to PAGE_NUMS,
+ * which holds COUNT page numbers and has room for MAX_COUNT. Returns the new
+ * count.
  */
-void pager_flush(Pager *pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    /* TODO: move this error message elsewhere */
-    printf("Tried to flush null page.\n");
-    exit(EXIT_FAILURE);
+static uint32_t append_children(void *node, uint32_t first_child,
+                                uint32_t *page_nums, uint32_t count,
+                                uint32_t max_count) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = first_child; i <= num_keys && count < max_count; i++) {
+    page_nums[count++] = *internal_node_child(node, i);
   }
+  return count;
+}
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+/*
+ * Fills PAGE_NUMS with up to MAX_COUNT leaves that follow LEAF_PAGE_NUM in the
+ * leaf chain and returns how many it found. They are taken from the parent of
+ * the leaf and, once those run out, from the next sibling of the parent. Unlike
+ * following next_leaf, this knows all of them before any has been read.
+ * The leaf must be latched. The nodes above it are latched bottom up, against
+ * the order of a descent, so a node the writer holds ends the search instead
+ * of waiting for it.
+ */
+static uint32_t find_next_leaves(Pager *pager, uint32_t leaf_page_num,
+                                 uint32_t *page_nums, uint32_t max_count) {
+  void *leaf = get_page(pager, leaf_page_num);
+  bool is_root = is_node_root(leaf);
+  uint32_t num_cells = *leaf_node_num_cells(leaf);
+  uint64_t key = num_cells > 0 ? leaf_node_key(leaf, 0) : 0;
+  uint32_t parent_page_num = *node_parent(leaf);
+  unpin_page(pager, leaf_page_num);
+  if (is_root || num_cells == 0) {
+    return 0;
+  }
 
-  if (offset == -1) {
-    /* TODO: move this error message elsewhere */
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
+  void *parent = try_get_page_latched(pager, parent_page_num);
+  if (parent == NULL) {
+    return 0;
+  }
+  uint32_t count = 0;
+  uint32_t index = internal_node_find_child(parent, key);
+  if (*internal_node_child(parent, index) != leaf_page_num) {
+    /* Should not happen, but reading ahead is only a hint */
+    unlatch_page(pager, parent_page_num);
+    return 0;
+  }
+  count = append_children(parent, index + 1, page_nums, count, max_count);
+  bool parent_is_root = is_node_root(parent);
+  uint32_t grandparent_page_num = *node_parent(parent);
+  if (count == max_count || parent_is_root) {
+    unlatch_page(pager, parent_page_num);
+    return count;
+  }
+
+  void *grandparent = try_get_page_latched(pager, grandparent_page_num);
+  unlatch_page(pager, parent_page_num);
+  if (grandparent == NULL) {
+    return count;
+  }
+  uint32_t parent_index = internal_node_find_child(grandparent, key);
+  uint32_t uncle_page_num = INVALID_PAGE_NUM;
+  if (parent_index < *internal_node_num_keys(grandparent)) {
+    uncle_page_num = *internal_node_child(grandparent, parent_index + 1);
+  }
+  void *uncle = NULL;
+  if (uncle_page_num != INVALID_PAGE_NUM) {
+    uncle = try_get_page_latched(pager, uncle_page_num);
+  }
+  unlatch_page(pager, grandparent_page_num);
+  if (uncle != NULL) {
+    count = append_children(uncle, 0, page_nums, count, max_count);
+    unlatch_page(pager, uncle_page_num);
   }
+  return count;
+}
 
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+/*
+ * Reads the leaves after the one CURSOR just entered ahead, read_ahead of
+ * them at a time, and adapts read_ahead to the pace of the scan. A scan that
+ * reaches a leaf whose read is still running is faster than the reads, so it
+ * asks for more leaves at a time. If pages read ahead were evicted before
+ * anyone got to them, the reads are too far ahead and it asks for fewer.
+ */
+static void cursor_read_ahead(Cursor *cursor) {
+  Pager *pager = cursor->table->pager;
+  PageStatus status = pager_page_status(pager, cursor->page_num);
+  if (cursor->read_ahead_covered > 0) {
+    cursor->read_ahead_covered--;
+  }
 
-  if (bytes_written == -1) {
-    /* TODO: move this error message elsewhere */
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
+  uint64_t num_wasted_reads = pager_wasted_reads(pager);
+  if (num_wasted_reads != cursor->wasted_reads_seen) {
+    cursor->wasted_reads_seen = num_wasted_reads;
+    if (cursor->read_ahead > CURSOR_MIN_READ_AHEAD) {
+      cursor->read_ahead /= 2;
+    }
+  } else if (status == PAGE_READING &&
+             cursor->read_ahead < CURSOR_MAX_READ_AHEAD) {
+    cursor->read_ahead *= 2;
   }
+  cursor->leaf_is_cold = cursor->cold_scan && status != PAGE_CACHED;
+
+  /* Ask for more once half of what was asked for has been used. */
+  if (cursor->read_ahead_covered > cursor->read_ahead / 2) {
+    return;
+  }
+  uint32_t page_nums[CURSOR_MAX_READ_AHEAD];
+  uint32_t count = find_next_leaves(pager, cursor->page_num, page_nums,
+                                    cursor->read_ahead);
+  cursor->read_ahead_covered = pager_read_pages(pager, page_nums, count);
 }
 
 /*
  * Creates a cursor pointing to the start of the table, which is
- * key 0 or the start of the leftmost node.
+ * key 0 or the start of the leftmost node. The cursor is meant for a scan, so
+ * the leaves after the first one are read ahead.
  */
 Cursor *table_start(Table *table) {
   Cursor *cursor = table_find(table, 0);
@@ -368,7 +628,11 @@ Cursor *table_start(Table *table) {
   void *node = get_page(table->pager, cursor->page_num);
   uint32_t num_cells = *leaf_node_num_cells(node);
   cursor->end_of_table = (num_cells == 0);
+  unpin_page(table->pager, cursor->page_num);
 
+  if (!cursor->end_of_table) {
+    cursor_read_ahead(cursor);
+  }
   return cursor;
 }
 
@@ -376,29 +640,88 @@ Cursor *table_start(Table *table) {
  * Return a cursor bearing the position of KEY.
  * If KEY is not present in TABLE, return the position where
  * it should be inserted.
+ * The nodes on the way down are latched shared, see internal_node_find.
  */
-Cursor *table_find(Table *table, uint32_t key) {
+Cursor *table_find(Table *table, uint64_t key) {
   uint32_t root_page_num = table->root_page_num;
-  void *root_node = get_page(table->pager, root_page_num);
+  void *root_node = get_page_latched(table->pager, root_page_num, LATCH_SHARED);
 
   if (get_node_type(root_node) == NODE_LEAF) {
-    return leaf_node_find(table, root_page_num, key);
+    return leaf_node_find(table, root_page_num, root_node, key);
   } else {
-    return internal_node_find(table, root_page_num, key);
+    return internal_node_find(table, root_page_num, root_node, key);
+  }
+}
+
+/*
+ * Returns a cursor to the end of the table if KEY is larger than every key in
+ * it, which is what an auto-incremented id looks like. The cached rightmost
+ * leaf saves the descent from the root. Returns NULL if KEY belongs anywhere
+ * else, or the cached page is no longer the rightmost leaf. A leaf without
+ * room for a cell of SIZE bytes is left to table_find as well, since its
+ * split changes the nodes above it.
+ * Only for the writer, which keeps rightmost_leaf_page_num up to date.
+ */
+Cursor *table_find_append(Table *table, uint64_t key, uint32_t size) {
+  uint32_t page_num = table->rightmost_leaf_page_num;
+  if (page_num == INVALID_PAGE_NUM) {
+    return NULL;
+  }
+
+  void *node = get_page(table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  bool is_append =
+      get_node_type(node) == NODE_LEAF && *leaf_node_next_leaf(node) == 0 &&
+      num_cells > 0 && key > leaf_node_key(node, num_cells - 1) &&
+      leaf_node_free_space(node) >= size + LEAF_NODE_CELL_POINTER_SIZE;
+  unpin_page(table->pager, page_num);
+  if (!is_append) {
+    return NULL;
   }
+
+  Cursor *cursor = create_cursor(table, page_num, num_cells);
+  cursor->end_of_table = true;
+  return cursor;
+}
+
+/*
+ * Returns a cursor on the first row with a key of KEY or more. Unlike
+ * table_find, the cursor never points past the last cell of a leaf that is
+ * followed by another one.
+ */
+Cursor *table_seek(Table *table, uint64_t key) {
+  Cursor *cursor = table_find(table, key);
+
+  void *node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t next_page_num = *leaf_node_next_leaf(node);
+  unpin_page(table->pager, cursor->page_num);
+
+  if (cursor->cell_num >= num_cells) {
+    if (next_page_num == 0) {
+      cursor->end_of_table = true;
+    } else {
+      cursor_enter_leaf(cursor, next_page_num);
+    }
+  }
+
+  return cursor;
 }
 
 /*
  * Calculates the memory location for a row, when a cursor is given.
+ * The page stays pinned, the caller has to unpin cursor->page_num once done
+ * with the value.
  */
 void *cursor_value(Cursor *cursor) {
   uint32_t page_num = cursor->page_num;
   void *page = get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num);
+  return leaf_node_cell(page, cursor->cell_num);
 }
 
 /*
  * Advances a cursor by one row.
+ * Leaving a leaf the scan brought in lets the buffer pool drop it first.
  */
 void cursor_advance(Cursor *cursor) {
   uint32_t page_num = cursor->page_num;
@@ -412,22 +735,52 @@ void cursor_advance(Cursor *cursor) {
       /* Means we are at the rightmost leaf */
       cursor->end_of_table = true;
     } else {
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
+      cursor_enter_leaf(cursor, next_page_num);
+      if (cursor->leaf_is_cold) {
+        pager_mark_cold(cursor->table->pager, page_num);
+      }
+      cursor_read_ahead(cursor);
     }
   }
+  unpin_page(cursor->table->pager, page_num);
+}
+
+/*
+ * Moves CURSOR to the first cell of leaf PAGE_NUM, which follows its leaf. A
+ * cursor that holds its leaf latches the next one before it lets go, so the
+ * writer cannot merge or split the two in between.
+ */
+void cursor_enter_leaf(Cursor *cursor, uint32_t page_num) {
+  if (cursor->latched) {
+    Pager *pager = cursor->table->pager;
+    get_page_latched(pager, page_num, LATCH_SHARED);
+    unlatch_page(pager, cursor->page_num);
+  }
+  cursor->page_num = page_num;
+  cursor->cell_num = 0;
+}
+
+/*
+ * Frees CURSOR, after letting go of its leaf if it holds it.
+ */
+void cursor_close(Cursor *cursor) {
+  if (cursor->latched) {
+    unlatch_page(cursor->table->pager, cursor->page_num);
+  }
+  free(cursor);
 }
 
 /*
  * Prints important constants.
  */
 void print_constants() {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
+  printf("ROW_MAX_SIZE: %d\n", ROW_MAX_SIZE);
   printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
   printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+  printf("LEAF_NODE_CELL_POINTER_SIZE: %d\n", LEAF_NODE_CELL_POINTER_SIZE);
   printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
   printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+  printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS);
 }
 
 /********************************************************************************
@@ -445,25 +798,43 @@ uint32_t *leaf_node_num_cells(void *node) {
   return node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
 
+/*
+ * Returns a pointer to the offset of the first cell in use in NODE.
+ */
+uint32_t *leaf_node_cell_content_start(void *node) {
+  return node + LEAF_NODE_CELL_CONTENT_START_OFFSET;
+}
+
+/*
+ * Returns a pointer to the cell pointer of CELL_NUM in NODE.
+ */
+uint16_t *leaf_node_cell_pointer(void *node, uint32_t cell_num) {
+  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_POINTER_SIZE;
+}
+
 /*
  * Returns a pointer to the cell at CELL_NUM of NODE.
  */
 void *leaf_node_cell(void *node, uint32_t cell_num) {
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+  return node + *leaf_node_cell_pointer(node, cell_num);
 }
 
 /*
- * Returns a pointer to the key of the cell at CELL_NUM of NODE.
+ * Returns the key of the cell at CELL_NUM of NODE.
  */
-uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num);
+uint64_t leaf_node_key(void *node, uint32_t cell_num) {
+  return serialized_row_id(leaf_node_cell(node, cell_num));
 }
 
 /*
- * Returns a pointer to the value of the cell at CELL_NUM of NODE.
+ * Returns the number of bytes between the cell pointers and the cells of
+ * NODE. A new cell needs room for itself and its pointer.
  */
-void *leaf_node_value(void *node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+uint32_t leaf_node_free_space(void *node) {
+  uint32_t pointers_end =
+      LEAF_NODE_HEADER_SIZE +
+      *leaf_node_num_cells(node) * LEAF_NODE_CELL_POINTER_SIZE;
+  return *leaf_node_cell_content_start(node) - pointers_end;
 }
 
 /*
@@ -475,56 +846,134 @@ void initialize_leaf_node(void *node) {
   set_node_root(node, false);
   *leaf_node_num_cells(node) = 0;
   *leaf_node_next_leaf(node) =
-      0; /* 0 means no next leaf, since its the number of the root node. */
+      0; /* 0 means no next leaf, since page 0 holds the file header. */
+  *leaf_node_cell_content_start(node) = PAGE_SIZE;
 }
 
 /*
- * Inserts a KEY/VALUE pair to a node at position given by CURSOR.
- * If the position is taken, shifts cells to make space.
+ * Makes room for a cell of SIZE bytes at CELL_NUM of NODE, shifting the
+ * pointers of the cells after it, and returns where the cell goes. NODE must
+ * have enough free space.
  */
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
-  void *node = get_page(cursor->table->pager, cursor->page_num);
-
+static void *leaf_node_make_cell(void *node, uint32_t cell_num,
+                                 uint32_t size) {
   uint32_t num_cells = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    leaf_node_split_and_insert(cursor, key, value);
+  memmove(leaf_node_cell_pointer(node, cell_num + 1),
+          leaf_node_cell_pointer(node, cell_num),
+          (num_cells - cell_num) * LEAF_NODE_CELL_POINTER_SIZE);
+
+  uint32_t offset = *leaf_node_cell_content_start(node) - size;
+  *leaf_node_cell_content_start(node) = offset;
+  *leaf_node_cell_pointer(node, cell_num) = offset;
+  *leaf_node_num_cells(node) = num_cells + 1;
+  return node + offset;
+}
+
+/*
+ * Serializes ROW into a new cell at CELL_NUM of NODE, which must have room
+ * for it.
+ */
+void leaf_node_insert_row(void *node, uint32_t cell_num, Row *row) {
+  serialize_row(row, leaf_node_make_cell(node, cell_num, row_size(row)));
+}
+
+/*
+ * Empties leaf NODE, keeping the rest of its header.
+ */
+static void leaf_node_clear_cells(void *node) {
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_cell_content_start(node) = PAGE_SIZE;
+}
+
+/*
+ * Appends COUNT cells of leaf SOURCE, starting at FIRST, to leaf NODE.
+ */
+static void leaf_node_append_cells(void *node, void *source, uint32_t first,
+                                   uint32_t count) {
+  for (uint32_t i = first; i < first + count; i++) {
+    void *cell = leaf_node_cell(source, i);
+    uint32_t size = serialized_row_size(cell);
+    memcpy(leaf_node_make_cell(node, *leaf_node_num_cells(node), size), cell,
+           size);
+  }
+}
+
+/*
+ * Replaces the cell at CELL_NUM of NODE with ROW, which has the same key. A
+ * row of the same size is written over the old one. Otherwise the cells are
+ * packed again around the new one, so NODE must have room for the difference.
+ */
+void leaf_node_replace_row(void *node, uint32_t cell_num, Row *row) {
+  void *cell = leaf_node_cell(node, cell_num);
+  if (serialized_row_size(cell) == row_size(row)) {
+    serialize_row(row, cell);
     return;
   }
 
-  if (cursor->cell_num < num_cells) {
-    /* Make space for new cell */
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
-    }
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  void *old_cells = malloc(PAGE_SIZE);
+  memcpy(old_cells, node, PAGE_SIZE);
+  leaf_node_clear_cells(node);
+  leaf_node_append_cells(node, old_cells, 0, cell_num);
+  leaf_node_insert_row(node, cell_num, row);
+  leaf_node_append_cells(node, old_cells, cell_num + 1,
+                         num_cells - cell_num - 1);
+  free(old_cells);
+}
+
+/*
+ * Inserts VALUE, keyed by its id, to a node at position given by CURSOR.
+ * If the position is taken, shifts cells to make space.
+ */
+void leaf_node_insert(Cursor *cursor, Row *value) {
+  uint8_t cell[ROW_MAX_SIZE];
+  serialize_row(value, cell);
+  leaf_node_insert_cell(cursor, cell, row_size(value));
+}
+
+/*
+ * Inserts CELL of SIZE bytes, which is laid out like a serialized row, at the
+ * position given by CURSOR. A leaf without room for it is split.
+ */
+void leaf_node_insert_cell(Cursor *cursor, void *cell, uint32_t size) {
+  void *node = get_page(cursor->table->pager, cursor->page_num);
+
+  if (leaf_node_free_space(node) < size + LEAF_NODE_CELL_POINTER_SIZE) {
+    unpin_page(cursor->table->pager, cursor->page_num);
+    leaf_node_split_and_insert(cursor, cell, size);
+    return;
   }
 
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+  memcpy(leaf_node_make_cell(node, cursor->cell_num, size), cell, size);
+  mark_page_dirty(cursor->table->pager, cursor->page_num);
+  unpin_page(cursor->table->pager, cursor->page_num);
 }
 
 /*
- * Returns a Cursor pointing to the given KEY in TABLE's PAGE_NUM.
+ * Returns a Cursor pointing to the given KEY in leaf NODE, which is TABLE's
+ * PAGE_NUM and was latched with get_page_latched by the caller.
  * If KEY is not found, the Cursor will point to where it should be.
+ * A reader's cursor holds on to the latch, see Cursor.
  */
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
-  void *node = get_page(table->pager, page_num);
+Cursor *leaf_node_find(Table *table, uint32_t page_num, void *node,
+                       uint64_t key) {
   uint32_t num_cells = *leaf_node_num_cells(node);
+  bool is_writer = pager_is_writer(table->pager);
+  if (*leaf_node_next_leaf(node) == 0 && is_writer) {
+    table->rightmost_leaf_page_num = page_num;
+  }
 
-  Cursor *cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = page_num;
+  Cursor *cursor = create_cursor(table, page_num, 0);
 
   // Binary search
   uint32_t min_index = 0;
   uint32_t max_index_plus_one = num_cells;
   while (max_index_plus_one != min_index) {
     uint32_t index = (min_index + max_index_plus_one) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
+    uint64_t key_at_index = leaf_node_key(node, index);
     if (key == key_at_index) {
-      cursor->cell_num = index;
-      return cursor;
+      min_index = index;
+      break;
     }
     if (key < key_at_index) {
       max_index_plus_one = index;
@@ -534,75 +983,104 @@ Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
   }
 
   cursor->cell_num = min_index;
+  if (is_writer) {
+    unlatch_page(table->pager, page_num);
+  } else {
+    cursor->latched = true;
+  }
   return cursor;
 }
 
 /*
- * Creates a new node and moves half the cells to it.
- * KEY/VALUE pair is inserted to one of the two nodes.
+ * Creates a new node and moves half the cells to it, by size.
+ * CELL of SIZE bytes is inserted to one of the two nodes.
  * Parent is updated or a new parent is created.
+ *
+ * Appending to the rightmost leaf is how increasing keys arrive. Then the old
+ * node stays full and KEY starts the new node on its own, instead of leaving
+ * a half empty leaf behind for good.
  */
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
-  void *old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(old_node);
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void *new_node = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node) == *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
-  // printf("[*] Split and insert running for key %d cursor cell num %d\n", key,
-  // cursor->cell_num);
-
-  /* Divide the keys between old (left) and new (right) nodes. */
-  for (uint32_t i = LEAF_NODE_MAX_CELLS; i > 0; i--) {
-    /* The loop used to have i >= 0 condition, but it caused an error */
-    void *destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-      destination_node = new_node;
-      //  printf("[*] Copying to new node. I = %d\n", i);
-    } else {
-      destination_node = old_node;
-      //  printf("[*] Copying to old node. I = %d\n", i);
-    }
+void leaf_node_split_and_insert(Cursor *cursor, void *cell, uint32_t size) {
+  Pager *pager = cursor->table->pager;
+  void *old_node = get_page(pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(old_node);
 
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    // printf("\t[*] To index %d\n", index_within_node);
-    void *destination = leaf_node_cell(destination_node, index_within_node);
+  /* Both nodes are rebuilt from a copy of the old one. */
+  void *old_cells = malloc(PAGE_SIZE);
+  memcpy(old_cells, old_node, PAGE_SIZE);
 
-    /*
-     * Copy the values to new locations.
-     */
+  /*
+   * Cell i of the split is the new cell if it is at the cursor, otherwise one
+   * of the old cells.
+   */
+  uint32_t cell_sizes[LEAF_NODE_MAX_CELLS + 1];
+  uint32_t total_size = 0;
+  for (uint32_t i = 0; i <= num_cells; i++) {
     if (i == cursor->cell_num) {
-      // printf("\t[*] Target cell found. Serializing.\n");
-      serialize_row(value,
-                    leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
-    } else if (i > cursor->cell_num) {
-      // printf("\t[*] Copying key %d from old node to %d\n",
-      // *leaf_node_key(old_node, i - 1), index_within_node);
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+      cell_sizes[i] = size;
     } else {
-      // printf("\t[*] Copying key %d from old node to %d\n",
-      // *leaf_node_key(old_node, i), index_within_node);
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+      uint32_t old_cell_num = i < cursor->cell_num ? i : i - 1;
+      cell_sizes[i] = serialized_row_size(leaf_node_cell(old_cells, old_cell_num));
     }
+    cell_sizes[i] += LEAF_NODE_CELL_POINTER_SIZE;
+    total_size += cell_sizes[i];
   }
 
-  /* Update cell counts */
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+  uint32_t left_split_count = 0;
+  if (*leaf_node_next_leaf(old_node) == 0 && cursor->cell_num == num_cells) {
+    left_split_count = num_cells;
+  } else {
+    uint32_t left_size = 0;
+    while (left_split_count < num_cells && left_size < total_size / 2) {
+      left_size += cell_sizes[left_split_count++];
+    }
+    if (left_split_count == 0) {
+      left_split_count = 1;
+    }
+  }
+
+  uint32_t new_page_num = get_unused_page_num(pager, cursor->page_num);
+  void *new_node = get_page(pager, new_page_num);
+  initialize_leaf_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+
+  bool was_root = is_node_root(old_node);
+  uint32_t parent_page_num = *node_parent(old_node);
+  initialize_leaf_node(old_node);
+  set_node_root(old_node, was_root);
+  *node_parent(old_node) = parent_page_num;
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  /* Divide the cells between old (left) and new (right) nodes. */
+  for (uint32_t i = 0; i <= num_cells; i++) {
+    void *destination_node = i < left_split_count ? old_node : new_node;
+    uint32_t index_within_node =
+        i < left_split_count ? i : i - left_split_count;
+
+    uint32_t cell_size = cell_sizes[i] - LEAF_NODE_CELL_POINTER_SIZE;
+    void *source = cell;
+    if (i != cursor->cell_num) {
+      uint32_t old_cell_num = i < cursor->cell_num ? i : i - 1;
+      source = leaf_node_cell(old_cells, old_cell_num);
+    }
+    memcpy(leaf_node_make_cell(destination_node, index_within_node, cell_size),
+           source, cell_size);
+  }
+  free(old_cells);
+
+  uint64_t separator = leaf_node_key(old_node, left_split_count - 1);
+  mark_page_dirty(pager, cursor->page_num);
+  mark_page_dirty(pager, new_page_num);
+  unpin_page(pager, cursor->page_num);
+  unpin_page(pager, new_page_num);
 
   /* Update the parent, or create one */
-  if (is_node_root(old_node)) {
-    return create_new_root(cursor->table, new_page_num);
+  if (was_root) {
+    return create_new_root(cursor->table, separator, new_page_num);
   } else {
-    uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(old_node);
-    void *parent = get_page(cursor->table->pager, parent_page_num);
-
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    internal_node_insert(cursor->table, parent_page_num, cursor->page_num,
+                         separator, new_page_num);
     return;
   }
 }
@@ -629,10 +1107,55 @@ uint32_t *internal_node_right_child(void *node) {
 }
 
 /*
- * Returns a pointer to the page number of child with CELL_NUM of NODE
+ * Returns a pointer to the LOWER_FENCE of internal node NODE
+ */
+uint64_t *internal_node_lower_fence(void *node) {
+  return node + INTERNAL_NODE_LOWER_FENCE_OFFSET;
+}
+
+/*
+ * Returns a pointer to the UPPER_FENCE of internal node NODE
+ */
+uint64_t *internal_node_upper_fence(void *node) {
+  return node + INTERNAL_NODE_UPPER_FENCE_OFFSET;
+}
+
+/*
+ * Returns a pointer to the KEY_WIDTH of internal node NODE
+ */
+uint8_t *internal_node_key_width(void *node) {
+  return node + INTERNAL_NODE_KEY_WIDTH_OFFSET;
+}
+
+/*
+ * Returns the number of bytes needed for the keys of a node with fences LOWER
+ * and UPPER.
  */
-uint32_t *internal_node_cell(void *node, uint32_t cell_num) {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+static uint32_t key_width_for_fences(uint64_t lower, uint64_t upper) {
+  uint64_t range = upper - lower;
+  uint32_t width = 1;
+  while (width < INTERNAL_NODE_KEY_SIZE && (range >> (8 * width)) != 0) {
+    width++;
+  }
+  return width;
+}
+
+/*
+ * Returns true if COUNT children fit in an internal node with fences LOWER and
+ * UPPER.
+ */
+static bool internal_node_fits(uint32_t count, uint64_t lower,
+                               uint64_t upper) {
+  return count - 1 <= internal_node_max_keys(key_width_for_fences(lower, upper));
+}
+
+/*
+ * Returns a pointer to the cell with CELL_NUM of NODE, which starts with the
+ * page number of the child.
+ */
+void *internal_node_cell(void *node, uint32_t cell_num) {
+  uint32_t cell_size = INTERNAL_NODE_CHILD_SIZE + *internal_node_key_width(node);
+  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * cell_size;
 }
 
 /*
@@ -652,26 +1175,109 @@ uint32_t *internal_node_child(void *node, uint32_t child_num) {
 }
 
 /*
- * Returns a pointer to the key of KEY_NUM of NODE
+ * Reads the stored distance of a key from the lower fence out of CELL.
  */
-uint32_t *internal_node_key(void *node, uint32_t key_num) {
-  return (void *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+static uint64_t internal_node_cell_offset(void *cell, uint32_t key_width) {
+  uint8_t *bytes = cell + INTERNAL_NODE_CHILD_SIZE;
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < key_width; i++) {
+    offset |= (uint64_t)bytes[i] << (8 * i);
+  }
+  return offset;
 }
 
 /*
- * Intializes an internal node by setting its num_keys to 0 and is_root to false
+ * Returns the key of KEY_NUM of NODE
+ */
+uint64_t internal_node_key(void *node, uint32_t key_num) {
+  return *internal_node_lower_fence(node) +
+         internal_node_cell_offset(internal_node_cell(node, key_num),
+                                   *internal_node_key_width(node));
+}
+
+/*
+ * Sets the key of KEY_NUM of NODE to KEY, which has to lie between the fences
+ * of NODE.
+ */
+void internal_node_set_key(void *node, uint32_t key_num, uint64_t key) {
+  uint8_t *bytes = internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+  uint64_t offset = key - *internal_node_lower_fence(node);
+  for (uint32_t i = 0; i < *internal_node_key_width(node); i++) {
+    bytes[i] = (offset >> (8 * i)) & 0xff;
+  }
+}
+
+/*
+ * Intializes an internal node by setting its num_keys to 0 and is_root to false.
+ * Its fences cover all keys until the node gets a place in the tree.
  */
 void initialize_internal_node(void *node) {
   set_node_type(node, NODE_INTERNAL);
   set_node_root(node, false);
   *internal_node_num_keys(node) = 0;
+  *internal_node_lower_fence(node) = 0;
+  *internal_node_upper_fence(node) = UINT64_MAX;
+  *internal_node_key_width(node) = INTERNAL_NODE_KEY_SIZE;
 }
 
 /*
- * Return the index of the child which should contain the given key.
+ * Lays out the children of internal NODE in key order in CHILDREN and KEYS,
+ * with the upper fence as the key of the right child. Returns the number of
+ * children.
  */
-uint32_t internal_node_find_child(void *node, uint32_t key) {
+static uint32_t internal_node_gather(void *node, uint32_t *children,
+                                     uint64_t *keys) {
   uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    children[i] = *internal_node_child(node, i);
+    keys[i] = internal_node_key(node, i);
+  }
+  children[num_keys] = *internal_node_right_child(node);
+  keys[num_keys] = *internal_node_upper_fence(node);
+  return num_keys + 1;
+}
+
+/*
+ * Fills internal NODE with COUNT of CHILDREN and their KEYS, between fences
+ * LOWER and UPPER. The last child becomes the right child. The children have
+ * to fit, see internal_node_fits.
+ */
+static void internal_node_fill(void *node, uint32_t *children, uint64_t *keys,
+                               uint32_t count, uint64_t lower, uint64_t upper) {
+  *internal_node_lower_fence(node) = lower;
+  *internal_node_upper_fence(node) = upper;
+  *internal_node_key_width(node) = key_width_for_fences(lower, upper);
+  *internal_node_num_keys(node) = count - 1;
+  for (uint32_t i = 0; i < count - 1; i++) {
+    *internal_node_child(node, i) = children[i];
+    internal_node_set_key(node, i, keys[i]);
+  }
+  *internal_node_right_child(node) = children[count - 1];
+}
+
+/*
+ * Moves the fences of internal NODE to LOWER and UPPER, which must still hold
+ * all of its keys, and stores the keys again in the width that goes with them.
+ */
+void internal_node_set_fences(void *node, uint64_t lower, uint64_t upper) {
+  uint32_t count = *internal_node_num_keys(node) + 1;
+  uint32_t *children = malloc(count * sizeof(uint32_t));
+  uint64_t *keys = malloc(count * sizeof(uint64_t));
+  internal_node_gather(node, children, keys);
+  internal_node_fill(node, children, keys, count, lower, upper);
+  free(children);
+  free(keys);
+}
+
+/*
+ * Returns the index of the first of the NUM_KEYS keys of NODE, KEY_WIDTH
+ * bytes each, that lies OFFSET or more above the lower fence, or NUM_KEYS
+ * for the rightmost child. The header of NODE is not read, so the caller
+ * decides which values to trust.
+ */
+static uint32_t internal_node_search(void *node, uint64_t offset,
+                                     uint32_t num_keys, uint32_t key_width) {
+  uint32_t cell_size = INTERNAL_NODE_CHILD_SIZE + key_width;
 
   /* Binary search */
   uint32_t min_index = 0;
@@ -683,8 +1289,9 @@ uint32_t internal_node_find_child(void *node, uint32_t key) {
    */
   while (min_index != max_index) {
     uint32_t index = (min_index + max_index) / 2;
-    uint32_t key_to_right = *internal_node_key(node, index);
-    if (key_to_right >= key) {
+    void *cell = node + INTERNAL_NODE_HEADER_SIZE + index * cell_size;
+    uint64_t offset_to_right = internal_node_cell_offset(cell, key_width);
+    if (offset_to_right >= offset) {
       max_index = index;
     } else {
       min_index = index + 1;
@@ -695,80 +1302,723 @@ uint32_t internal_node_find_child(void *node, uint32_t key) {
 }
 
 /*
- * Returns a cursor to the position of KEY. If KEY is not found returns a
- * pointer to where it should be.
+ * Return the index of the child which should contain the given key.
+ * Only the stored distances from the lower fence are compared, so keys are
+ * not decoded while searching.
  */
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key) {
-  void *node = get_page(table->pager, page_num);
+uint32_t internal_node_find_child(void *node, uint64_t key) {
+  uint64_t lower_fence = *internal_node_lower_fence(node);
+  uint64_t offset = key > lower_fence ? key - lower_fence : 0;
+  return internal_node_search(node, offset, *internal_node_num_keys(node),
+                              *internal_node_key_width(node));
+}
+
+/*
+ * How a lookup that reads pages without latching them ended. Pages that are
+ * not in the pool, that the writer holds, or that changed after the snapshot
+ * of the lookup are left to table_find.
+ */
+typedef enum {
+  LOOKUP_FOUND,
+  LOOKUP_NOT_FOUND,
+  LOOKUP_RESTART,
+  LOOKUP_BLOCKED
+} LookupResult;
+
+/*
+ * Returns the offset of the cell at CELL_NUM of leaf NODE, or 0 if the cell,
+ * read while the writer may be changing NODE, runs off the page. SIZE gets
+ * the size of the row in the cell.
+ */
+static uint32_t leaf_node_checked_cell(void *node, uint32_t cell_num,
+                                       uint32_t *size) {
+  uint32_t offset = *leaf_node_cell_pointer(node, cell_num);
+  if (offset < LEAF_NODE_HEADER_SIZE ||
+      offset + ID_SIZE + ROW_LENGTH_SIZE > PAGE_SIZE) {
+    return 0;
+  }
+  uint32_t email_field = offset + ID_SIZE + ROW_LENGTH_SIZE +
+                         *(uint8_t *)(node + offset + ID_SIZE);
+  if (email_field + ROW_LENGTH_SIZE > PAGE_SIZE) {
+    return 0;
+  }
+  *size = email_field + ROW_LENGTH_SIZE + *(uint8_t *)(node + email_field) -
+          offset;
+  if (*size > ROW_MAX_SIZE || offset + *size > PAGE_SIZE) {
+    return 0;
+  }
+  return offset;
+}
+
+/*
+ * Looks KEY up in TABLE without pinning or latching a page. Every page is
+ * read between pager_read_begin and pager_read_validate, and a node is only
+ * trusted once the page it led to is known. Nothing read in between is
+ * used before it is checked to stay within the page, so a change by the
+ * writer at worst makes the lookup start over.
+ * A leaf has no upper fence, so a key beyond its last one is looked for in
+ * the next leaf too, in case a split moved it there after the parent was
+ * read.
+ */
+static LookupResult table_lookup_optimistic(Table *table, uint64_t key,
+                                            Row *row) {
+  Pager *pager = table->pager;
+  PageRead read;
+  void *node = pager_read_begin(pager, table->root_page_num, &read);
+  if (node == NULL) {
+    return LOOKUP_BLOCKED;
+  }
+
+  /* Pages the writer reused meanwhile could lead around in circles. */
+  uint32_t num_nodes = 1;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    if (num_nodes++ > LATCHED_PATH_MAX_NODES) {
+      return LOOKUP_RESTART;
+    }
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t key_width = *internal_node_key_width(node);
+    if (key_width == 0 || key_width > INTERNAL_NODE_KEY_SIZE ||
+        num_keys > internal_node_max_keys(key_width)) {
+      return LOOKUP_RESTART;
+    }
+    uint64_t lower_fence = *internal_node_lower_fence(node);
+    uint64_t offset = key > lower_fence ? key - lower_fence : 0;
+    uint32_t index = internal_node_search(node, offset, num_keys, key_width);
+    uint32_t child_page_num =
+        index == num_keys
+            ? *internal_node_right_child(node)
+            : *(uint32_t *)(node + INTERNAL_NODE_HEADER_SIZE +
+                            index * (INTERNAL_NODE_CHILD_SIZE + key_width));
+
+    PageRead child_read;
+    void *child = pager_read_begin(pager, child_page_num, &child_read);
+    if (!pager_read_validate(pager, &read)) {
+      return LOOKUP_RESTART;
+    }
+    if (child == NULL) {
+      return LOOKUP_BLOCKED;
+    }
+    node = child;
+    read = child_read;
+  }
 
+  while (true) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (get_node_type(node) != NODE_LEAF || num_cells > LEAF_NODE_MAX_CELLS ||
+        num_nodes++ > LATCHED_PATH_MAX_NODES) {
+      return LOOKUP_RESTART;
+    }
+
+    uint32_t min_index = 0;
+    uint32_t max_index = num_cells;
+    while (min_index != max_index) {
+      uint32_t index = (min_index + max_index) / 2;
+      uint32_t size;
+      uint32_t offset = leaf_node_checked_cell(node, index, &size);
+      if (offset == 0) {
+        return LOOKUP_RESTART;
+      }
+      uint64_t key_at_index = serialized_row_id(node + offset);
+      if (key == key_at_index) {
+        uint8_t cell[ROW_MAX_SIZE];
+        memcpy(cell, node + offset, size);
+        if (!pager_read_validate(pager, &read)) {
+          return LOOKUP_RESTART;
+        }
+        deserialize_row(cell, row);
+        return LOOKUP_FOUND;
+      }
+      if (key < key_at_index) {
+        max_index = index;
+      } else {
+        min_index = index + 1;
+      }
+    }
+
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (min_index < num_cells || next_page_num == 0) {
+      return pager_read_validate(pager, &read) ? LOOKUP_NOT_FOUND
+                                               : LOOKUP_RESTART;
+    }
+    PageRead next_read;
+    void *next = pager_read_begin(pager, next_page_num, &next_read);
+    if (!pager_read_validate(pager, &read)) {
+      return LOOKUP_RESTART;
+    }
+    if (next == NULL) {
+      return LOOKUP_BLOCKED;
+    }
+    node = next;
+    read = next_read;
+  }
+}
+
+/*
+ * Looks KEY up in TABLE and copies its row to ROW. Returns whether it is
+ * there.
+ * Lookups first read pages without latching them, and start over if the
+ * writer changed one meanwhile. After LOOKUP_MAX_RESTARTS tries, or when a
+ * page has to be read in or waited for, the lookup goes down with
+ * table_find.
+ */
+bool table_lookup(Table *table, uint64_t key, Row *row) {
+  for (uint32_t i = 0; i < LOOKUP_MAX_RESTARTS; i++) {
+    LookupResult result = table_lookup_optimistic(table, key, row);
+    if (result == LOOKUP_BLOCKED) {
+      break;
+    }
+    if (result != LOOKUP_RESTART) {
+      return result == LOOKUP_FOUND;
+    }
+  }
+
+  Cursor *cursor = table_find(table, key);
+  void *node = get_page(table->pager, cursor->page_num);
+  bool found = cursor->cell_num < *leaf_node_num_cells(node) &&
+               leaf_node_key(node, cursor->cell_num) == key;
+  if (found) {
+    deserialize_row(leaf_node_cell(node, cursor->cell_num), row);
+  }
+  unpin_page(table->pager, cursor->page_num);
+  cursor_close(cursor);
+  return found;
+}
+
+/*
+ * Returns a cursor to the position of KEY under internal NODE, which is
+ * PAGE_NUM and was latched with get_page_latched by the caller. If KEY is not
+ * found returns a pointer to where it should be.
+ * A node is let go only once the child it leads to is latched, so a split or
+ * a merge by the writer is seen either whole or not at all.
+ */
+Cursor *internal_node_find(Table *table, uint32_t page_num, void *node,
+                           uint64_t key) {
   uint32_t child_index = internal_node_find_child(node, key);
   uint32_t child_num = *internal_node_child(node, child_index);
-  void *child = get_page(table->pager, child_num);
-  switch (get_node_type(child)) {
-  case NODE_LEAF:
-    return leaf_node_find(table, child_num, key);
-  case NODE_INTERNAL:
-    return internal_node_find(table, child_num, key);
+  void *child = get_page_latched(table->pager, child_num, LATCH_SHARED);
+  unlatch_page(table->pager, page_num);
+
+  if (get_node_type(child) == NODE_LEAF) {
+    return leaf_node_find(table, child_num, child, key);
+  } else {
+    return internal_node_find(table, child_num, child, key);
+  }
+}
+
+/*
+ * Tells whether changing NODE stays inside it: it has room for INSERT_SIZE
+ * more bytes, or with INSERT_SIZE 0, it can lose a cell (a child for an
+ * internal node) without being rebalanced. Leaves are rebalanced by size, so
+ * a delete from any leaf but the root may reach its parent.
+ */
+static bool node_is_safe(void *node, uint32_t insert_size) {
+  bool is_root = is_node_root(node);
+  if (get_node_type(node) == NODE_LEAF) {
+    if (insert_size == 0) {
+      return is_root;
+    }
+    return leaf_node_free_space(node) >=
+           insert_size + LEAF_NODE_CELL_POINTER_SIZE;
+  }
+
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (insert_size > 0) {
+    return internal_node_fits(num_keys + 2, *internal_node_lower_fence(node),
+                              *internal_node_upper_fence(node));
   }
+  if (is_root) {
+    return num_keys >= 2;
+  }
+  return num_keys > INTERNAL_NODE_MAX_CELLS / NODE_UNDERFLOW_RATIO;
 }
 
 /*
- * Adds a new child/key pair identified by CHILD_PAGE_NUM to internal node
- * PARENT_PAGE_NUM.
+ * Latches the nodes above leaf LEAF_PAGE_NUM that the writer may change when
+ * it inserts INSERT_SIZE bytes into the leaf, or with INSERT_SIZE 0, deletes
+ * from it. Readers that descend wait at them until the split or merge below
+ * is done, and the readers below already never see it half done.
+ * The path is latched exclusively from the root down. A node that can take
+ * the change lets go of the nodes above it, so PATH ends up holding the
+ * nodes from the lowest of those down to the parent of the leaf. A root leaf
+ * is kept when it may split, since the new root takes its place. The leaf
+ * itself is latched by the code that changes it. Without threads nothing is
+ * latched.
+ */
+void table_latch_path(Table *table, uint32_t leaf_page_num, uint32_t insert_size,
+                      LatchedPath *path) {
+  Pager *pager = table->pager;
+  path->num_nodes = 0;
+  if (!pager->threaded) {
+    return;
+  }
+
+  void *leaf = get_page(pager, leaf_page_num);
+  bool leaf_is_safe = node_is_safe(leaf, insert_size);
+  bool leaf_is_root = is_node_root(leaf);
+  uint32_t page_num = *node_parent(leaf);
+  if (!leaf_is_safe && leaf_is_root) {
+    path->page_nums[path->num_nodes++] = leaf_page_num;
+    return;
+  }
+  unpin_page(pager, leaf_page_num);
+  if (leaf_is_safe) {
+    return;
+  }
+
+  /* Only the writer moves nodes, so their parents lead to the root. */
+  uint32_t ancestors[LATCHED_PATH_MAX_NODES];
+  uint32_t num_ancestors = 0;
+  while (true) {
+    if (num_ancestors == LATCHED_PATH_MAX_NODES) {
+      printf("Tree under page %d is too high.\n", table->root_page_num);
+      exit(EXIT_FAILURE);
+    }
+    ancestors[num_ancestors++] = page_num;
+    void *node = get_page_latched(pager, page_num, LATCH_SHARED);
+    bool is_root = is_node_root(node);
+    uint32_t parent_page_num = *node_parent(node);
+    unlatch_page(pager, page_num);
+    if (is_root) {
+      break;
+    }
+    page_num = parent_page_num;
+  }
+
+  for (uint32_t i = num_ancestors; i > 0; i--) {
+    void *node = get_page(pager, ancestors[i - 1]);
+    if (node_is_safe(node, insert_size)) {
+      table_unlatch_path(table, path);
+    }
+    path->page_nums[path->num_nodes++] = ancestors[i - 1];
+  }
+}
+
+/*
+ * Lets go of the nodes latched by table_latch_path.
+ */
+void table_unlatch_path(Table *table, LatchedPath *path) {
+  for (uint32_t i = 0; i < path->num_nodes; i++) {
+    unpin_page(table->pager, path->page_nums[i]);
+  }
+  path->num_nodes = 0;
+}
+
+/*
+ * Returns the index of CHILD_PAGE_NUM among the children of internal NODE.
+ */
+static uint32_t internal_node_child_index(void *node, uint32_t child_page_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    if (*internal_node_child(node, i) == child_page_num) {
+      return i;
+    }
+  }
+  return num_keys;
+}
+
+/*
+ * Sets the parent pointer of the node at PAGE_NUM to PARENT_PAGE_NUM.
+ */
+static void set_parent(Pager *pager, uint32_t page_num,
+                       uint32_t parent_page_num) {
+  void *node = get_page(pager, page_num);
+  *node_parent(node) = parent_page_num;
+  mark_page_dirty(pager, page_num);
+  unpin_page(pager, page_num);
+}
+
+/*
+ * Splits internal node OLD_NODE at PAGE_NUM, which is pinned and overflowed to
+ * NUM_CHILDREN of CHILDREN and KEYS after adding the child at INDEX. The upper
+ * half of the children move to a new node, which is then added to the
+ * parent. Splitting the root grows the tree by one level. Both halves fit,
+ * since their fences are narrower than those of the full node.
+ */
+static void internal_node_split(Table *table, uint32_t page_num,
+                                void *old_node, uint32_t *children,
+                                uint64_t *keys, uint32_t num_children,
+                                uint32_t index) {
+  Pager *pager = table->pager;
+  uint64_t lower_fence = *internal_node_lower_fence(old_node);
+  uint64_t upper_fence = *internal_node_upper_fence(old_node);
+
+  /* As with leaves, a child appended at the end starts the new node alone. */
+  uint32_t left_count = num_children / 2;
+  if (index == num_children - 1) {
+    left_count = num_children - 1;
+  }
+  uint64_t separator = keys[left_count - 1];
+  uint32_t new_page_num = get_unused_page_num(pager, page_num);
+  void *new_node = get_page(pager, new_page_num);
+  initialize_internal_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+
+  internal_node_fill(old_node, children, keys, left_count, lower_fence,
+                     separator);
+  internal_node_fill(new_node, children + left_count, keys + left_count,
+                     num_children - left_count, separator, upper_fence);
+
+  bool was_root = is_node_root(old_node);
+  uint32_t parent_page_num = *node_parent(old_node);
+  mark_page_dirty(pager, page_num);
+  mark_page_dirty(pager, new_page_num);
+  unpin_page(pager, page_num);
+  unpin_page(pager, new_page_num);
+
+  for (uint32_t i = left_count; i < num_children; i++) {
+    set_parent(pager, children[i], new_page_num);
+  }
+
+  /* Update the parent, or create one */
+  if (was_root) {
+    return create_new_root(table, separator, new_page_num);
+  } else {
+    internal_node_insert(table, parent_page_num, page_num, separator,
+                         new_page_num);
+  }
+}
+
+/*
+ * The child LEFT_PAGE_NUM of internal node PARENT_PAGE_NUM was split, and
+ * CHILD_PAGE_NUM took over its upper half. Adds CHILD_PAGE_NUM right after
+ * it. SEPARATOR, the largest key left in LEFT_PAGE_NUM, becomes its key and
+ * the new child takes over the old one. A parent that is full is split.
  */
 void internal_node_insert(Table *table, uint32_t parent_page_num,
+                          uint32_t left_page_num, uint64_t separator,
                           uint32_t child_page_num) {
-  void *parent = get_page(table->pager, parent_page_num);
-  void *child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
+  Pager *pager = table->pager;
+  void *parent = get_page(pager, parent_page_num);
+  uint64_t lower_fence = *internal_node_lower_fence(parent);
+  uint64_t upper_fence = *internal_node_upper_fence(parent);
+
+  /* Lay out all children in key order, including the new one. */
+  uint32_t num_children = *internal_node_num_keys(parent) + 2;
+  uint32_t *children = malloc(num_children * sizeof(uint32_t));
+  uint64_t *keys = malloc(num_children * sizeof(uint64_t));
+  uint32_t index = internal_node_child_index(parent, left_page_num) + 1;
+  internal_node_gather(parent, children, keys);
+  memmove(children + index + 1, children + index,
+          (num_children - index - 1) * sizeof(uint32_t));
+  memmove(keys + index, keys + index - 1,
+          (num_children - index) * sizeof(uint64_t));
+  children[index] = child_page_num;
+  keys[index - 1] = separator;
+
+  if (internal_node_fits(num_children, lower_fence, upper_fence)) {
+    internal_node_fill(parent, children, keys, num_children, lower_fence,
+                       upper_fence);
+    mark_page_dirty(pager, parent_page_num);
+    unpin_page(pager, parent_page_num);
+    free(children);
+    free(keys);
+    return;
+  }
+  internal_node_split(table, parent_page_num, parent, children, keys,
+                      num_children, index);
+  free(children);
+  free(keys);
+}
+
+/*
+ * Removes the child at INDEX of internal NODE together with its key. INDEX
+ * must not be the right child.
+ */
+static void internal_node_remove_child(void *node, uint32_t index) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  uint32_t cell_size = INTERNAL_NODE_CHILD_SIZE + *internal_node_key_width(node);
+  memmove(internal_node_cell(node, index), internal_node_cell(node, index + 1),
+          (num_keys - index - 1) * cell_size);
+  *internal_node_num_keys(node) = num_keys - 1;
+}
 
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
-  *internal_node_num_keys(parent) = original_num_keys + 1;
+/*
+ * Returns the number of bytes the cells of leaf NODE take, with their
+ * pointers. Cells are always packed, so this is all the space in use.
+ */
+static uint32_t leaf_node_used_space(void *node) {
+  return LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
+}
 
-  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-    printf("Need to implement splitting internal node\n");
-    exit(EXIT_FAILURE);
+/*
+ * Puts the page of a node that was merged away on the free list.
+ */
+static void free_node(Table *table, uint32_t page_num) {
+  pager_free_page(table->pager, page_num);
+  table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+}
+
+/*
+ * Replaces a root that has a single child with that child, which makes the
+ * tree one level shorter. The root keeps its page.
+ */
+static void collapse_root(Table *table) {
+  Pager *pager = table->pager;
+  uint32_t root_page_num = table->root_page_num;
+  void *root = get_page(pager, root_page_num);
+  uint32_t child_page_num = *internal_node_right_child(root);
+  void *child = get_page(pager, child_page_num);
+
+  memcpy(root, child, PAGE_SIZE);
+  set_node_root(root, true);
+  *node_parent(root) = 0;
+
+  uint32_t num_children = 0;
+  uint32_t *children = NULL;
+  if (get_node_type(root) == NODE_INTERNAL) {
+    num_children = *internal_node_num_keys(root) + 1;
+    children = malloc(num_children * sizeof(uint32_t));
+    for (uint32_t i = 0; i < num_children; i++) {
+      children[i] = *internal_node_child(root, i);
+    }
   }
 
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  void *right_child = get_page(table->pager, right_child_page_num);
+  mark_page_dirty(pager, root_page_num);
+  unpin_page(pager, child_page_num);
+  unpin_page(pager, root_page_num);
 
-  if (child_max_key > get_node_max_key(right_child)) {
-    /* Replace right child */
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) =
-        get_node_max_key(right_child);
-    *internal_node_right_child(parent) = child_page_num;
-  } else {
-    /* Make room for new cell */
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      void *destination = internal_node_cell(parent, i);
-      void *source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+  for (uint32_t i = 0; i < num_children; i++) {
+    set_parent(pager, children[i], root_page_num);
+  }
+  free(children);
+  free_node(table, child_page_num);
+}
+
+/*
+ * Fixes internal node PAGE_NUM after it lost a child. A root without keys is
+ * collapsed. Any other node with less than 1/NODE_UNDERFLOW_RATIO of the keys
+ * it can hold is merged with a sibling if they fit in one node, otherwise
+ * children move over from the sibling until both are about as full. A merge
+ * takes a child from the parent, so the parent is checked next.
+ */
+static void internal_node_rebalance(Table *table, uint32_t page_num) {
+  Pager *pager = table->pager;
+  while (true) {
+    void *node = get_page(pager, page_num);
+    bool is_root = is_node_root(node);
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t parent_page_num = *node_parent(node);
+    unpin_page(pager, page_num);
+
+    if (is_root) {
+      if (num_keys == 0) {
+        collapse_root(table);
+      }
+      return;
+    }
+    if (num_keys >= INTERNAL_NODE_MAX_CELLS / NODE_UNDERFLOW_RATIO) {
+      return;
+    }
+
+    void *parent = get_page(pager, parent_page_num);
+    uint32_t parent_num_keys = *internal_node_num_keys(parent);
+    if (parent_num_keys == 0) {
+      /* The node has no sibling until its parent got one. */
+      unpin_page(pager, parent_page_num);
+      internal_node_rebalance(table, parent_page_num);
+      continue;
+    }
+    uint32_t index = internal_node_child_index(parent, page_num);
+    uint32_t left_index = index < parent_num_keys ? index : index - 1;
+    uint32_t left_page_num = *internal_node_child(parent, left_index);
+    uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+    void *left = get_page(pager, left_page_num);
+    void *right = get_page(pager, right_page_num);
+
+    uint32_t max_children = *internal_node_num_keys(left) +
+                            *internal_node_num_keys(right) + 2;
+    uint32_t *children = malloc(max_children * sizeof(uint32_t));
+    uint64_t *keys = malloc(max_children * sizeof(uint64_t));
+    uint64_t lower_fence = *internal_node_lower_fence(left);
+    uint64_t upper_fence = *internal_node_upper_fence(right);
+    uint32_t left_num_children = internal_node_gather(left, children, keys);
+    uint32_t num_children =
+        left_num_children + internal_node_gather(right,
+                                                 children + left_num_children,
+                                                 keys + left_num_children);
+
+    bool merge = internal_node_fits(num_children, lower_fence, upper_fence);
+    uint32_t left_count = num_children;
+    if (!merge) {
+      /*
+       * Split as evenly as the key widths allow. The old split point always
+       * works, so the search ends there at the latest.
+       */
+      left_count = num_children / 2;
+      while (!internal_node_fits(left_count, lower_fence,
+                                 keys[left_count - 1]) ||
+             !internal_node_fits(num_children - left_count,
+                                 keys[left_count - 1], upper_fence)) {
+        if (left_count < left_num_children) {
+          left_count++;
+        } else {
+          left_count--;
+        }
+      }
+    }
+    internal_node_fill(left, children, keys, left_count, lower_fence,
+                       merge ? upper_fence : keys[left_count - 1]);
+    if (merge) {
+      *internal_node_child(parent, left_index + 1) = left_page_num;
+      internal_node_remove_child(parent, left_index);
+    } else {
+      internal_node_fill(right, children + left_count, keys + left_count,
+                         num_children - left_count, keys[left_count - 1],
+                         upper_fence);
+      internal_node_set_key(parent, left_index, keys[left_count - 1]);
+      mark_page_dirty(pager, right_page_num);
+    }
+    mark_page_dirty(pager, left_page_num);
+    mark_page_dirty(pager, parent_page_num);
+    unpin_page(pager, left_page_num);
+    unpin_page(pager, right_page_num);
+    unpin_page(pager, parent_page_num);
+
+    /* Children that changed sides get their new parent. */
+    for (uint32_t i = 0; i < num_children; i++) {
+      if (i < left_count && i >= left_num_children) {
+        set_parent(pager, children[i], left_page_num);
+      } else if (i >= left_count && i < left_num_children) {
+        set_parent(pager, children[i], right_page_num);
+      }
+    }
+    free(children);
+    free(keys);
+
+    if (!merge) {
+      return;
     }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
+    free_node(table, right_page_num);
+    page_num = parent_page_num;
   }
 }
 
 /*
- * Replaces NODE's OLD_KEY with NEW_KEY.
+ * Fixes leaf PAGE_NUM after it became less than 1/NODE_UNDERFLOW_RATIO full,
+ * the same way internal_node_rebalance does.
  */
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key) {
-  uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
+static void leaf_node_rebalance(Table *table, uint32_t page_num) {
+  Pager *pager = table->pager;
+  uint32_t parent_page_num;
+  void *parent;
+  while (true) {
+    void *node = get_page(pager, page_num);
+    parent_page_num = *node_parent(node);
+    unpin_page(pager, page_num);
+
+    parent = get_page(pager, parent_page_num);
+    if (*internal_node_num_keys(parent) > 0) {
+      break;
+    }
+    /* The leaf has no sibling until its parent got one. */
+    unpin_page(pager, parent_page_num);
+    internal_node_rebalance(table, parent_page_num);
+  }
+
+  uint32_t parent_num_keys = *internal_node_num_keys(parent);
+  uint32_t index = internal_node_child_index(parent, page_num);
+  uint32_t left_index = index < parent_num_keys ? index : index - 1;
+  uint32_t left_page_num = *internal_node_child(parent, left_index);
+  uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+  void *left = get_page(pager, left_page_num);
+  void *right = get_page(pager, right_page_num);
+  uint32_t left_num_cells = *leaf_node_num_cells(left);
+  uint32_t right_num_cells = *leaf_node_num_cells(right);
+
+  /* Both leaves are rebuilt from copies of them. */
+  void *cells = malloc(2 * PAGE_SIZE);
+  memcpy(cells, left, PAGE_SIZE);
+  memcpy(cells + PAGE_SIZE, right, PAGE_SIZE);
+  void *left_cells = cells;
+  void *right_cells = cells + PAGE_SIZE;
+
+  bool merge =
+      leaf_node_used_space(left) + leaf_node_used_space(right) <=
+      LEAF_NODE_SPACE_FOR_CELLS;
+  leaf_node_clear_cells(left);
+  if (merge) {
+    leaf_node_append_cells(left, left_cells, 0, left_num_cells);
+    leaf_node_append_cells(left, right_cells, 0, right_num_cells);
+    *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+    *internal_node_child(parent, left_index + 1) = left_page_num;
+    internal_node_remove_child(parent, left_index);
+  } else {
+    /* Cell i is the i-th cell of the left leaf followed by the right leaf. */
+    uint32_t num_cells = left_num_cells + right_num_cells;
+    uint32_t total_size =
+        leaf_node_used_space(left_cells) + leaf_node_used_space(right_cells);
+    uint32_t left_count = 0;
+    uint32_t left_size = 0;
+    while (left_count < num_cells - 1 && left_size < total_size / 2) {
+      void *cell = left_count < left_num_cells
+                       ? leaf_node_cell(left_cells, left_count)
+                       : leaf_node_cell(right_cells, left_count - left_num_cells);
+      left_size += serialized_row_size(cell) + LEAF_NODE_CELL_POINTER_SIZE;
+      left_count++;
+    }
+    if (left_count == 0) {
+      left_count = 1;
+    }
+
+    leaf_node_clear_cells(right);
+    if (left_count <= left_num_cells) {
+      leaf_node_append_cells(left, left_cells, 0, left_count);
+      leaf_node_append_cells(right, left_cells, left_count,
+                             left_num_cells - left_count);
+      leaf_node_append_cells(right, right_cells, 0, right_num_cells);
+    } else {
+      uint32_t moved = left_count - left_num_cells;
+      leaf_node_append_cells(left, left_cells, 0, left_num_cells);
+      leaf_node_append_cells(left, right_cells, 0, moved);
+      leaf_node_append_cells(right, right_cells, moved,
+                             right_num_cells - moved);
+    }
+    internal_node_set_key(parent, left_index,
+                          leaf_node_key(left, left_count - 1));
+    mark_page_dirty(pager, right_page_num);
+  }
+  free(cells);
+
+  mark_page_dirty(pager, left_page_num);
+  mark_page_dirty(pager, parent_page_num);
+  unpin_page(pager, left_page_num);
+  unpin_page(pager, right_page_num);
+  unpin_page(pager, parent_page_num);
+
+  if (merge) {
+    free_node(table, right_page_num);
+    internal_node_rebalance(table, parent_page_num);
+  }
 }
 
 /*
- * Returns the maximum key of NODE
+ * Deletes COUNT cells starting at CELL_NUM from leaf PAGE_NUM. The keys in
+ * the ancestors stay as they are, since they only bound the keys below them.
+ * A leaf that became too empty is rebalanced with a sibling, which may shrink
+ * the tree. The root leaf may become empty.
  */
-uint32_t get_node_max_key(void *node) {
-  switch (get_node_type(node)) {
-  case NODE_INTERNAL:
-    return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-  case NODE_LEAF:
-    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+void leaf_node_delete(Table *table, uint32_t page_num, uint32_t cell_num,
+                      uint32_t count) {
+  Pager *pager = table->pager;
+  void *node = get_page(pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  void *old_cells = malloc(PAGE_SIZE);
+  memcpy(old_cells, node, PAGE_SIZE);
+  leaf_node_clear_cells(node);
+  leaf_node_append_cells(node, old_cells, 0, cell_num);
+  leaf_node_append_cells(node, old_cells, cell_num + count,
+                         num_cells - cell_num - count);
+  free(old_cells);
+  mark_page_dirty(pager, page_num);
+
+  bool is_root = is_node_root(node);
+  bool underflow = leaf_node_used_space(node) <
+                   LEAF_NODE_SPACE_FOR_CELLS / NODE_UNDERFLOW_RATIO;
+  unpin_page(pager, page_num);
+
+  if (!is_root && underflow) {
+    leaf_node_rebalance(table, page_num);
   }
 }
 
@@ -810,12 +2060,15 @@ void set_node_type(void *node, NodeType type) {
 
 /*
  * Old root is copied to a new page, and becomes the left child.
- * New root points to the two leaf (child) nodes.
+ * New root points to the two child nodes, with SEPARATOR as the key between
+ * them.
  */
-void create_new_root(Table *table, uint32_t right_child_page_num) {
+void create_new_root(Table *table, uint64_t separator,
+                     uint32_t right_child_page_num) {
+  uint32_t left_child_page_number =
+      get_unused_page_num(table->pager, table->root_page_num);
   void *root = get_page(table->pager, table->root_page_num);
   void *right_child = get_page(table->pager, right_child_page_num);
-  uint32_t left_child_page_number = get_unused_page_num(table->pager);
   void *left_child = get_page(table->pager, left_child_page_number);
 
   /* Copy the old root to left child */
@@ -827,11 +2080,34 @@ void create_new_root(Table *table, uint32_t right_child_page_num) {
   set_node_root(root, true);
   *internal_node_num_keys(root) = 1;
   *internal_node_child(root, 0) = left_child_page_number;
-  uint32_t left_child_max_key = get_node_max_key(left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
+  internal_node_set_key(root, 0, separator);
   *internal_node_right_child(root) = right_child_page_num;
   *node_parent(left_child) = table->root_page_num;
   *node_parent(right_child) = table->root_page_num;
+
+  /* The children of an internal left child moved along with it */
+  uint32_t num_children = 0;
+  uint32_t *children = NULL;
+  if (get_node_type(left_child) == NODE_INTERNAL) {
+    num_children = *internal_node_num_keys(left_child) + 1;
+    children = malloc(num_children * sizeof(uint32_t));
+    for (uint32_t i = 0; i < num_children - 1; i++) {
+      children[i] = *internal_node_child(left_child, i);
+    }
+    children[num_children - 1] = *internal_node_right_child(left_child);
+  }
+
+  mark_page_dirty(table->pager, left_child_page_number);
+  mark_page_dirty(table->pager, right_child_page_num);
+  mark_page_dirty(table->pager, table->root_page_num);
+  unpin_page(table->pager, left_child_page_number);
+  unpin_page(table->pager, right_child_page_num);
+  unpin_page(table->pager, table->root_page_num);
+
+  for (uint32_t i = 0; i < num_children; i++) {
+    set_parent(table->pager, children[i], left_child_page_number);
+  }
+  free(children);
 }
 
 /*
@@ -854,7 +2130,7 @@ void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
     printf("- leaf (size %d)\n", num_keys);
     for (uint32_t i = 0; i < num_keys; i++) {
       indent(indentation_level + 1);
-      printf("-%d\n", *leaf_node_key(node, i));
+      printf("-%lu\n", leaf_node_key(node, i));
     }
     break;
   case (NODE_INTERNAL):
@@ -866,12 +2142,14 @@ void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
       print_tree(pager, child, indentation_level + 1);
 
       indent(indentation_level + 1);
-      printf("- key %d\n", *internal_node_key(node, i));
+      printf("- key %lu\n", internal_node_key(node, i));
     }
     child = *internal_node_right_child(node);
     print_tree(pager, child, indentation_level + 1);
     break;
   }
+
+  unpin_page(pager, page_num);
 }
 
 /*
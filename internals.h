@@ -7,46 +7,100 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "output.h"
+#include "pager.h"
 #include "results.h"
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
 
-/* Arbitrary value. Table is composed of pages, each of which has rows. */
-#define TABLE_MAX_PAGES 100
+/* Tables have names of up to this many letters, digits and underscores. */
+#define TABLE_NAME_SIZE 32
+
+/* Bounds for the number of leaves a scan reads ahead of its cursor. */
+#define CURSOR_MIN_READ_AHEAD 2
+#define CURSOR_START_READ_AHEAD 8
+#define CURSOR_MAX_READ_AHEAD 64
+
+/*
+ * A lookup that reads pages without latching them starts over when the
+ * writer changes one of them, and latches them once it tried this often.
+ */
+#define LOOKUP_MAX_RESTARTS 4
+
+/*
+ * A node other than the root underflows once it is less than
+ * 1/NODE_UNDERFLOW_RATIO full, and is then rebalanced with a sibling.
+ */
+#define NODE_UNDERFLOW_RATIO 4
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
 typedef enum {
   STATEMENT_INSERT,
-  STATEMENT_SELECT
+  STATEMENT_SELECT,
+  STATEMENT_DELETE,
+  STATEMENT_UPDATE,
+  STATEMENT_CREATE_INDEX,
+  STATEMENT_CREATE_TABLE,
+  STATEMENT_DROP_TABLE,
+  STATEMENT_BEGIN,
+  STATEMENT_COMMIT,
+  STATEMENT_ROLLBACK
 } StatementType;
 
+/* The columns besides the id, each of which can have a secondary index. */
+typedef enum {
+  COLUMN_USERNAME,
+  COLUMN_EMAIL
+} Column;
+
+#define NUM_INDEXED_COLUMNS 2
+
 /*
  * The additional byte (+1) is given for the null byte at the end.
  */
 typedef struct {
-  uint32_t id;
+  uint64_t id;
   char username[COLUMN_USERNAME_SIZE + 1];
   char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+/*
+ * A select returns the rows with keys from min_key to max_key, both included,
+ * and a delete removes them. A select with match_column set returns the rows
+ * whose COLUMN has the value that column has in row_to_insert instead.
+ * An update finds the row by the id in row_to_insert and sets the columns it
+ * is asked to from there. Create index builds an index on COLUMN.
+ * Every statement works on the table called TABLE_NAME, which is the default
+ * table unless the statement names another one.
+ */
 typedef struct {
   StatementType type;
-  Row row_to_insert; /* Used only by the insert statement */
+  char table_name[TABLE_NAME_SIZE + 1];
+  Row row_to_insert; /* Used by the insert, update and select statements */
+  uint64_t min_key;  /* Used only by the select and delete statements */
+  uint64_t max_key;
+  bool match_column; /* Used only by the select statement */
+  Column column;
+  bool set_username; /* Used only by the update statement */
+  bool set_email;
 } Statement;
 
-/* Pager manages the pages of the table */
-typedef struct {
-  int file_descriptor;
-  uint32_t file_length;
-  uint32_t num_pages;
-  void* pages[TABLE_MAX_PAGES];
-} Pager;
-
-typedef struct {
+/*
+ * rightmost_leaf_page_num caches the leaf that holds the largest keys, so
+ * appends can skip the descent from the root. It is only a hint and is
+ * checked before use.
+ * A secondary index is a tree of its own in the same file, and is opened as a
+ * Table as well. INDEXES holds the index of each column, or NULL if the
+ * column has none. NAME is empty for an index.
+ */
+typedef struct Table {
+  char name[TABLE_NAME_SIZE + 1];
   uint32_t root_page_num;
+  uint32_t rightmost_leaf_page_num;
   Pager* pager;
+  struct Table* indexes[NUM_INDEXED_COLUMNS];
 } Table;
 
 /* A Cursor represents a location in the table
@@ -54,14 +108,47 @@ typedef struct {
  * It has a table reference in it so we can simply pass the cursor ref to functions.
  * Member end_of_table says whether this cursor points beyond the table.
  *
+ * A scan reads leaves ahead of the cursor. read_ahead is how many leaves it
+ * asks for at a time, and read_ahead_covered how many of the leaves after the
+ * current one have been asked for. wasted_reads_seen is the pager's
+ * num_wasted_reads when the cursor last looked. With cold_scan set, leaves
+ * the scan brought into the buffer pool (leaf_is_cold) are the first to go
+ * once the cursor leaves them.
+ *
+ * With threads, a reader's cursor keeps its leaf pinned and latched shared
+ * (latched is set) until it moves on or is closed with cursor_close, so no
+ * row under it is changed or moved away.
  */
 typedef struct {
   Table* table;
   uint32_t page_num;
   uint32_t cell_num;
   bool end_of_table;
+  uint32_t read_ahead;
+  uint32_t read_ahead_covered;
+  uint64_t wasted_reads_seen;
+  bool cold_scan;
+  bool leaf_is_cold;
+  bool latched;
 } Cursor;
 
+/* No tree is ever this high. */
+#define LATCHED_PATH_MAX_NODES 32
+
+/*
+ * The nodes above a leaf that the writer keeps latched while it changes the
+ * leaf, because a split or a merge may reach them. See table_latch_path.
+ */
+typedef struct {
+  uint32_t num_nodes;
+  uint32_t page_nums[LATCHED_PATH_MAX_NODES];
+} LatchedPath;
+
+extern const uint32_t LEAF_NODE_CELL_POINTER_SIZE;
+extern uint32_t LEAF_NODE_SPACE_FOR_CELLS;
+extern uint32_t LEAF_NODE_MAX_CELLS;
+extern uint32_t INTERNAL_NODE_MAX_CELLS;
+
 /* NodeType is for the tree implementation */
 typedef enum {
   NODE_INTERNAL,
@@ -69,53 +156,78 @@ typedef enum {
 } NodeType;
 
 ExecuteResult execute_insert(Statement* statement, Table* table);
-ExecuteResult execute_select(Statement* statement, Table* table);
-
-Table* db_open(const char* filename);
-void db_close(Table* table);
-
+ExecuteResult execute_select(Statement* statement, Table* table,
+                             ResultWriter* writer);
+ExecuteResult execute_delete(Statement* statement, Table* table);
+ExecuteResult execute_update(Statement* statement, Table* table);
+
+void initialize_node_layout();
+Table* table_open(Pager* pager, uint32_t root_page_num);
+void table_close(Table* table);
+uint32_t create_tree(Pager* pager);
+void free_tree(Pager* pager, uint32_t page_num);
+
+uint32_t row_size(Row* row);
 void serialize_row(Row* source, void* destination);
 void deserialize_row(void* source, Row* destination);
-
-Pager* pager_open(const char* filename);
-void* get_page(Pager* pager, uint32_t page_num);
-uint32_t get_unused_page_num(Pager* pager);
-void pager_flush(Pager* pager, uint32_t page_num);
+uint64_t serialized_row_id(void* source);
+char* serialized_row_username(void* source, uint32_t* length);
+char* serialized_row_email(void* source, uint32_t* length);
+uint32_t serialized_row_size(void* source);
 
 Cursor* table_start(Table* table);
-Cursor* table_find(Table* table, uint32_t key);
+Cursor* table_find(Table* table, uint64_t key);
+bool table_lookup(Table* table, uint64_t key, Row* row);
+Cursor* table_find_append(Table* table, uint64_t key, uint32_t size);
+Cursor* table_seek(Table* table, uint64_t key);
 void* cursor_value(Cursor* cursor);
 void cursor_advance(Cursor* cursor);
+void cursor_enter_leaf(Cursor* cursor, uint32_t page_num);
+void cursor_close(Cursor* cursor);
+void table_latch_path(Table* table, uint32_t leaf_page_num, uint32_t insert_size,
+                      LatchedPath* path);
+void table_unlatch_path(Table* table, LatchedPath* path);
 
 void print_constants();
 
 uint32_t* leaf_node_num_cells(void* node);
+uint32_t* leaf_node_cell_content_start(void* node);
+uint16_t* leaf_node_cell_pointer(void* node, uint32_t cell_num);
 void* leaf_node_cell(void* node, uint32_t cell_num);
-uint32_t* leaf_node_key(void* node, uint32_t cell_num);
-void* leaf_node_value(void* node, uint32_t cell_num);
+uint64_t leaf_node_key(void* node, uint32_t cell_num);
+uint32_t leaf_node_free_space(void* node);
 void initialize_leaf_node(void* node);
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value);
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key);
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value);
+void leaf_node_insert_row(void* node, uint32_t cell_num, Row* row);
+void leaf_node_replace_row(void* node, uint32_t cell_num, Row* row);
+void leaf_node_insert(Cursor* cursor, Row* value);
+void leaf_node_insert_cell(Cursor* cursor, void* cell, uint32_t size);
+Cursor* leaf_node_find(Table* table, uint32_t page_num, void* node, uint64_t key);
+void leaf_node_split_and_insert(Cursor* cursor, void* cell, uint32_t size);
 uint32_t* leaf_node_next_leaf(void* node);
+void leaf_node_delete(Table* table, uint32_t page_num, uint32_t cell_num,
+                      uint32_t count);
 
 uint32_t* internal_node_num_keys(void* node);
 uint32_t* internal_node_right_child(void* node);
-uint32_t* internal_node_cell(void* node, uint32_t cell_num);
+uint64_t* internal_node_lower_fence(void* node);
+uint64_t* internal_node_upper_fence(void* node);
+uint8_t* internal_node_key_width(void* node);
+void* internal_node_cell(void* node, uint32_t cell_num);
 uint32_t* internal_node_child(void* node, uint32_t child_num);
-uint32_t* internal_node_key(void* node, uint32_t key_num);
+uint64_t internal_node_key(void* node, uint32_t key_num);
+void internal_node_set_key(void* node, uint32_t key_num, uint64_t key);
 void initialize_internal_node(void* node);
-uint32_t internal_node_find_child(void* node, uint32_t key);
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key);
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key);
+void internal_node_set_fences(void* node, uint64_t lower, uint64_t upper);
+uint32_t internal_node_find_child(void* node, uint64_t key);
+Cursor* internal_node_find(Table* table, uint32_t page_num, void* node, uint64_t key);
+void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t left_page_num,
+                          uint64_t separator, uint32_t child_page_num);
 
-uint32_t get_node_max_key(void* node);
 bool is_node_root(void* node);
 void set_node_root(void* node, bool is_root);
 NodeType get_node_type(void* node);
 void set_node_type(void* node, NodeType type);
-void create_new_root(Table* table, uint32_t right_child_page_num);
+void create_new_root(Table* table, uint64_t separator, uint32_t right_child_page_num);
 uint32_t* node_parent(void* node);
 
 void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
@@ -0,0 +1,287 @@
+/********************************************************************************
+ * io.c : Batched asynchronous file I/O on io_uring, with a blocking fallback
+ *
+ * There is no liburing dependency. The ring is set up with the raw system
+ * calls and the queues are shared with the kernel through mmap, as described
+ * in linux/io_uring.h.
+ ********************************************************************************/
+#include "io.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Maps the queues of the ring behind RING_FD. Returns false if any of them
+ * cannot be mapped.
+ */
+static bool io_map_ring(IoRing *ring, int ring_fd,
+                        struct io_uring_params *params) {
+  ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(uint32_t);
+  ring->cq_ring_size =
+      params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    return false;
+  }
+
+  ring->sq_head = ring->sq_ring + params->sq_off.head;
+  ring->sq_tail = ring->sq_ring + params->sq_off.tail;
+  ring->sq_mask = ring->sq_ring + params->sq_off.ring_mask;
+  ring->sq_array = ring->sq_ring + params->sq_off.array;
+  ring->cq_head = ring->cq_ring + params->cq_off.head;
+  ring->cq_tail = ring->cq_ring + params->cq_off.tail;
+  ring->cq_mask = ring->cq_ring + params->cq_off.ring_mask;
+  ring->cqes = ring->cq_ring + params->cq_off.cqes;
+  return true;
+}
+
+static void io_unmap_ring(IoRing *ring) {
+  if (ring->sq_ring != MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->cq_ring != MAP_FAILED) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+}
+
+/*
+ * Sets up an io_uring for RING. Leaves ring_fd at -1 if the kernel does not
+ * offer one. Kernels without IORING_FEAT_FAST_POLL (before 5.7) are treated
+ * as not having it, since they may lack IORING_OP_READ.
+ */
+static void io_setup_ring(IoRing *ring) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ring_fd = syscall(__NR_io_uring_setup, ring->queue_depth, &params);
+  if (ring_fd < 0) {
+    return;
+  }
+  if (!(params.features & IORING_FEAT_FAST_POLL)) {
+    close(ring_fd);
+    return;
+  }
+
+  if (!io_map_ring(ring, ring_fd, &params)) {
+    io_unmap_ring(ring);
+    close(ring_fd);
+    return;
+  }
+  ring->ring_fd = ring_fd;
+}
+
+/*
+ * Creates a ring that allows QUEUE_DEPTH requests at a time. Without
+ * USE_IO_URING, or when the kernel does not support it, requests are carried
+ * out with blocking calls.
+ */
+IoRing *io_open(uint32_t queue_depth, bool use_io_uring) {
+  IoRing *ring = malloc(sizeof(IoRing));
+  ring->ring_fd = -1;
+  ring->queue_depth = queue_depth;
+  ring->num_queued = 0;
+  ring->num_in_flight = 0;
+  ring->sq_ring = MAP_FAILED;
+  ring->cq_ring = MAP_FAILED;
+  ring->sqes = MAP_FAILED;
+  ring->done = malloc(queue_depth * sizeof(IoCompletion));
+  ring->num_done = 0;
+
+  if (use_io_uring) {
+    io_setup_ring(ring);
+  }
+  return ring;
+}
+
+/*
+ * Tears the ring down. Every request has to be reaped first.
+ */
+void io_close(IoRing *ring) {
+  if (io_num_pending(ring) > 0) {
+    printf("Tried to close I/O ring with requests pending.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (ring->ring_fd != -1) {
+    io_unmap_ring(ring);
+    close(ring->ring_fd);
+  }
+  free(ring->done);
+  free(ring);
+}
+
+/*
+ * Returns true if requests run asynchronously on an io_uring.
+ */
+bool io_is_async(IoRing *ring) { return ring->ring_fd != -1; }
+
+/*
+ * Returns true if no request can be queued until one is reaped.
+ */
+bool io_is_full(IoRing *ring) {
+  return io_num_pending(ring) >= ring->queue_depth;
+}
+
+/*
+ * Number of requests that were queued and have not been reaped yet.
+ */
+uint32_t io_num_pending(IoRing *ring) {
+  return ring->num_queued + ring->num_in_flight + ring->num_done;
+}
+
+/*
+ * Records the result of a request that was carried out right away.
+ */
+static void io_complete_now(IoRing *ring, uint64_t user_data, ssize_t result) {
+  ring->done[ring->num_done].user_data = user_data;
+  ring->done[ring->num_done].result = result == -1 ? -errno : result;
+  ring->num_done++;
+}
+
+/*
+ * Returns a cleared submission queue entry. It is handed to the kernel by
+ * io_queue_entry once filled in.
+ */
+static struct io_uring_sqe *io_next_entry(IoRing *ring) {
+  uint32_t index = *ring->sq_tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  return sqe;
+}
+
+static void io_queue_entry(IoRing *ring) {
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+  ring->num_queued++;
+}
+
+static void io_check_room(IoRing *ring) {
+  if (io_is_full(ring)) {
+    printf("Tried to queue more than %d I/O requests.\n", ring->queue_depth);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Queues a read of LENGTH bytes at OFFSET of FD into BUFFER.
+ */
+void io_read(IoRing *ring, int fd, void *buffer, uint32_t length, off_t offset,
+             uint64_t user_data) {
+  io_check_room(ring);
+  if (ring->ring_fd == -1) {
+    io_complete_now(ring, user_data, pread(fd, buffer, length, offset));
+    return;
+  }
+
+  struct io_uring_sqe *sqe = io_next_entry(ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buffer;
+  sqe->len = length;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  io_queue_entry(ring);
+}
+
+/*
+ * Queues a write of the IOV_COUNT buffers in IOV to OFFSET of FD. IOV has to
+ * stay valid until the request is reaped.
+ */
+void io_writev(IoRing *ring, int fd, struct iovec *iov, uint32_t iov_count,
+               off_t offset, uint64_t user_data) {
+  io_check_room(ring);
+  if (ring->ring_fd == -1) {
+    io_complete_now(ring, user_data, pwritev(fd, iov, iov_count, offset));
+    return;
+  }
+
+  struct io_uring_sqe *sqe = io_next_entry(ring);
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)iov;
+  sqe->len = iov_count;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  io_queue_entry(ring);
+}
+
+/*
+ * Calls io_uring_enter, retrying when interrupted by a signal.
+ */
+static int io_enter(IoRing *ring, uint32_t to_submit, uint32_t min_complete,
+                    uint32_t flags) {
+  while (true) {
+    int result = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit,
+                         min_complete, flags, NULL, 0);
+    if (result >= 0 || errno != EINTR) {
+      return result;
+    }
+  }
+}
+
+/*
+ * Hands the queued requests to the kernel, all with a single system call.
+ */
+void io_submit(IoRing *ring) {
+  while (ring->num_queued > 0) {
+    int submitted = io_enter(ring, ring->num_queued, 0, 0);
+    if (submitted < 0) {
+      printf("Error submitting I/O: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    ring->num_queued -= submitted;
+    ring->num_in_flight += submitted;
+  }
+}
+
+/*
+ * Takes the result of a finished request and stores it in COMPLETION. If
+ * none has finished yet and WAIT is set, blocks until one does.
+ * Returns false if there was nothing to reap.
+ */
+bool io_reap(IoRing *ring, IoCompletion *completion, bool wait) {
+  if (ring->ring_fd == -1) {
+    if (ring->num_done == 0) {
+      return false;
+    }
+    *completion = ring->done[--ring->num_done];
+    return true;
+  }
+
+  if (wait) {
+    io_submit(ring);
+  }
+  while (true) {
+    uint32_t head = *ring->cq_head;
+    if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      completion->user_data = cqe->user_data;
+      completion->result = cqe->res;
+      __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+      ring->num_in_flight--;
+      return true;
+    }
+    if (!wait || ring->num_in_flight == 0) {
+      return false;
+    }
+    if (io_enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+      printf("Error waiting for I/O: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
@@ -0,0 +1,71 @@
+/********************************************************************************
+ * io.h : Batched asynchronous file I/O on io_uring, with a blocking fallback
+ ********************************************************************************/
+#ifndef _IO_H
+#define _IO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Number of requests that can be queued or in flight at the same time. */
+#define IO_QUEUE_DEPTH 64
+
+/*
+ * The outcome of a request: the USER_DATA it was queued with, and the number
+ * of bytes transferred or a negative errno.
+ */
+typedef struct {
+  uint64_t user_data;
+  int32_t result;
+} IoCompletion;
+
+/*
+ * A submission and completion queue shared with the kernel.
+ * If io_uring is not available (old kernel, seccomp, or turned off), ring_fd
+ * is -1 and every request is carried out right away with a blocking call.
+ * Its completion is kept in DONE until it is reaped, so callers handle both
+ * cases the same way.
+ * num_queued requests are waiting to be submitted, num_in_flight were
+ * submitted and have not been reaped.
+ */
+typedef struct {
+  int ring_fd;
+  uint32_t queue_depth;
+  uint32_t num_queued;
+  uint32_t num_in_flight;
+
+  void* sq_ring;
+  size_t sq_ring_size;
+  uint32_t* sq_head;
+  uint32_t* sq_tail;
+  uint32_t* sq_mask;
+  uint32_t* sq_array;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+
+  void* cq_ring;
+  size_t cq_ring_size;
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  IoCompletion* done;
+  uint32_t num_done;
+} IoRing;
+
+IoRing* io_open(uint32_t queue_depth, bool use_io_uring);
+void io_close(IoRing* ring);
+bool io_is_async(IoRing* ring);
+bool io_is_full(IoRing* ring);
+uint32_t io_num_pending(IoRing* ring);
+void io_read(IoRing* ring, int fd, void* buffer, uint32_t length, off_t offset,
+             uint64_t user_data);
+void io_writev(IoRing* ring, int fd, struct iovec* iov, uint32_t iov_count,
+               off_t offset, uint64_t user_data);
+void io_submit(IoRing* ring);
+bool io_reap(IoRing* ring, IoCompletion* completion, bool wait);
+
+#endif
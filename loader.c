@@ -0,0 +1,611 @@
+/********************************************************************************
+ * loader.c : Bulk loading of rows into an empty table
+ *
+ * Rows are read from a text file with one "id username email" row per line.
+ * They are sorted in memory. Input that does not fit in the sort memory is
+ * cut into sorted runs in temporary files, which are merged afterwards.
+ * The sorted rows are then packed into leaves, and the internal levels are
+ * built bottom-up on top of them. The shape of the whole tree is known up
+ * front from the number and size of the rows, so every level is written to
+ * its own range of new pages, sequentially and without going through the log.
+ * Only the root goes through the buffer pool, once everything below it is on
+ * disk.
+ ********************************************************************************/
+#include "loader.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+#include "processor.h"
+
+/* Pages of one tree level are written in batches of this many. */
+#define LOAD_BATCH_PAGES 256
+
+/* Buffer size for reading and writing run files. */
+#define LOAD_RUN_BUFFER_SIZE (1024 * 1024)
+
+/*
+ * Nodes get at least 2 children and page numbers are 32 bit, so no tree that
+ * fits in a file is any taller.
+ */
+#define LOAD_MAX_LEVELS 33
+
+/*
+ * Sorting these instead of whole rows keeps qsort from moving rows around.
+ */
+typedef struct {
+  uint64_t id;
+  uint32_t index;
+} SortKey;
+
+/*
+ * Rows in key order, either straight from the sort buffer or merged from the
+ * run files. The heap holds the indexes of the runs that still have rows,
+ * ordered by the row each run has up next.
+ * All rows together take up num_bytes in leaves, counting their cell
+ * pointers, and the largest one takes max_row_bytes.
+ */
+typedef struct {
+  Row* rows;
+  SortKey* keys;
+  uint32_t num_rows;
+  uint32_t next_row;
+  FILE** runs;
+  Row* run_rows;
+  uint32_t num_runs;
+  uint32_t* heap;
+  uint32_t heap_size;
+  uint64_t num_bytes;
+  uint32_t max_row_bytes;
+} RowStream;
+
+/*
+ * One level of the tree being built. Level 0 holds the leaves.
+ * NUM_ENTRIES rows or children are spread evenly over NUM_NODES nodes, which
+ * take up consecutive pages starting at FIRST_PAGE_NUM. The top level has a
+ * single node, the root, which lives in page 0.
+ * Rows differ in size, so leaves are filled by size instead of count. The
+ * rows take up NUM_BYTES, and BYTES_ADDED of them went into leaves so far.
+ * MAX_KEY is the largest key in the node being filled, and LOWER_FENCE the
+ * largest key before it, which bounds an internal node from below.
+ * Nodes are built in place in the batch buffer and written once it is full.
+ */
+typedef struct {
+  uint64_t num_entries;
+  uint32_t num_nodes;
+  uint32_t first_page_num;
+  uint32_t node_index;
+  uint32_t node_fill;
+  uint64_t max_key;
+  uint64_t lower_fence;
+  uint64_t num_bytes;
+  uint64_t bytes_added;
+  uint64_t entries_added;
+  void* node;
+  void* batch;
+  uint32_t batch_first_page_num;
+  uint32_t batch_count;
+} Level;
+
+typedef struct {
+  Table* table;
+  Level levels[LOAD_MAX_LEVELS];
+  uint32_t num_levels;
+} TreeBuilder;
+
+static int compare_sort_keys(const void* a, const void* b) {
+  const SortKey* key_a = a;
+  const SortKey* key_b = b;
+  if (key_a->id != key_b->id) {
+    return (key_a->id > key_b->id) - (key_a->id < key_b->id);
+  }
+  return (key_a->index > key_b->index) - (key_a->index < key_b->index);
+}
+
+/*
+ * Sorts the rows in STREAM's sort buffer and writes them to a new run file.
+ * The buffer is empty afterwards.
+ */
+static void spill_run(RowStream* stream) {
+  qsort(stream->keys, stream->num_rows, sizeof(SortKey), compare_sort_keys);
+
+  FILE* run = tmpfile();
+  if (run == NULL) {
+    printf("Unable to create run file\n");
+    exit(EXIT_FAILURE);
+  }
+  setvbuf(run, NULL, _IOFBF, LOAD_RUN_BUFFER_SIZE);
+  for (uint32_t i = 0; i < stream->num_rows; i++) {
+    fwrite(&stream->rows[stream->keys[i].index], sizeof(Row), 1, run);
+  }
+  if (fflush(run) != 0) {
+    printf("Error writing run file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  stream->runs = realloc(stream->runs, (stream->num_runs + 1) * sizeof(FILE*));
+  stream->runs[stream->num_runs++] = run;
+  stream->num_rows = 0;
+}
+
+/*
+ * Moves the run at heap position INDEX down until the heap is ordered again.
+ */
+static void heap_sift_down(RowStream* stream, uint32_t index) {
+  while (true) {
+    uint32_t smallest = index;
+    uint32_t left = 2 * index + 1;
+    uint32_t right = left + 1;
+    if (left < stream->heap_size &&
+        stream->run_rows[stream->heap[left]].id <
+            stream->run_rows[stream->heap[smallest]].id) {
+      smallest = left;
+    }
+    if (right < stream->heap_size &&
+        stream->run_rows[stream->heap[right]].id <
+            stream->run_rows[stream->heap[smallest]].id) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      return;
+    }
+    uint32_t run = stream->heap[index];
+    stream->heap[index] = stream->heap[smallest];
+    stream->heap[smallest] = run;
+    index = smallest;
+  }
+}
+
+/*
+ * Reads the next row of run RUN. Returns false once the run is used up.
+ */
+static bool run_read_row(RowStream* stream, uint32_t run) {
+  return fread(&stream->run_rows[run], sizeof(Row), 1, stream->runs[run]) == 1;
+}
+
+/*
+ * Gets the stream ready to hand out rows in key order.
+ */
+static void stream_start(RowStream* stream) {
+  if (stream->num_runs == 0) {
+    qsort(stream->keys, stream->num_rows, sizeof(SortKey), compare_sort_keys);
+    stream->next_row = 0;
+    return;
+  }
+
+  if (stream->num_rows > 0) {
+    spill_run(stream);
+  }
+  stream->run_rows = malloc(stream->num_runs * sizeof(Row));
+  stream->heap = malloc(stream->num_runs * sizeof(uint32_t));
+  stream->heap_size = 0;
+  for (uint32_t i = 0; i < stream->num_runs; i++) {
+    rewind(stream->runs[i]);
+    if (run_read_row(stream, i)) {
+      stream->heap[stream->heap_size++] = i;
+    }
+  }
+  for (int32_t i = stream->heap_size / 2 - 1; i >= 0; i--) {
+    heap_sift_down(stream, i);
+  }
+}
+
+/*
+ * Copies the next row in key order to ROW. Returns false when there are no
+ * rows left.
+ */
+static bool stream_next(RowStream* stream, Row* row) {
+  if (stream->num_runs == 0) {
+    if (stream->next_row == stream->num_rows) {
+      return false;
+    }
+    *row = stream->rows[stream->keys[stream->next_row++].index];
+    return true;
+  }
+
+  if (stream->heap_size == 0) {
+    return false;
+  }
+  uint32_t run = stream->heap[0];
+  *row = stream->run_rows[run];
+  if (!run_read_row(stream, run)) {
+    stream->heap[0] = stream->heap[--stream->heap_size];
+  }
+  heap_sift_down(stream, 0);
+  return true;
+}
+
+static void stream_free(RowStream* stream) {
+  for (uint32_t i = 0; i < stream->num_runs; i++) {
+    fclose(stream->runs[i]);
+  }
+  free(stream->runs);
+  free(stream->run_rows);
+  free(stream->heap);
+  free(stream->rows);
+  free(stream->keys);
+}
+
+/*
+ * Works out the shape of a tree holding NUM_ROWS rows, which take up
+ * NUM_BYTES in leaves and at most MAX_ROW_BYTES each: how many nodes each
+ * level has and which pages they go to.
+ */
+static void builder_init(TreeBuilder* builder, Table* table, uint64_t num_rows,
+                         uint64_t num_bytes, uint32_t max_row_bytes,
+                         uint32_t fill_percent) {
+  /* A leaf can end up one row over its share, which still has to fit. */
+  uint32_t leaf_capacity = LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100;
+  if (leaf_capacity > LEAF_NODE_SPACE_FOR_CELLS - max_row_bytes) {
+    leaf_capacity = LEAF_NODE_SPACE_FOR_CELLS - max_row_bytes;
+  }
+  uint32_t internal_capacity =
+      (INTERNAL_NODE_MAX_CELLS + 1) * fill_percent / 100;
+  if (leaf_capacity < 1) {
+    leaf_capacity = 1;
+  }
+  if (internal_capacity < 2) {
+    internal_capacity = 2;
+  }
+
+  builder->table = table;
+  builder->num_levels = 0;
+  /* The nodes go past the end of the file, so they can be written directly. */
+  uint32_t next_page_num = table->pager->num_pages;
+  uint64_t num_entries = num_rows;
+  uint64_t num_nodes = (num_bytes + leaf_capacity - 1) / leaf_capacity;
+  if (num_nodes > num_entries) {
+    num_nodes = num_entries;
+  }
+  while (true) {
+    Level* level = &builder->levels[builder->num_levels++];
+    level->num_entries = num_entries;
+    level->num_nodes = num_nodes;
+    level->node_index = 0;
+    level->node_fill = 0;
+    level->lower_fence = 0;
+    level->num_bytes = num_bytes;
+    level->bytes_added = 0;
+    level->entries_added = 0;
+    level->batch = malloc((size_t)LOAD_BATCH_PAGES * PAGE_SIZE);
+    level->batch_count = 0;
+
+    if (level->num_nodes == 1) {
+      level->first_page_num = table->root_page_num;
+      level->batch_first_page_num = table->root_page_num;
+      break;
+    }
+    level->first_page_num = next_page_num;
+    level->batch_first_page_num = next_page_num;
+    next_page_num += level->num_nodes;
+
+    num_entries = level->num_nodes;
+    num_nodes = (num_entries + internal_capacity - 1) / internal_capacity;
+  }
+}
+
+/*
+ * Returns true once the leaf being filled has its share of the rows. Leaf i
+ * ends with the row that reaches (i + 1) / num_nodes of all the bytes, so the
+ * leaves come out about the same size. If some rows are large enough that the
+ * leaves would run out of rows, each of the last leaves gets one.
+ */
+static bool leaf_is_full(Level* level) {
+  uint64_t share_end =
+      level->num_bytes * (level->node_index + 1) / level->num_nodes;
+  uint64_t rows_left = level->num_entries - level->entries_added;
+  uint64_t leaves_left = level->num_nodes - level->node_index - 1;
+  return level->bytes_added >= share_end || rows_left <= leaves_left;
+}
+
+/*
+ * Number of entries that go into the node being filled at LEVEL.
+ */
+static uint32_t level_node_size(Level* level) {
+  uint32_t size = level->num_entries / level->num_nodes;
+  if (level->node_index < level->num_entries % level->num_nodes) {
+    size++;
+  }
+  return size;
+}
+
+static bool builder_is_top(TreeBuilder* builder, uint32_t level_num) {
+  return level_num == builder->num_levels - 1;
+}
+
+/*
+ * Writes the full nodes in the batch of LEVEL to the database file.
+ */
+static void level_write_batch(TreeBuilder* builder, Level* level) {
+  if (level->batch_count == 0) {
+    return;
+  }
+  pager_write_pages(builder->table->pager, level->batch_first_page_num,
+                    level->batch, level->batch_count);
+  level->batch_first_page_num += level->batch_count;
+  level->batch_count = 0;
+}
+
+/*
+ * Starts the next node of LEVEL_NUM in its batch.
+ */
+static void builder_open_node(TreeBuilder* builder, uint32_t level_num) {
+  Level* level = &builder->levels[level_num];
+  if (level->batch_count == LOAD_BATCH_PAGES) {
+    level_write_batch(builder, level);
+  }
+  level->node = level->batch + (size_t)level->batch_count * PAGE_SIZE;
+  if (level_num == 0) {
+    initialize_leaf_node(level->node);
+  } else {
+    initialize_internal_node(level->node);
+  }
+}
+
+static void builder_add_child(TreeBuilder* builder, uint32_t level_num,
+                              uint32_t child_page_num, uint64_t child_max_key);
+
+/*
+ * Finishes the node being filled at LEVEL_NUM and hands it to the level above.
+ * The root is copied to its page in the buffer pool instead.
+ */
+static void builder_close_node(TreeBuilder* builder, uint32_t level_num) {
+  Level* level = &builder->levels[level_num];
+  void* node = level->node;
+  uint32_t page_num = level->first_page_num + level->node_index;
+  bool is_top = builder_is_top(builder, level_num);
+  bool is_last = level->node_index + 1 == level->num_nodes;
+
+  if (level_num == 0) {
+    *leaf_node_next_leaf(node) = is_last ? 0 : page_num + 1;
+  } else {
+    /* Keys were stored in full width until the range of the node was known. */
+    internal_node_set_fences(node, level->lower_fence,
+                             is_last ? UINT64_MAX : level->max_key);
+  }
+  level->lower_fence = level->max_key;
+
+  if (is_top) {
+    Pager* pager = builder->table->pager;
+    void* root = get_page(pager, page_num);
+    memcpy(root, node, PAGE_SIZE);
+    set_node_root(root, true);
+    mark_page_dirty(pager, page_num);
+    unpin_page(pager, page_num);
+  } else {
+    Level* parent_level = &builder->levels[level_num + 1];
+    *node_parent(node) =
+        parent_level->first_page_num + parent_level->node_index;
+    level->batch_count++;
+    builder_add_child(builder, level_num + 1, page_num, level->max_key);
+  }
+
+  level->node_index++;
+  level->node_fill = 0;
+}
+
+/*
+ * Adds a child to the internal node being filled at LEVEL_NUM.
+ */
+static void builder_add_child(TreeBuilder* builder, uint32_t level_num,
+                              uint32_t child_page_num, uint64_t child_max_key) {
+  Level* level = &builder->levels[level_num];
+  if (level->node_fill == 0) {
+    builder_open_node(builder, level_num);
+  }
+
+  void* node = level->node;
+  if (level->node_fill > 0) {
+    /* The previous right child gets a cell of its own */
+    uint32_t num_keys = *internal_node_num_keys(node);
+    *internal_node_num_keys(node) = num_keys + 1;
+    *internal_node_child(node, num_keys) = *internal_node_right_child(node);
+    internal_node_set_key(node, num_keys, level->max_key);
+  }
+  *internal_node_right_child(node) = child_page_num;
+  level->max_key = child_max_key;
+
+  if (++level->node_fill == level_node_size(level)) {
+    builder_close_node(builder, level_num);
+  }
+}
+
+/*
+ * Appends ROW to the leaf being filled. Rows must come in key order.
+ */
+static void builder_add_row(TreeBuilder* builder, Row* row) {
+  Level* level = &builder->levels[0];
+  if (level->node_fill == 0) {
+    builder_open_node(builder, 0);
+  }
+
+  leaf_node_insert_row(level->node, level->node_fill, row);
+  level->node_fill++;
+  level->max_key = row->id;
+  level->bytes_added += row_size(row) + LEAF_NODE_CELL_POINTER_SIZE;
+  level->entries_added++;
+
+  if (leaf_is_full(level)) {
+    builder_close_node(builder, 0);
+  }
+}
+
+/*
+ * Writes the batches that are still partly filled.
+ */
+static void builder_finish(TreeBuilder* builder) {
+  for (uint32_t i = 0; i < builder->num_levels; i++) {
+    level_write_batch(builder, &builder->levels[i]);
+  }
+}
+
+static void builder_free(TreeBuilder* builder) {
+  for (uint32_t i = 0; i < builder->num_levels; i++) {
+    free(builder->levels[i].batch);
+  }
+}
+
+/*
+ * Returns true if TABLE has no rows.
+ */
+static bool table_is_empty(Table* table) {
+  void* root = get_page(table->pager, table->root_page_num);
+  bool is_empty =
+      get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+  unpin_page(table->pager, table->root_page_num);
+  return is_empty;
+}
+
+/*
+ * Reads every row of FILE into STREAM, spilling sorted runs whenever the sort
+ * buffer is full.
+ */
+static LoadResult read_rows(RowStream* stream, FILE* file, uint32_t capacity,
+                            LoadSummary* summary) {
+  char* line = NULL;
+  size_t line_capacity = 0;
+  ssize_t line_length;
+  uint64_t line_num = 0;
+
+  while ((line_length = getline(&line, &line_capacity, file)) != -1) {
+    line_num++;
+    while (line_length > 0 &&
+           (line[line_length - 1] == '\n' || line[line_length - 1] == '\r')) {
+      line[--line_length] = '\0';
+    }
+    if (line_length == 0) {
+      continue;
+    }
+
+    if (stream->num_rows == capacity) {
+      spill_run(stream);
+    }
+    Row* row = &stream->rows[stream->num_rows];
+    if (prepare_row(line, row) != PREPARE_SUCCESS) {
+      summary->error_line = line_num;
+      free(line);
+      return LOAD_INVALID_ROW;
+    }
+    uint32_t row_bytes = row_size(row) + LEAF_NODE_CELL_POINTER_SIZE;
+    stream->num_bytes += row_bytes;
+    if (row_bytes > stream->max_row_bytes) {
+      stream->max_row_bytes = row_bytes;
+    }
+    stream->keys[stream->num_rows].id = row->id;
+    stream->keys[stream->num_rows].index = stream->num_rows;
+    stream->num_rows++;
+    summary->num_rows++;
+  }
+
+  free(line);
+  return LOAD_SUCCESS;
+}
+
+/*
+ * Loads the rows in FILENAME into TABLE, which has to be empty.
+ * Each node is filled up to FILL_PERCENT of its capacity. At most SORT_MEMORY
+ * bytes of rows are sorted in memory at a time.
+ * Nothing is loaded if a row is invalid or a key appears twice. The indexes
+ * of the table are built from the rows once they are in.
+ */
+LoadResult load_file(Table* table, const char* filename, uint32_t fill_percent,
+                     size_t sort_memory, LoadSummary* summary) {
+  summary->num_rows = 0;
+  summary->error_line = 0;
+  summary->error_key = 0;
+
+  if (!table_is_empty(table)) {
+    return LOAD_TABLE_NOT_EMPTY;
+  }
+
+  FILE* file = fopen(filename, "r");
+  if (file == NULL) {
+    return LOAD_CANNOT_OPEN_FILE;
+  }
+
+  uint32_t capacity = sort_memory / (sizeof(Row) + sizeof(SortKey));
+  if (capacity < 1) {
+    capacity = 1;
+  }
+  RowStream stream = {0};
+  stream.rows = malloc((size_t)capacity * sizeof(Row));
+  stream.keys = malloc((size_t)capacity * sizeof(SortKey));
+
+  LoadResult result = read_rows(&stream, file, capacity, summary);
+  fclose(file);
+  if (result != LOAD_SUCCESS || summary->num_rows == 0) {
+    stream_free(&stream);
+    return result;
+  }
+
+  Pager* pager = table->pager;
+  uint32_t original_num_pages = pager->num_pages;
+  TreeBuilder builder;
+  builder_init(&builder, table, summary->num_rows, stream.num_bytes,
+               stream.max_row_bytes, fill_percent);
+
+  stream_start(&stream);
+  Row row;
+  bool has_previous = false;
+  uint64_t previous_key = 0;
+  while (stream_next(&stream, &row)) {
+    if (has_previous && row.id == previous_key) {
+      summary->error_key = row.id;
+      result = LOAD_DUPLICATE_KEY;
+      break;
+    }
+    builder_add_row(&builder, &row);
+    previous_key = row.id;
+    has_previous = true;
+  }
+  stream_free(&stream);
+
+  if (result != LOAD_SUCCESS) {
+    /* The root was never touched, so dropping the new pages is enough. */
+    builder_free(&builder);
+    pager_truncate(pager, original_num_pages);
+    return result;
+  }
+
+  /* The new pages have to be on disk before the root that points to them. */
+  builder_finish(&builder);
+  builder_free(&builder);
+  pager_sync_file(pager);
+
+  /* The indexes were as empty as the table, and are filled from it now. */
+  for (uint32_t i = 0; i < NUM_INDEXED_COLUMNS; i++) {
+    if (table->indexes[i] != NULL) {
+      index_build(table, i);
+    }
+  }
+  pager_commit(pager);
+  pager_sync(pager);
+
+  return LOAD_SUCCESS;
+}
+
+/*
+ * Prints the outcome of a load.
+ */
+void print_load_result(LoadResult result, LoadSummary* summary) {
+  switch (result) {
+  case LOAD_SUCCESS:
+    printf("Loaded %lu rows.\n", summary->num_rows);
+    break;
+  case LOAD_CANNOT_OPEN_FILE:
+    printf("Error: Could not open input file.\n");
+    break;
+  case LOAD_INVALID_ROW:
+    printf("Error: Invalid row on line %lu.\n", summary->error_line);
+    break;
+  case LOAD_DUPLICATE_KEY:
+    printf("Error: Key %lu appears more than once.\n", summary->error_key);
+    break;
+  case LOAD_TABLE_NOT_EMPTY:
+    printf("Error: Bulk load needs an empty table.\n");
+    break;
+  }
+}
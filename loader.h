@@ -0,0 +1,32 @@
+/********************************************************************************
+ * loader.h : Bulk loading of rows into an empty table
+ ********************************************************************************/
+#ifndef _LOADER_H
+#define _LOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "internals.h"
+#include "results.h"
+
+/* Percentage of each node that a bulk load fills, leaving room for inserts. */
+#define LOAD_DEFAULT_FILL_PERCENT 90
+
+/* Rows are sorted in memory this many bytes at a time. */
+#define LOAD_DEFAULT_SORT_MEMORY (64 * 1024 * 1024)
+
+/*
+ * Outcome of a load. Which of the error fields is set depends on the result.
+ */
+typedef struct {
+  uint64_t num_rows;
+  uint64_t error_line; /* Line of a row that could not be parsed */
+  uint64_t error_key;  /* Key that appears more than once */
+} LoadSummary;
+
+LoadResult load_file(Table* table, const char* filename, uint32_t fill_percent,
+                     size_t sort_memory, LoadSummary* summary);
+void print_load_result(LoadResult result, LoadSummary* summary);
+
+#endif
@@ -3,16 +3,51 @@
  ********************************************************************************/
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "catalog.h"
 #include "interface.h"
 #include "internals.h"
 #include "processor.h"
+#include "server.h"
+
+/*
+ * Size of the stdout buffer. Acknowledgements wait in it until the log is
+ * synced, so a statement is never reported as executed before it is durable.
+ * stdio writes the buffer out by itself once it is full, so the log is synced
+ * and the buffer released while it still has room for OUTPUT_MAX_LINE_SIZE
+ * bytes, which is more than the prompt and any fixed message take up.
+ */
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define OUTPUT_MAX_LINE_SIZE 256
+
+static char output_buffer[OUTPUT_BUFFER_SIZE];
+
+/*
+ * Makes the committed statements durable, then writes out the output that
+ * was held back until they were.
+ */
+static void release_output(Database* database) {
+  pager_sync(database->pager);
+  fflush(stdout);
+}
 
 /*
  * Entry point for the simpledb program.
  *
  * Opens the given database file, or creates if it doesn't exist.
+ * Options after the filename:
+ *   --frames N      number of pages the buffer pool keeps in memory
+ *   --mmap          read pages through a memory mapping of the file
+ *   --sync-io       use blocking reads and writes instead of io_uring
+ *   --binary        write result rows in the binary format (see output.h)
+ *   --page-size N   size of the pages of a new database file, in bytes
+ *   --serve ADDRESS serve the default table to clients on ADDRESS, a Unix
+ *                   socket path or a TCP port (see server.h), instead of
+ *                   reading statements from stdin
  * Reads user input, and if the input is a meta-command executes it.
  * Otherwise it prepares the statement and executes it.
  */
@@ -23,17 +58,60 @@ int main(int argc, char* argv[]) {
   }
 
   char* filename = argv[1];
-  Table* table = db_open(filename);
+  PagerOptions options = {.num_frames = PAGER_DEFAULT_FRAMES};
+  ResultFormat result_format = RESULT_TEXT;
+  char* serve_address = NULL;
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      options.num_frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options.use_mmap = true;
+    } else if (strcmp(argv[i], "--sync-io") == 0) {
+      options.sync_io = true;
+    } else if (strcmp(argv[i], "--binary") == 0) {
+      result_format = RESULT_BINARY;
+    } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+      options.page_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      serve_address = argv[++i];
+    } else {
+      printf("Unknown option '%s'. Quitting..\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  Database* database = db_open(filename, options);
+  if (serve_address != NULL) {
+    server_run(database, serve_address);
+    db_close(database);
+    return EXIT_SUCCESS;
+  }
+
   InputBuffer* input_buffer = new_input_buffer();
+  setvbuf(stdout, output_buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+  ResultWriter* result_writer = result_writer_open(STDOUT_FILENO, result_format);
 
   /* REPL */
   while (true) {
+    /*
+     * Group commit: inserts that are piped in back to back share one log sync.
+     * Before waiting for more input, or before stdio would write out the held
+     * back output on its own, the log is synced and the output released.
+     */
+    if (__fpending(stdout) + OUTPUT_MAX_LINE_SIZE > OUTPUT_BUFFER_SIZE) {
+      release_output(database);
+    }
     print_prompt();
+    if (!input_pending()) {
+      release_output(database);
+    }
     read_input(input_buffer);
 
     /* Meta-commands begin with a . (dot) character */
     if (input_buffer->buffer[0] == '.') {
-      switch (do_meta_command(input_buffer, table)) {
+      pager_sync(database->pager);
+      switch (do_meta_command(input_buffer, database)) {
         case (META_COMMAND_SUCCESS):
           continue;
         case (META_COMMAND_UNRECOGNIZED_COMMAND):
@@ -50,6 +128,8 @@ int main(int argc, char* argv[]) {
         printf("Syntax error. Could not parse statement.\n");
         continue;
       case (PREPARE_UNRECOGNIZED_STATEMENT):
+        /* The message repeats the input, which may be of any length. */
+        release_output(database);
         printf("Unrecognized keyword at start of '%s'\n", input_buffer->buffer);
         continue;
       case (PREPARE_STRING_TOO_LONG):
@@ -60,7 +140,15 @@ int main(int argc, char* argv[]) {
         continue;
     }
 
-    switch (execute_statement(&statement, table)) {
+    /*
+     * Anything but an insert may print more than the output buffer holds.
+     * Its rows bypass stdio, so what is buffered there goes out first.
+     */
+    if (statement.type != STATEMENT_INSERT) {
+      release_output(database);
+    }
+
+    switch (execute_statement(&statement, database, result_writer)) {
       case (EXECUTE_SUCCESS):
         printf("Executed.\n");
         break;
@@ -70,6 +158,27 @@ int main(int argc, char* argv[]) {
       case (EXECUTE_DUPLICATE_KEY):
         printf("Error: Key already exits.\n");
         break;
+      case (EXECUTE_KEY_NOT_FOUND):
+        printf("Error: Key not found.\n");
+        break;
+      case (EXECUTE_INDEX_EXISTS):
+        printf("Error: Index already exists.\n");
+        break;
+      case (EXECUTE_TABLE_EXISTS):
+        printf("Error: Table already exists.\n");
+        break;
+      case (EXECUTE_TABLE_NOT_FOUND):
+        printf("Error: Table not found.\n");
+        break;
+      case (EXECUTE_CATALOG_FULL):
+        printf("Error: Too many tables.\n");
+        break;
+      case (EXECUTE_TRANSACTION_OPEN):
+        printf("Error: A transaction is open.\n");
+        break;
+      case (EXECUTE_NO_TRANSACTION):
+        printf("Error: No transaction is open.\n");
+        break;
     }
   }
 }
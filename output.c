@@ -0,0 +1,151 @@
+/********************************************************************************
+ * output.c : Buffered writing of result rows to a file descriptor
+ *
+ * Rows are formatted straight from the fields they are given, which may point
+ * into a page of the buffer pool, so nothing is copied into a Row first and
+ * stdio is not involved.
+ ********************************************************************************/
+#include "output.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The most bytes a row takes up: the binary header or 20 digits and spaces. */
+#define RESULT_MAX_ROW_OVERHEAD 24
+
+/*
+ * Creates a writer for rows in FORMAT to FD.
+ */
+ResultWriter *result_writer_open(int fd, ResultFormat format) {
+  ResultWriter *writer = malloc(sizeof(ResultWriter));
+  writer->fd = fd;
+  writer->format = format;
+  writer->buffer = malloc(RESULT_BUFFER_SIZE);
+  writer->length = 0;
+  return writer;
+}
+
+/*
+ * Writes out what is left in the buffer and frees the writer. The file
+ * descriptor stays open.
+ */
+void result_writer_close(ResultWriter *writer) {
+  result_writer_flush(writer);
+  free(writer->buffer);
+  free(writer);
+}
+
+/*
+ * Writes the buffered rows to the file descriptor.
+ */
+void result_writer_flush(ResultWriter *writer) {
+  size_t written = 0;
+  while (written < writer->length) {
+    ssize_t result = write(writer->fd, writer->buffer + written,
+                           writer->length - written);
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error writing results: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    written += result;
+  }
+  writer->length = 0;
+}
+
+/*
+ * Writes VALUE in decimal to DESTINATION and returns the number of digits.
+ */
+static size_t format_uint64(char *destination, uint64_t value) {
+  char digits[20];
+  size_t count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+
+  for (size_t i = 0; i < count; i++) {
+    destination[i] = digits[count - 1 - i];
+  }
+  return count;
+}
+
+static void put_uint16(char *destination, uint16_t value) {
+  destination[0] = value & 0xff;
+  destination[1] = value >> 8;
+}
+
+static void put_uint32(char *destination, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    destination[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+static void put_uint64(char *destination, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    destination[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+/*
+ * Adds a row to the result, writing out the buffer first if the row does
+ * not fit in it anymore.
+ */
+void result_writer_add_row(ResultWriter *writer, uint64_t id,
+                           const char *username, size_t username_length,
+                           const char *email, size_t email_length) {
+  size_t row_size = RESULT_MAX_ROW_OVERHEAD + username_length + email_length;
+  if (writer->length + row_size > RESULT_BUFFER_SIZE) {
+    result_writer_flush(writer);
+  }
+
+  char *out = writer->buffer + writer->length;
+  if (writer->format == RESULT_BINARY) {
+    put_uint32(out, 8 + 2 + username_length + 2 + email_length);
+    put_uint64(out + 4, id);
+    out += 12;
+    put_uint16(out, username_length);
+    memcpy(out + 2, username, username_length);
+    out += 2 + username_length;
+    put_uint16(out, email_length);
+    memcpy(out + 2, email, email_length);
+    out += 2 + email_length;
+  } else {
+    out += format_uint64(out, id);
+    *out++ = ' ';
+    memcpy(out, username, username_length);
+    out += username_length;
+    *out++ = ' ';
+    memcpy(out, email, email_length);
+    out += email_length;
+    *out++ = '\n';
+  }
+  writer->length = out - writer->buffer;
+}
+
+/*
+ * Ends the rows of a statement in the buffer, without writing them out.
+ */
+void result_writer_add_end(ResultWriter *writer) {
+  if (writer->format == RESULT_BINARY) {
+    if (writer->length + 4 > RESULT_BUFFER_SIZE) {
+      result_writer_flush(writer);
+    }
+    put_uint32(writer->buffer + writer->length, 0);
+    writer->length += 4;
+  }
+}
+
+/*
+ * Ends the rows of a statement and writes them out, so they reach the reader
+ * before anything else the statement prints.
+ */
+void result_writer_end(ResultWriter *writer) {
+  result_writer_add_end(writer);
+  result_writer_flush(writer);
+}
@@ -0,0 +1,45 @@
+/********************************************************************************
+ * output.h : Buffered writing of result rows to a file descriptor
+ ********************************************************************************/
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Rows are gathered in a buffer of this size and written with one call. */
+#define RESULT_BUFFER_SIZE (256 * 1024)
+
+/*
+ * RESULT_TEXT writes a row as "id username email" and a newline.
+ * RESULT_BINARY is meant for programs. Each row is a frame made of a 32 bit
+ * length of the rest of the frame, the 64 bit id, and the username and the
+ * email, each as a 16 bit length followed by that many bytes. A frame of
+ * length 0 ends the rows of a statement. Integers are little endian.
+ */
+typedef enum {
+  RESULT_TEXT,
+  RESULT_BINARY
+} ResultFormat;
+
+/*
+ * Collects formatted rows in BUFFER until it is full or the statement ends,
+ * then writes them to FD.
+ */
+typedef struct {
+  int fd;
+  ResultFormat format;
+  char* buffer;
+  size_t length;
+} ResultWriter;
+
+ResultWriter* result_writer_open(int fd, ResultFormat format);
+void result_writer_close(ResultWriter* writer);
+void result_writer_add_row(ResultWriter* writer, uint64_t id,
+                           const char* username, size_t username_length,
+                           const char* email, size_t email_length);
+void result_writer_add_end(ResultWriter* writer);
+void result_writer_end(ResultWriter* writer);
+void result_writer_flush(ResultWriter* writer);
+
+#endif
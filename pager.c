@@ -0,0 +1,1820 @@
+/********************************************************************************
+ * pager.c : Buffer pool that caches the pages of the database file
+ ********************************************************************************/
+#define _GNU_SOURCE
+#include "pager.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Linux accepts at most this many buffers in a single pwritev call. */
+#define PAGER_MAX_IOVECS 1024
+
+/*
+ * The user data of an I/O request holds its kind in the upper half, and the
+ * frame read into or the number of pages written in the lower half.
+ */
+#define PAGER_IO_READ 1
+#define PAGER_IO_WRITE 2
+#define pager_io_user_data(kind, value) (((uint64_t)(kind) << 32) | (value))
+
+uint32_t PAGE_SIZE = PAGER_DEFAULT_PAGE_SIZE;
+
+/* Pagers that are open, so their logs can be synced when the process exits. */
+static Pager *open_pagers = NULL;
+static bool exit_handler_registered = false;
+
+/* The pager this thread writes to, between pager_begin_write and
+ * pager_end_write. */
+static _Thread_local Pager *writing_pager = NULL;
+
+/* The pager this thread reads a snapshot of, between pager_begin_snapshot and
+ * pager_end_snapshot, and the commit timestamp of the snapshot. */
+static _Thread_local Pager *snapshot_pager = NULL;
+static _Thread_local uint64_t snapshot_ts = 0;
+
+/* The pager this thread is the writer of but reads like a reader without a
+ * snapshot, between pager_begin_snapshot and pager_end_snapshot. */
+static _Thread_local Pager *paused_pager = NULL;
+
+/* How many pages this thread holds latched as a reader, see rollback_latch. */
+static _Thread_local uint32_t num_read_latches = 0;
+
+/*
+ * Takes the latch of the buffer pool, which threads hold while they look at
+ * or change the frames, the log or the I/O ring. It is recursive, so public
+ * functions can call each other. Without threads it is not used.
+ */
+static void pager_lock(Pager *pager) {
+  if (pager->threaded) {
+    pthread_mutex_lock(&pager->mutex);
+  }
+}
+
+static void pager_unlock(Pager *pager) {
+  if (pager->threaded) {
+    pthread_mutex_unlock(&pager->mutex);
+  }
+}
+
+/*
+ * Make the version of FRAME odd before its page changes and even again after,
+ * so optimistic readers (see pager_read_begin) notice.
+ */
+static void frame_begin_change(Frame *frame) {
+  __atomic_store_n(&frame->version, frame->version + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void frame_end_change(Frame *frame) {
+  __atomic_store_n(&frame->version, frame->version + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the head of the page table bucket for PAGE_NUM.
+ * Page numbers are handed out sequentially, so masking the low bits spreads
+ * them evenly over the buckets.
+ */
+static int32_t *page_table_bucket(Pager *pager, uint32_t page_num) {
+  return &pager->page_table[page_num & pager->page_table_mask];
+}
+
+/*
+ * Returns the index of the frame holding PAGE_NUM, or -1 if it is not cached.
+ */
+static int32_t page_table_lookup(Pager *pager, uint32_t page_num) {
+  int32_t frame_index = *page_table_bucket(pager, page_num);
+  while (frame_index != -1) {
+    if (pager->frames[frame_index].page_num == page_num) {
+      return frame_index;
+    }
+    frame_index = pager->frames[frame_index].hash_next;
+  }
+  return -1;
+}
+
+/*
+ * The page table is changed with atomic stores, since pager_read_begin walks
+ * it without the latch of the pool.
+ */
+static void page_table_insert(Pager *pager, int32_t frame_index) {
+  int32_t *bucket = page_table_bucket(pager, pager->frames[frame_index].page_num);
+  __atomic_store_n(&pager->frames[frame_index].hash_next, *bucket,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(bucket, frame_index, __ATOMIC_RELEASE);
+}
+
+static void page_table_remove(Pager *pager, int32_t frame_index) {
+  int32_t *link = page_table_bucket(pager, pager->frames[frame_index].page_num);
+  while (*link != frame_index) {
+    link = &pager->frames[*link].hash_next;
+  }
+  __atomic_store_n(link, pager->frames[frame_index].hash_next,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&pager->frames[frame_index].hash_next, -1,
+                   __ATOMIC_RELAXED);
+}
+
+static uint32_t spill_map_slot(SpillMap *map, uint32_t page_num) {
+  uint32_t slot = page_num & (map->capacity - 1);
+  while (map->page_nums[slot] != INVALID_PAGE_NUM &&
+         map->page_nums[slot] != page_num) {
+    slot = (slot + 1) & (map->capacity - 1);
+  }
+  return slot;
+}
+
+static void spill_map_init(SpillMap *map, uint32_t capacity) {
+  map->capacity = capacity;
+  map->count = 0;
+  map->page_nums = malloc(capacity * sizeof(uint32_t));
+  map->lsns = malloc(capacity * sizeof(uint64_t));
+  for (uint32_t i = 0; i < capacity; i++) {
+    map->page_nums[i] = INVALID_PAGE_NUM;
+  }
+}
+
+/*
+ * Returns the LSN of the spilled image of PAGE_NUM, or 0 if it was not spilled.
+ */
+static uint64_t spill_map_get(SpillMap *map, uint32_t page_num) {
+  uint32_t slot = spill_map_slot(map, page_num);
+  return map->page_nums[slot] == page_num ? map->lsns[slot] : 0;
+}
+
+static void spill_map_put(SpillMap *map, uint32_t page_num, uint64_t lsn) {
+  if (2 * (map->count + 1) > map->capacity) {
+    SpillMap grown;
+    spill_map_init(&grown, 2 * map->capacity);
+    for (uint32_t i = 0; i < map->capacity; i++) {
+      if (map->page_nums[i] != INVALID_PAGE_NUM) {
+        spill_map_put(&grown, map->page_nums[i], map->lsns[i]);
+      }
+    }
+    free(map->page_nums);
+    free(map->lsns);
+    *map = grown;
+  }
+
+  uint32_t slot = spill_map_slot(map, page_num);
+  if (map->page_nums[slot] == INVALID_PAGE_NUM) {
+    map->count++;
+  }
+  map->page_nums[slot] = page_num;
+  map->lsns[slot] = lsn;
+}
+
+/*
+ * Removes PAGE_NUM from the map. The entries after it in the probe sequence
+ * are shifted back so that lookups never stop at the hole.
+ */
+static void spill_map_remove(SpillMap *map, uint32_t page_num) {
+  uint32_t mask = map->capacity - 1;
+  uint32_t hole = spill_map_slot(map, page_num);
+  if (map->page_nums[hole] == INVALID_PAGE_NUM) {
+    return;
+  }
+  map->count--;
+
+  uint32_t slot = hole;
+  while (true) {
+    slot = (slot + 1) & mask;
+    if (map->page_nums[slot] == INVALID_PAGE_NUM) {
+      break;
+    }
+    uint32_t home = map->page_nums[slot] & mask;
+    /* Move the entry unless its home lies cyclically in (hole, slot]. */
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      map->page_nums[hole] = map->page_nums[slot];
+      map->lsns[hole] = map->lsns[slot];
+      hole = slot;
+    }
+  }
+  map->page_nums[hole] = INVALID_PAGE_NUM;
+}
+
+/*
+ * Returns true if FRAME's data lives in the mapping of the database file.
+ */
+static bool frame_is_mapped(Pager *pager, Frame *frame) {
+  return pager->map != NULL && frame->data >= pager->map &&
+         frame->data < pager->map + PAGER_MMAP_RESERVE;
+}
+
+/*
+ * Returns the head of the version table bucket for PAGE_NUM. The version
+ * table has as many buckets as the page table.
+ */
+static PageVersion **version_table_bucket(Pager *pager, uint32_t page_num) {
+  return &pager->version_table[page_num & pager->page_table_mask];
+}
+
+/*
+ * Returns the commit timestamp of the newest version of PAGE_NUM, or 0 if it
+ * has none. A page that is read in again changed last with that statement.
+ */
+static uint64_t pager_newest_version_ts(Pager *pager, uint32_t page_num) {
+  for (PageVersion *version = *version_table_bucket(pager, page_num);
+       version != NULL; version = version->hash_next) {
+    if (version->page_num == page_num) {
+      return version->commit_ts;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Keeps the content of the page in FRAME as a version before the writer
+ * changes it for the first time in a statement. The frame trades its buffer
+ * for a copy that the writer changes, and the buffer becomes the version, so
+ * readers that got it before keep reading it without a latch. A mapped page
+ * is copied into the version instead.
+ * Only needed when readers may take snapshots, so not in mmap mode, or when a
+ * transaction may be rolled back. The pool must be latched.
+ */
+static void frame_save_version(Pager *pager, Frame *frame) {
+  uint64_t commit_ts = pager->commit_ts + 1;
+  if ((!pager->in_transaction && (!pager->threaded || pager->map != NULL)) ||
+      frame->commit_ts == commit_ts) {
+    return;
+  }
+
+  PageVersion *version = pager->free_versions;
+  if (version != NULL) {
+    pager->free_versions = version->next;
+  } else {
+    version = malloc(sizeof(PageVersion));
+    version->data = malloc(PAGE_SIZE);
+  }
+  version->page_num = frame->page_num;
+  version->commit_ts = commit_ts;
+
+  PageVersion **bucket = version_table_bucket(pager, frame->page_num);
+  version->hash_next = *bucket;
+  *bucket = version;
+  version->next = NULL;
+  if (pager->newest_version == NULL) {
+    pager->oldest_version = version;
+  } else {
+    pager->newest_version->next = version;
+  }
+  pager->newest_version = version;
+
+  if (frame_is_mapped(pager, frame)) {
+    memcpy(version->data, frame->data, PAGE_SIZE);
+  } else {
+    void *copy = version->data;
+    memcpy(copy, frame->data, PAGE_SIZE);
+    version->data = frame->data;
+    frame->buffer = copy;
+    __atomic_store_n(&frame->data, copy, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&frame->commit_ts, commit_ts, __ATOMIC_RELAXED);
+}
+
+/*
+ * Lets go of the versions that no snapshot needs anymore: the ones that are
+ * not newer than the oldest snapshot, or than the last commit, which every
+ * snapshot taken from now on sees. The pool must be latched.
+ */
+static void pager_collect_versions(Pager *pager) {
+  uint64_t horizon = pager->commit_ts;
+  for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+    if (pager->snapshots[i] < horizon) {
+      horizon = pager->snapshots[i];
+    }
+  }
+
+  while (pager->oldest_version != NULL &&
+         pager->oldest_version->commit_ts <= horizon) {
+    PageVersion *version = pager->oldest_version;
+    PageVersion **link = version_table_bucket(pager, version->page_num);
+    while (*link != version) {
+      link = &(*link)->hash_next;
+    }
+    *link = version->hash_next;
+
+    pager->oldest_version = version->next;
+    if (pager->oldest_version == NULL) {
+      pager->newest_version = NULL;
+    }
+    version->next = pager->free_versions;
+    pager->free_versions = version;
+  }
+}
+
+/*
+ * Returns the content of the page in FRAME as the calling thread sees it: as
+ * of its snapshot if it took one, see pager_begin_snapshot. A page that
+ * changed since has a version the snapshot needs, which is kept until the
+ * snapshot ends. The pool must be latched.
+ */
+static void *frame_snapshot_data(Pager *pager, Frame *frame) {
+  if (snapshot_pager != pager || frame->commit_ts <= snapshot_ts) {
+    return frame->data;
+  }
+  void *data = NULL;
+  for (PageVersion *version = *version_table_bucket(pager, frame->page_num);
+       version != NULL; version = version->hash_next) {
+    if (version->page_num == frame->page_num &&
+        version->commit_ts > snapshot_ts) {
+      data = version->data;
+    }
+  }
+  return data;
+}
+
+/*
+ * Extends the mapping of the database file until it covers the whole file.
+ * The mapping is private, so changes to mapped pages never reach the file on
+ * their own. Pages are written back with pwrite like in the normal mode.
+ */
+static void pager_map_file(Pager *pager) {
+  while (pager->map_length < pager->file_length) {
+    if (pager->map_length + PAGER_MMAP_CHUNK_SIZE > PAGER_MMAP_RESERVE) {
+      printf("Db file is too large to map.\n");
+      exit(EXIT_FAILURE);
+    }
+    void *chunk = mmap(pager->map + pager->map_length, PAGER_MMAP_CHUNK_SIZE,
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                       pager->file_descriptor, pager->map_length);
+    if (chunk == MAP_FAILED) {
+      printf("Error mapping db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->map_length += PAGER_MMAP_CHUNK_SIZE;
+  }
+}
+
+/*
+ * Checks the result of a finished I/O request. A frame that was read into is
+ * ready for use and loses the pin its read held.
+ */
+static void pager_complete_io(Pager *pager, IoCompletion *completion) {
+  uint32_t kind = completion->user_data >> 32;
+  uint32_t value = (uint32_t)completion->user_data;
+
+  if (kind == PAGER_IO_READ) {
+    if (completion->result != (int32_t)PAGE_SIZE) {
+      printf("Error reading file: %d\n", -completion->result);
+      exit(EXIT_FAILURE);
+    }
+    Frame *frame = &pager->frames[value];
+    frame->io_pending = false;
+    frame->pin_count--;
+    frame_end_change(frame);
+    pager->num_reads_in_flight--;
+  } else if (completion->result != (int32_t)(value * PAGE_SIZE)) {
+    printf("Error writing: %d\n", -completion->result);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Handles one finished I/O request, waiting for one if WAIT is set.
+ * Returns false if there was none.
+ */
+static bool pager_reap_io(Pager *pager, bool wait) {
+  IoCompletion completion;
+  if (!io_reap(pager->io, &completion, wait)) {
+    return false;
+  }
+  pager_complete_io(pager, &completion);
+  return true;
+}
+
+/*
+ * Releases the frames whose reads ahead are done, without waiting for the
+ * others.
+ */
+static void pager_reap_reads(Pager *pager) {
+  while (pager->num_reads_in_flight > 0 && pager_reap_io(pager, false)) {
+  }
+}
+
+/*
+ * Waits until every I/O request the pager made has finished.
+ */
+static void pager_wait_io(Pager *pager) {
+  while (io_num_pending(pager->io) > 0) {
+    pager_reap_io(pager, true);
+  }
+}
+
+/*
+ * Takes the frame at FRAME_INDEX off the list of uncommitted frames.
+ */
+static void frame_forget_uncommitted(Pager *pager, int32_t frame_index) {
+  for (uint32_t i = 0; i < pager->num_uncommitted; i++) {
+    if (pager->uncommitted_frames[i] == (uint32_t)frame_index) {
+      pager->uncommitted_frames[i] =
+          pager->uncommitted_frames[--pager->num_uncommitted];
+      break;
+    }
+  }
+  pager->frames[frame_index].uncommitted = false;
+}
+
+/*
+ * Appends the image of an uncommitted frame to the log, so the frame can be
+ * reused before the statement that modified it commits. Until the next
+ * checkpoint the page is read back from the log instead of the database file.
+ * If the statement never commits, replay ignores the record.
+ */
+static void pager_spill(Pager *pager, int32_t frame_index) {
+  Frame *frame = &pager->frames[frame_index];
+  uint64_t lsn = wal_append(pager->wal, WAL_RECORD_PAGE, frame->page_num,
+                            frame->data, PAGE_SIZE);
+  spill_map_put(&pager->spilled, frame->page_num, lsn);
+  pager->num_uncommitted_spills++;
+
+  frame_forget_uncommitted(pager, frame_index);
+  frame->dirty = false;
+  pager->num_dirty--;
+}
+
+/*
+ * Picks a frame to hold a new page using the CLOCK policy.
+ * The hand skips pinned frames and gives recently used frames a second chance
+ * by clearing their reference bit. The page in the chosen frame is written
+ * back if it is dirty and dropped from the page table.
+ * Frames modified by the running statement are only taken when there is no
+ * other choice, they are spilled to the log instead of written back.
+ */
+static int32_t pager_evict(Pager *pager) {
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    bool may_spill = (pass == 1);
+    for (uint32_t i = 0; i < 2 * pager->num_frames; i++) {
+      int32_t frame_index = pager->clock_hand;
+      Frame *frame = &pager->frames[frame_index];
+      pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+      if (frame->pin_count > 0 || (frame->uncommitted && !may_spill)) {
+        continue;
+      }
+      if (__atomic_load_n(&frame->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&frame->referenced, false, __ATOMIC_RELAXED);
+        continue;
+      }
+
+      if (frame->page_num != INVALID_PAGE_NUM) {
+        if (frame->uncommitted) {
+          pager_spill(pager, frame_index);
+        } else if (frame->dirty) {
+          pager_flush(pager, frame->page_num);
+        }
+        if (frame->private_copy) {
+          madvise(frame->data, PAGE_SIZE, MADV_DONTNEED);
+        }
+        if (frame->read_ahead) {
+          pager->num_wasted_reads++;
+        }
+        page_table_remove(pager, frame_index);
+        __atomic_store_n(&frame->page_num, INVALID_PAGE_NUM, __ATOMIC_RELAXED);
+      }
+      frame_begin_change(frame);
+      return frame_index;
+    }
+  }
+
+  /* Frames being read ahead come free once their reads are done. */
+  if (pager->num_reads_in_flight > 0) {
+    pager_reap_io(pager, true);
+    return pager_evict(pager);
+  }
+
+  printf("Buffer pool exhausted: all %d frames are pinned.\n",
+         pager->num_frames);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Syncs the log of every open pager. Registered with atexit, which runs before
+ * stdio flushes its buffers, so output acknowledging a statement never leaves
+ * the process before the statement is durable.
+ */
+static void pager_sync_open_pagers() {
+  for (Pager *pager = open_pagers; pager != NULL; pager = pager->next_open) {
+    pager_sync(pager);
+  }
+}
+
+/*
+ * Returns the page size of the database file FD of FILE_LENGTH bytes, which
+ * is read from its header. A new file gets the size asked for in OPTIONS.
+ */
+static uint32_t pager_read_page_size(int fd, off_t file_length,
+                                     PagerOptions options) {
+  if (file_length == 0) {
+    uint32_t page_size = options.page_size;
+    if (page_size == 0) {
+      page_size = PAGER_DEFAULT_PAGE_SIZE;
+    }
+    if (page_size < PAGER_MIN_PAGE_SIZE || page_size > PAGER_MAX_PAGE_SIZE ||
+        (page_size & (page_size - 1)) != 0) {
+      printf("Page size must be a power of two from %d to %d.\n",
+             PAGER_MIN_PAGE_SIZE, PAGER_MAX_PAGE_SIZE);
+      exit(EXIT_FAILURE);
+    }
+    return page_size;
+  }
+
+  FileHeader header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, PAGER_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    printf("Not a simpledb database file.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (header.page_size < PAGER_MIN_PAGE_SIZE ||
+      header.page_size > PAGER_MAX_PAGE_SIZE ||
+      (header.page_size & (header.page_size - 1)) != 0) {
+    printf("Invalid page size %d in file header. Corrupted file.\n",
+           header.page_size);
+    exit(EXIT_FAILURE);
+  }
+  return header.page_size;
+}
+
+/*
+ * Creates a pager and initializes its values.
+ * The buffer pool has NUM_FRAMES frames, all of them empty at first.
+ * Pages are only loaded to memory when requested, to keep resource usage low.
+ * Statements that were committed to the log but whose pages never made it to
+ * the database file are replayed first.
+ * The page size comes from the header on page 0, which is written when the
+ * file is created.
+ * The mmap mode needs PAGE_SIZE to be a multiple of the system page size,
+ * otherwise the pager falls back to reading pages into the buffer pool.
+ */
+Pager *pager_open(const char *filename, PagerOptions options) {
+  uint32_t num_frames = options.num_frames;
+  int fd = open(filename,
+                O_RDWR |     /* Read/Write mode */
+                    O_CREAT, /* Create file if it does not exist */
+                S_IWUSR |    /* User write permission */
+                    S_IRUSR  /* User read permission */
+  );
+
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Wal *wal = wal_open(filename);
+  wal_replay(wal, fd);
+
+  off_t file_length = lseek(fd, 0, SEEK_END);
+
+  uint32_t page_size = pager_read_page_size(fd, file_length, options);
+  if (open_pagers != NULL && page_size != PAGE_SIZE) {
+    printf("Cannot open a db file with %d byte pages while one with %d byte "
+           "pages is open.\n",
+           page_size, PAGE_SIZE);
+    exit(EXIT_FAILURE);
+  }
+  PAGE_SIZE = page_size;
+
+  if (file_length % PAGE_SIZE != 0) {
+    printf("Partial page found. Db file should contain a whole number of "
+           "pages. Corrupted file.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (num_frames < PAGER_MIN_FRAMES) {
+    num_frames = PAGER_MIN_FRAMES;
+  }
+
+  Pager *pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->file_length = file_length;
+  pager->num_pages = (file_length / PAGE_SIZE);
+  pager->num_frames = num_frames;
+  pager->num_dirty = 0;
+  pager->num_uncommitted = 0;
+  pager->uncommitted_frames = malloc(num_frames * sizeof(uint32_t));
+  pager->num_uncommitted_spills = 0;
+  spill_map_init(&pager->spilled, 16);
+  pager->commit_lsn = wal->next_lsn;
+  pager->clock_hand = 0;
+  pager->map = NULL;
+  pager->map_length = 0;
+  pager->io = io_open(IO_QUEUE_DEPTH, !options.sync_io);
+  pager->num_reads_in_flight = 0;
+  pager->num_wasted_reads = 0;
+  pager->wal = wal;
+
+  if (options.use_mmap && PAGE_SIZE % sysconf(_SC_PAGESIZE) == 0) {
+    /* Reserve the address space, pager_map_file maps the file into it. */
+    pager->map = mmap(NULL, PAGER_MMAP_RESERVE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pager->map == MAP_FAILED) {
+      printf("Error reserving address space: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (!exit_handler_registered) {
+    atexit(pager_sync_open_pagers);
+    exit_handler_registered = true;
+  }
+  pager->next_open = open_pagers;
+  open_pagers = pager;
+
+  /* A reader never takes a latch it holds again, so the writer can go first
+   * without readers starving it on the pages near the root. */
+  pthread_rwlockattr_t latch_attributes;
+  pthread_rwlockattr_init(&latch_attributes);
+  pthread_rwlockattr_setkind_np(&latch_attributes,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+  pager->frames = malloc(num_frames * sizeof(Frame));
+  for (uint32_t i = 0; i < num_frames; i++) {
+    pager->frames[i].page_num = INVALID_PAGE_NUM;
+    pager->frames[i].pin_count = 0;
+    pager->frames[i].referenced = false;
+    pager->frames[i].dirty = false;
+    pager->frames[i].uncommitted = false;
+    pager->frames[i].private_copy = false;
+    pager->frames[i].io_pending = false;
+    pager->frames[i].read_ahead = false;
+    pager->frames[i].lsn = 0;
+    pager->frames[i].hash_next = -1;
+    pager->frames[i].buffer = malloc(PAGE_SIZE);
+    pager->frames[i].data = pager->frames[i].buffer;
+    pthread_rwlock_init(&pager->frames[i].latch, &latch_attributes);
+    pager->frames[i].exclusive_depth = 0;
+    pager->frames[i].version = 0;
+    pager->frames[i].commit_ts = 0;
+  }
+  pthread_rwlockattr_destroy(&latch_attributes);
+  pager->threaded = false;
+  pager->commit_ts = 0;
+  pager->oldest_version = NULL;
+  pager->newest_version = NULL;
+  pager->free_versions = NULL;
+  pager->snapshots = NULL;
+  pager->num_snapshots = 0;
+  pager->snapshots_capacity = 0;
+  pager->in_transaction = false;
+  pager->rollback_version = 0;
+
+  uint32_t num_buckets = 1;
+  while (num_buckets < num_frames) {
+    num_buckets <<= 1;
+  }
+  pager->page_table_mask = num_buckets - 1;
+  pager->page_table = malloc(num_buckets * sizeof(int32_t));
+  pager->version_table = malloc(num_buckets * sizeof(PageVersion *));
+  for (uint32_t i = 0; i < num_buckets; i++) {
+    pager->page_table[i] = -1;
+    pager->version_table[i] = NULL;
+  }
+
+  if (pager->num_pages == 0) {
+    FileHeader *header = get_page(pager, 0);
+    memcpy(header->magic, PAGER_FILE_MAGIC, sizeof(header->magic));
+    header->page_size = PAGE_SIZE;
+    header->catalog_page_num = 0;
+    header->first_free_trunk = 0;
+    header->num_free_pages = 0;
+    mark_page_dirty(pager, 0);
+    unpin_page(pager, 0);
+  }
+
+  return pager;
+}
+
+/*
+ * Checkpoints the database, closes the file and the log and frees the pager.
+ * Pages that were only read are not written again.
+ */
+void pager_close(Pager *pager) {
+  pager_wait_io(pager);
+  pager_checkpoint(pager);
+  wal_close(pager->wal);
+  io_close(pager->io);
+
+  Pager **link = &open_pagers;
+  while (*link != pager) {
+    link = &(*link)->next_open;
+  }
+  *link = pager->next_open;
+
+  int result = close(pager->file_descriptor);
+  if (result == -1) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (pager->map != NULL) {
+    munmap(pager->map, PAGER_MMAP_RESERVE);
+  }
+  if (pager->threaded) {
+    pthread_mutex_destroy(&pager->mutex);
+    pthread_mutex_destroy(&pager->writer_mutex);
+    pthread_rwlock_destroy(&pager->rollback_latch);
+  }
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    pthread_rwlock_destroy(&pager->frames[i].latch);
+    free(pager->frames[i].buffer);
+  }
+  PageVersion *lists[] = {pager->oldest_version, pager->free_versions};
+  for (uint32_t i = 0; i < 2; i++) {
+    while (lists[i] != NULL) {
+      PageVersion *version = lists[i];
+      lists[i] = version->next;
+      free(version->data);
+      free(version);
+    }
+  }
+  free(pager->snapshots);
+  free(pager->version_table);
+  free(pager->page_table);
+  free(pager->uncommitted_frames);
+  free(pager->spilled.page_nums);
+  free(pager->spilled.lsns);
+  free(pager->frames);
+  free(pager);
+}
+
+/*
+ * Pins the page with the given page number and returns its frame.
+ * If the page is not in the buffer pool, a frame is freed up and the page is
+ * read from disk. If the requested page number is not found in the file, a
+ * blank page is handed out. This blank page will not be persisted to the disk
+ * until flushed.(eg: using db_close())
+ * The pool must be latched. A miss is read while it is, which keeps the
+ * bookkeeping simple at the cost of making other threads wait for the read.
+ */
+static Frame *pager_pin(Pager *pager, uint32_t page_num) {
+  pager_reap_reads(pager);
+
+  int32_t frame_index = page_table_lookup(pager, page_num);
+
+  if (frame_index == -1) {
+    /* Cache miss. Find a frame for the page and read it from file. */
+    frame_index = pager_evict(pager);
+    Frame *frame = &pager->frames[frame_index];
+    uint32_t num_pages_in_file = pager->file_length / PAGE_SIZE;
+    __atomic_store_n(&frame->data, frame->buffer, __ATOMIC_RELAXED);
+    frame->private_copy = false;
+    __atomic_store_n(&frame->commit_ts, pager_newest_version_ts(pager, page_num),
+                     __ATOMIC_RELAXED);
+
+    /*
+     * If the requested page has been used before, load it to memory.
+     * Otherwise the frame is handed out as a blank page.
+     */
+    uint64_t spilled_lsn = spill_map_get(&pager->spilled, page_num);
+    if (spilled_lsn != 0) {
+      wal_read(pager->wal, spilled_lsn, frame->data, PAGE_SIZE);
+      spill_map_remove(&pager->spilled, page_num);
+
+      /* The database file does not have this version of the page yet. */
+      frame->dirty = true;
+      pager->num_dirty++;
+      frame->lsn = spilled_lsn;
+      if (spilled_lsn > pager->commit_lsn) {
+        frame->uncommitted = true;
+        pager->uncommitted_frames[pager->num_uncommitted++] = frame_index;
+      }
+    } else if (page_num < num_pages_in_file && pager->map != NULL) {
+      pager_map_file(pager);
+      __atomic_store_n(&frame->data, pager->map + (size_t)page_num * PAGE_SIZE,
+                       __ATOMIC_RELAXED);
+    } else if (page_num < num_pages_in_file) {
+      ssize_t bytes_read = pread(pager->file_descriptor, frame->data, PAGE_SIZE,
+                                 (off_t)page_num * PAGE_SIZE);
+      if (bytes_read == -1) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+    } else {
+      memset(frame->data, 0, PAGE_SIZE);
+    }
+
+    __atomic_store_n(&frame->page_num, page_num, __ATOMIC_RELAXED);
+    page_table_insert(pager, frame_index);
+    frame_end_change(frame);
+
+    /*
+     * If the requested page is a new page, update the pagers total accordingly.
+     */
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+  }
+
+  Frame *frame = &pager->frames[frame_index];
+  frame->pin_count++;
+  __atomic_store_n(&frame->referenced, true, __ATOMIC_RELAXED);
+  frame->read_ahead = false;
+  while (frame->io_pending) {
+    pager_reap_io(pager, true);
+  }
+  return frame;
+}
+
+/*
+ * Takes the latch of FRAME in MODE. The writer takes the latch of a page it
+ * holds exclusively once more instead, and holding it shared, must not ask
+ * for it exclusively. Only the writer latches pages exclusively, and keeps a
+ * version of the page before it changes it (see frame_save_version), so DATA
+ * of the frame must be read again after the latch is taken. A reader takes
+ * the rollback latch of the pager along with its first latch on a page.
+ */
+static void latch_frame(Pager *pager, Frame *frame, LatchMode mode) {
+  if (writing_pager == pager) {
+    if (frame->exclusive_depth > 0) {
+      frame->exclusive_depth++;
+      return;
+    }
+    if (mode == LATCH_EXCLUSIVE) {
+      pthread_rwlock_wrlock(&frame->latch);
+      frame->exclusive_depth = 1;
+      frame_begin_change(frame);
+      pager_lock(pager);
+      frame_save_version(pager, frame);
+      pager_unlock(pager);
+      return;
+    }
+  }
+  if (num_read_latches++ == 0) {
+    pthread_rwlock_rdlock(&pager->rollback_latch);
+  }
+  if (mode == LATCH_EXCLUSIVE) {
+    pthread_rwlock_wrlock(&frame->latch);
+  } else {
+    pthread_rwlock_rdlock(&frame->latch);
+  }
+}
+
+/*
+ * Lets go of a latch on FRAME taken by latch_frame.
+ */
+static void unlatch_frame(Pager *pager, Frame *frame) {
+  if (writing_pager == pager && frame->exclusive_depth > 0) {
+    if (--frame->exclusive_depth > 0) {
+      return;
+    }
+    frame_end_change(frame);
+    pthread_rwlock_unlock(&frame->latch);
+    return;
+  }
+  pthread_rwlock_unlock(&frame->latch);
+  if (--num_read_latches == 0) {
+    pthread_rwlock_unlock(&pager->rollback_latch);
+  }
+}
+
+/*
+ * Releases a pin on PAGE_NUM, after its latch if LATCHED is set.
+ */
+static void pager_release(Pager *pager, uint32_t page_num, bool latched) {
+  pager_lock(pager);
+  int32_t frame_index = page_table_lookup(pager, page_num);
+  if (frame_index == -1 || pager->frames[frame_index].pin_count == 0) {
+    printf("Tried to unpin page %d which is not pinned.\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  if (latched) {
+    unlatch_frame(pager, &pager->frames[frame_index]);
+  }
+  pager->frames[frame_index].pin_count--;
+  pager_unlock(pager);
+}
+
+/*
+ * Returns the page with the given page number from a pager, and pins it.
+ * With threads, the writer gets the page latched exclusively, and the latch
+ * goes with the pin. Readers only get the pin, see get_page_latched, and a
+ * reader with a snapshot gets the page as of its snapshot.
+ *
+ * The returned pointer is only valid until the page is unpinned. Every call to
+ * get_page must be matched by a call to unpin_page.
+ */
+void *get_page(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  Frame *frame = pager_pin(pager, page_num);
+  if (!pager->threaded && writing_pager == pager) {
+    frame_save_version(pager, frame);
+  }
+  void *data = frame_snapshot_data(pager, frame);
+  pager_unlock(pager);
+  if (pager->threaded && writing_pager == pager) {
+    latch_frame(pager, frame, LATCH_EXCLUSIVE);
+    data = frame->data;
+  }
+  return data;
+}
+
+/*
+ * Releases a pin taken by get_page. Once a page has no pins left, its frame may
+ * be reused for another page.
+ */
+void unpin_page(Pager *pager, uint32_t page_num) {
+  pager_release(pager, page_num, pager->threaded && writing_pager == pager);
+}
+
+/*
+ * Tells whether the calling thread latches the pages of PAGER it reads. A
+ * reader with a snapshot does not, since the writer never changes the pages
+ * it reads.
+ */
+static bool pager_latches_reads(Pager *pager) {
+  return pager->threaded && snapshot_pager != pager;
+}
+
+/*
+ * Like get_page, but with threads the page is latched in MODE as well, so no
+ * other thread changes it while it is read. Every call must be matched by a
+ * call to unlatch_page.
+ */
+void *get_page_latched(Pager *pager, uint32_t page_num, LatchMode mode) {
+  pager_lock(pager);
+  Frame *frame = pager_pin(pager, page_num);
+  if (!pager->threaded && writing_pager == pager) {
+    frame_save_version(pager, frame);
+  }
+  void *data = frame_snapshot_data(pager, frame);
+  pager_unlock(pager);
+  if (pager_latches_reads(pager)) {
+    latch_frame(pager, frame, mode);
+    data = frame->data;
+  }
+  return data;
+}
+
+/*
+ * Like get_page_latched with LATCH_SHARED, but returns NULL instead of waiting
+ * when a reader cannot have the latch right away. For reads that are only
+ * worth it if they do not wait, and that latch pages out of the usual order.
+ */
+void *try_get_page_latched(Pager *pager, uint32_t page_num) {
+  if (!pager_latches_reads(pager) || writing_pager == pager) {
+    return get_page_latched(pager, page_num, LATCH_SHARED);
+  }
+
+  pager_lock(pager);
+  Frame *frame = pager_pin(pager, page_num);
+  bool first = num_read_latches == 0;
+  if (first && pthread_rwlock_tryrdlock(&pager->rollback_latch) != 0) {
+    frame->pin_count--;
+    pager_unlock(pager);
+    return NULL;
+  }
+  if (pthread_rwlock_tryrdlock(&frame->latch) != 0) {
+    if (first) {
+      pthread_rwlock_unlock(&pager->rollback_latch);
+    }
+    frame->pin_count--;
+    pager_unlock(pager);
+    return NULL;
+  }
+  num_read_latches++;
+  pager_unlock(pager);
+  return frame->data;
+}
+
+/*
+ * Lets go of the latch and the pin taken by get_page_latched.
+ */
+void unlatch_page(Pager *pager, uint32_t page_num) {
+  pager_release(pager, page_num, pager_latches_reads(pager));
+}
+
+/*
+ * Lets NUM_THREADS threads share PAGER: any number of readers, and one writer
+ * at a time (see pager_begin_write). Must be called before the threads start.
+ * Each of them needs PAGER_FRAMES_PER_THREAD frames it can pin, on top of the
+ * ones reads ahead may take.
+ */
+void pager_enable_threads(Pager *pager, uint32_t num_threads) {
+  uint32_t num_frames_needed =
+      num_threads * PAGER_FRAMES_PER_THREAD +
+      pager->num_frames / PAGER_READ_AHEAD_SHARE;
+  if (pager->num_frames < num_frames_needed) {
+    printf("%d threads need a buffer pool of at least %d frames.\n",
+           num_threads, num_frames_needed);
+    exit(EXIT_FAILURE);
+  }
+  if (pager->threaded) {
+    return;
+  }
+
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&pager->mutex, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+  pthread_mutex_init(&pager->writer_mutex, NULL);
+
+  /* Readers hold it across operations, so a waiting rollback goes first. */
+  pthread_rwlockattr_t latch_attributes;
+  pthread_rwlockattr_init(&latch_attributes);
+  pthread_rwlockattr_setkind_np(&latch_attributes,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&pager->rollback_latch, &latch_attributes);
+  pthread_rwlockattr_destroy(&latch_attributes);
+  pager->threaded = true;
+}
+
+/*
+ * Makes the calling thread the writer of PAGER, once the one before it is
+ * done. Every page it gets with get_page is latched exclusively. It must not
+ * hold any latch when it calls pager_end_write. Without threads there is no
+ * one to wait for, but the writer keeps versions of the pages it gets during
+ * a transaction all the same.
+ */
+void pager_begin_write(Pager *pager) {
+  if (pager->threaded) {
+    pthread_mutex_lock(&pager->writer_mutex);
+  }
+  writing_pager = pager;
+}
+
+void pager_end_write(Pager *pager) {
+  writing_pager = NULL;
+  if (pager->threaded) {
+    pthread_mutex_unlock(&pager->writer_mutex);
+  }
+}
+
+/*
+ * Tells whether the calling thread may change pages of PAGER. Without threads
+ * it always may.
+ */
+bool pager_is_writer(Pager *pager) {
+  return !pager->threaded || writing_pager == pager;
+}
+
+/*
+ * Starts a transaction: the statements the writer runs from now on commit
+ * together with the next pager_commit, or are undone by pager_rollback. The
+ * calling thread must be the writer, and stays it until then.
+ */
+void pager_begin_transaction(Pager *pager) {
+  pager_lock(pager);
+  pager->in_transaction = true;
+  pager->transaction_num_pages = pager->num_pages;
+  pager_unlock(pager);
+}
+
+/*
+ * Tells whether the calling thread runs a transaction on PAGER.
+ */
+bool pager_in_transaction(Pager *pager) {
+  return writing_pager == pager && pager->in_transaction;
+}
+
+/*
+ * Gives FRAME back the content of its page in VERSION, the one kept before
+ * the running transaction changed it, and lets go of the version. The frame
+ * takes over the buffer of the version, which readers with a snapshot may
+ * still be reading, even if the page did not change. The frame must be
+ * latched exclusively, and the pool as well.
+ */
+static void frame_restore_version(Pager *pager, Frame *frame,
+                                  PageVersion *version) {
+  if (!frame_is_mapped(pager, frame)) {
+    void *data = frame->data;
+    frame->buffer = version->data;
+    __atomic_store_n(&frame->data, version->data, __ATOMIC_RELEASE);
+    version->data = data;
+  } else if (frame->uncommitted) {
+    memcpy(frame->data, version->data, PAGE_SIZE);
+  }
+  if (frame->uncommitted) {
+    frame_forget_uncommitted(pager, frame - pager->frames);
+  }
+
+  PageVersion **link = version_table_bucket(pager, version->page_num);
+  while (*link != version) {
+    link = &(*link)->hash_next;
+  }
+  *link = version->hash_next;
+  __atomic_store_n(&frame->commit_ts,
+                   pager_newest_version_ts(pager, frame->page_num),
+                   __ATOMIC_RELAXED);
+}
+
+/*
+ * Undoes the transaction of the writer. Every page it changed gets back the
+ * content it had before, which the writer kept as a version of the page
+ * (see frame_save_version), and the pages it added to the file are given up.
+ * Pages that had to be spilled are read back first, and their images in the
+ * log are voided. Like pager_commit, it ends the transaction. The writer must
+ * not hold any page.
+ * Readers with a snapshot read the versions until their pages are put back,
+ * the others wait for the rollback to finish, see rollback_latch.
+ */
+void pager_rollback(Pager *pager) {
+  uint64_t commit_ts = pager->commit_ts + 1;
+  if (pager->threaded) {
+    pthread_rwlock_wrlock(&pager->rollback_latch);
+  }
+  __atomic_store_n(&pager->rollback_version, pager->rollback_version + 1,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  pager_lock(pager);
+  PageVersion *version = pager->oldest_version;
+  while (version != NULL && version->commit_ts != commit_ts) {
+    version = version->next;
+  }
+  pager_unlock(pager);
+
+  /* Versions made by the transaction are never collected, and it makes no
+   * new ones while their pages keep its commit timestamp. */
+  while (version != NULL) {
+    uint32_t page_num = version->page_num;
+    get_page(pager, page_num);
+    pager_lock(pager);
+    Frame *frame = &pager->frames[page_table_lookup(pager, page_num)];
+    frame_restore_version(pager, frame, version);
+    version = version->next;
+    pager_unlock(pager);
+    unpin_page(pager, page_num);
+  }
+
+  pager_lock(pager);
+  if (pager->num_uncommitted > 0) {
+    printf("Tried to roll back %d pages that were not kept.\n",
+           pager->num_uncommitted);
+    exit(EXIT_FAILURE);
+  }
+  PageVersion **link = &pager->oldest_version;
+  PageVersion *previous = NULL;
+  while (*link != NULL && (*link)->commit_ts != commit_ts) {
+    previous = *link;
+    link = &(*link)->next;
+  }
+  if (*link != NULL) {
+    pager->newest_version->next = pager->free_versions;
+    pager->free_versions = *link;
+    *link = NULL;
+    pager->newest_version = previous;
+  }
+
+  /* The pages the transaction added are handed out again, blank. */
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    Frame *frame = &pager->frames[i];
+    if (frame->page_num == INVALID_PAGE_NUM ||
+        frame->page_num < pager->transaction_num_pages) {
+      continue;
+    }
+    if (frame->dirty) {
+      frame->dirty = false;
+      pager->num_dirty--;
+    }
+    frame_begin_change(frame);
+    page_table_remove(pager, i);
+    __atomic_store_n(&frame->page_num, INVALID_PAGE_NUM, __ATOMIC_RELAXED);
+    frame_end_change(frame);
+  }
+
+  if (pager->num_uncommitted_spills > 0) {
+    wal_abort(pager->wal);
+    pager->num_uncommitted_spills = 0;
+  }
+  pager->num_pages = pager->transaction_num_pages;
+  pager->in_transaction = false;
+  pager_unlock(pager);
+
+  __atomic_store_n(&pager->rollback_version, pager->rollback_version + 1,
+                   __ATOMIC_RELEASE);
+  if (pager->threaded) {
+    pthread_rwlock_unlock(&pager->rollback_latch);
+  }
+}
+
+/*
+ * Makes the calling thread read PAGER as it was after the last commit, until
+ * it calls pager_end_snapshot. It gets pages without latching them, and the
+ * writer does not wait for it. Pages the writer changes after the snapshot
+ * was taken are read from the versions it keeps of them.
+ * Returns false if no snapshot is taken: without threads there is no one
+ * else to change pages, and in mmap mode pages are latched as before. The
+ * writer in a transaction takes none either, it reads its own changes. Until
+ * pager_end_snapshot it gets pages like a reader, so it keeps no versions of
+ * the pages it only reads.
+ */
+bool pager_begin_snapshot(Pager *pager) {
+  if (writing_pager == pager) {
+    writing_pager = NULL;
+    paused_pager = pager;
+    return false;
+  }
+  if (!pager->threaded || pager->map != NULL) {
+    return false;
+  }
+  pager_lock(pager);
+  if (pager->num_snapshots == pager->snapshots_capacity) {
+    pager->snapshots_capacity = 2 * pager->snapshots_capacity + 4;
+    pager->snapshots = realloc(pager->snapshots,
+                               pager->snapshots_capacity * sizeof(uint64_t));
+  }
+  pager->snapshots[pager->num_snapshots++] = pager->commit_ts;
+  snapshot_ts = pager->commit_ts;
+  snapshot_pager = pager;
+  pager_unlock(pager);
+  return true;
+}
+
+/*
+ * Lets go of the snapshot of the calling thread, and of the versions of pages
+ * only it needed. It must not hold any page of PAGER.
+ */
+void pager_end_snapshot(Pager *pager) {
+  if (paused_pager == pager) {
+    paused_pager = NULL;
+    writing_pager = pager;
+    return;
+  }
+  if (snapshot_pager != pager) {
+    return;
+  }
+  pager_lock(pager);
+  for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+    if (pager->snapshots[i] == snapshot_ts) {
+      pager->snapshots[i] = pager->snapshots[--pager->num_snapshots];
+      break;
+    }
+  }
+  snapshot_pager = NULL;
+  pager_collect_versions(pager);
+  pager_unlock(pager);
+}
+
+/*
+ * Returns how many pages were read ahead and evicted unused so far.
+ */
+uint64_t pager_wasted_reads(Pager *pager) {
+  pager_lock(pager);
+  uint64_t num_wasted_reads = pager->num_wasted_reads;
+  pager_unlock(pager);
+  return num_wasted_reads;
+}
+
+/*
+ * Starts an optimistic read of PAGE_NUM: returns the page, without pinning or
+ * latching it, and notes where the read started in READ. Nothing is written
+ * to memory other threads share, so readers do not slow each other down.
+ * Returns NULL if the page is not cached, the writer holds it, the pager maps
+ * the file, the page changed after the snapshot of the calling thread, or a
+ * rollback is running.
+ * The page may change or even make way for another one while it is read, so
+ * whatever is read from it may be garbage and must be checked against the
+ * bounds of the page. It only counts once pager_read_validate says the page
+ * did not change in the meantime.
+ */
+void *pager_read_begin(Pager *pager, uint32_t page_num, PageRead *read) {
+  if (pager->map != NULL) {
+    return NULL;
+  }
+  read->rollback_version =
+      __atomic_load_n(&pager->rollback_version, __ATOMIC_ACQUIRE);
+  if (read->rollback_version % 2 == 1) {
+    return NULL;
+  }
+
+  /* The chain may be relinked under us, but it only ever holds frames. */
+  int32_t frame_index =
+      __atomic_load_n(page_table_bucket(pager, page_num), __ATOMIC_RELAXED);
+  for (uint32_t i = 0; frame_index != -1 && i < pager->num_frames; i++) {
+    Frame *frame = &pager->frames[frame_index];
+    if (__atomic_load_n(&frame->page_num, __ATOMIC_RELAXED) == page_num) {
+      read->frame_index = frame_index;
+      read->version = __atomic_load_n(&frame->version, __ATOMIC_ACQUIRE);
+      if (read->version % 2 == 1 ||
+          __atomic_load_n(&frame->page_num, __ATOMIC_RELAXED) != page_num ||
+          (snapshot_pager == pager &&
+           __atomic_load_n(&frame->commit_ts, __ATOMIC_RELAXED) > snapshot_ts)) {
+        return NULL;
+      }
+      /* Only set the bit the clock hand clears, so hot pages stay clean. */
+      if (!__atomic_load_n(&frame->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&frame->referenced, true, __ATOMIC_RELAXED);
+      }
+      return __atomic_load_n(&frame->data, __ATOMIC_RELAXED);
+    }
+    frame_index = __atomic_load_n(&frame->hash_next, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/*
+ * Tells whether the page that READ started on stayed the same since, so what
+ * was read from it holds. A rollback in the meantime may have changed the
+ * pages it led to, so it does not.
+ */
+bool pager_read_validate(Pager *pager, PageRead *read) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&pager->frames[read->frame_index].version,
+                         __ATOMIC_RELAXED) == read->version &&
+         __atomic_load_n(&pager->rollback_version, __ATOMIC_RELAXED) ==
+             read->rollback_version;
+}
+
+/*
+ * Records that the cached copy of PAGE_NUM was modified. The page must be
+ * pinned by the caller. It stays in the buffer pool at least until the running
+ * statement commits.
+ */
+void mark_page_dirty(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  int32_t frame_index = page_table_lookup(pager, page_num);
+  if (frame_index == -1) {
+    printf("Tried to mark page %d dirty which is not cached.\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+
+  Frame *frame = &pager->frames[frame_index];
+  if (!frame->dirty) {
+    frame->dirty = true;
+    pager->num_dirty++;
+  }
+  if (frame_is_mapped(pager, frame)) {
+    frame->private_copy = true;
+  }
+  if (!frame->uncommitted) {
+    frame->uncommitted = true;
+    pager->uncommitted_frames[pager->num_uncommitted++] = frame_index;
+  }
+  pager_unlock(pager);
+}
+
+/*
+ * Tells whether PAGE_NUM is in the buffer pool, and if it was read ahead,
+ * whether it arrived and has been used yet. Scans use it to learn if their
+ * reads ahead keep up.
+ */
+PageStatus pager_page_status(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  pager_reap_reads(pager);
+  int32_t frame_index = page_table_lookup(pager, page_num);
+  PageStatus status;
+  if (frame_index == -1) {
+    status = PAGE_NOT_CACHED;
+  } else if (pager->frames[frame_index].io_pending) {
+    status = PAGE_READING;
+  } else if (pager->frames[frame_index].read_ahead) {
+    status = PAGE_READ_AHEAD;
+  } else {
+    status = PAGE_CACHED;
+  }
+  pager_unlock(pager);
+  return status;
+}
+
+/*
+ * Lets the frame of PAGE_NUM be the next one the clock hand takes, instead of
+ * giving it a second chance. Meant for pages a large scan reads only once, so
+ * they do not push the pages that are used over and over out of the pool.
+ */
+void pager_mark_cold(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  int32_t frame_index = page_table_lookup(pager, page_num);
+  if (frame_index != -1) {
+    __atomic_store_n(&pager->frames[frame_index].referenced, false,
+                     __ATOMIC_RELAXED);
+  }
+  pager_unlock(pager);
+}
+
+/*
+ * Starts reading the COUNT pages in PAGE_NUMS into the buffer pool, all with
+ * one submission, and returns without waiting for them. get_page waits for a
+ * page whose read has not finished yet.
+ * Pages that are cached already or have no version in the file are skipped,
+ * and the rest is left out once the reads take up their share of the frames.
+ * Returns how many pages from the start of PAGE_NUMS are in the pool or on
+ * their way. In mmap mode the kernel is asked to read the pages into the page
+ * cache instead. Without io_uring there is nothing to gain, nothing is read
+ * and 0 is returned.
+ */
+uint32_t pager_read_pages(Pager *pager, uint32_t *page_nums, uint32_t count) {
+  pager_lock(pager);
+  uint32_t num_pages_in_file = pager->file_length / PAGE_SIZE;
+  if (pager->map != NULL) {
+    pager_map_file(pager);
+    for (uint32_t i = 0; i < count; i++) {
+      if (page_nums[i] < num_pages_in_file) {
+        madvise(pager->map + (size_t)page_nums[i] * PAGE_SIZE, PAGE_SIZE,
+                MADV_WILLNEED);
+      }
+    }
+    pager_unlock(pager);
+    return count;
+  }
+  if (!io_is_async(pager->io)) {
+    pager_unlock(pager);
+    return 0;
+  }
+
+  uint32_t num_covered = 0;
+  for (; num_covered < count; num_covered++) {
+    uint32_t page_num = page_nums[num_covered];
+    if (page_table_lookup(pager, page_num) != -1 ||
+        spill_map_get(&pager->spilled, page_num) != 0) {
+      continue;
+    }
+    if (page_num >= num_pages_in_file ||
+        pager->num_reads_in_flight >=
+            pager->num_frames / PAGER_READ_AHEAD_SHARE) {
+      break;
+    }
+
+    while (io_is_full(pager->io)) {
+      pager_reap_io(pager, true);
+    }
+    int32_t frame_index = pager_evict(pager);
+    Frame *frame = &pager->frames[frame_index];
+    __atomic_store_n(&frame->data, frame->buffer, __ATOMIC_RELAXED);
+    frame->private_copy = false;
+    __atomic_store_n(&frame->commit_ts, pager_newest_version_ts(pager, page_num),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&frame->page_num, page_num, __ATOMIC_RELAXED);
+    frame->pin_count = 1;
+    __atomic_store_n(&frame->referenced, true, __ATOMIC_RELAXED);
+    frame->io_pending = true;
+    frame->read_ahead = true;
+    page_table_insert(pager, frame_index);
+
+    io_read(pager->io, pager->file_descriptor, frame->data, PAGE_SIZE,
+            (off_t)page_num * PAGE_SIZE,
+            pager_io_user_data(PAGER_IO_READ, frame_index));
+    pager->num_reads_in_flight++;
+  }
+  io_submit(pager->io);
+  pager_unlock(pager);
+  return num_covered;
+}
+
+/*
+ * Returns a page that is not in use. Pages on the free list are recycled
+ * first, picking the one of the first trunk that is closest to
+ * NEAR_PAGE_NUM, so that pages which are read together stay close in the
+ * file. New pages are added at the end of the file.
+ * The page is taken off the free list right away, so the caller must use it
+ * in the same statement.
+ * Only the writer uses the free list, so its pages are not latched.
+ */
+uint32_t get_unused_page_num(Pager *pager, uint32_t near_page_num) {
+  pager_lock(pager);
+  Frame *header_frame = pager_pin(pager, 0);
+  uint32_t trunk_page_num = ((FileHeader *)header_frame->data)->first_free_trunk;
+  if (trunk_page_num == 0) {
+    pager_release(pager, 0, false);
+    uint32_t num_pages = pager->num_pages;
+    pager_unlock(pager);
+    return num_pages;
+  }
+  frame_save_version(pager, header_frame);
+  FileHeader *header = header_frame->data;
+
+  uint32_t page_num;
+  Frame *trunk_frame = pager_pin(pager, trunk_page_num);
+  frame_save_version(pager, trunk_frame);
+  FreeTrunk *trunk = trunk_frame->data;
+  if (trunk->num_entries == 0) {
+    page_num = trunk_page_num;
+    header->first_free_trunk = trunk->next_trunk;
+  } else {
+    uint32_t best = 0;
+    uint32_t best_distance = UINT32_MAX;
+    for (uint32_t i = 0; i < trunk->num_entries; i++) {
+      uint32_t entry = trunk->entries[i];
+      uint32_t distance = entry > near_page_num ? entry - near_page_num
+                                                : near_page_num - entry;
+      if (distance < best_distance) {
+        best = i;
+        best_distance = distance;
+      }
+    }
+    page_num = trunk->entries[best];
+    trunk->entries[best] = trunk->entries[--trunk->num_entries];
+    mark_page_dirty(pager, trunk_page_num);
+  }
+  pager_release(pager, trunk_page_num, false);
+
+  header->num_free_pages--;
+  mark_page_dirty(pager, 0);
+  pager_release(pager, 0, false);
+  pager_unlock(pager);
+  return page_num;
+}
+
+/*
+ * Puts PAGE_NUM on the free list. Nothing may point to the page anymore.
+ * It is added to the first trunk if there is room, otherwise it becomes the
+ * new first trunk.
+ */
+void pager_free_page(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  Frame *header_frame = pager_pin(pager, 0);
+  frame_save_version(pager, header_frame);
+  FileHeader *header = header_frame->data;
+  uint32_t trunk_page_num = header->first_free_trunk;
+  bool added = false;
+  if (trunk_page_num != 0) {
+    Frame *trunk_frame = pager_pin(pager, trunk_page_num);
+    frame_save_version(pager, trunk_frame);
+    FreeTrunk *trunk = trunk_frame->data;
+    if (trunk->num_entries < FREE_TRUNK_MAX_ENTRIES) {
+      trunk->entries[trunk->num_entries++] = page_num;
+      mark_page_dirty(pager, trunk_page_num);
+      added = true;
+    }
+    pager_release(pager, trunk_page_num, false);
+  }
+
+  if (!added) {
+    Frame *frame = pager_pin(pager, page_num);
+    frame_save_version(pager, frame);
+    FreeTrunk *new_trunk = frame->data;
+    new_trunk->next_trunk = trunk_page_num;
+    new_trunk->num_entries = 0;
+    mark_page_dirty(pager, page_num);
+    pager_release(pager, page_num, false);
+    header->first_free_trunk = page_num;
+  }
+
+  header->num_free_pages++;
+  mark_page_dirty(pager, 0);
+  pager_release(pager, 0, false);
+  pager_unlock(pager);
+}
+
+/*
+ * Writes COUNT pages starting at PAGE_NUM straight to the database file,
+ * without logging them. Only meant for new pages that nothing points to yet,
+ * like the ones a bulk load builds before it links them in. The pages must not
+ * be in the buffer pool.
+ */
+void pager_write_pages(Pager *pager, uint32_t page_num, void *pages,
+                       uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (page_table_lookup(pager, page_num + i) != -1) {
+      printf("Tried to write page %d around the buffer pool.\n", page_num + i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  off_t offset = (off_t)page_num * PAGE_SIZE;
+  size_t length = (size_t)count * PAGE_SIZE;
+  ssize_t bytes_written = pwrite(pager->file_descriptor, pages, length, offset);
+  if (bytes_written != (ssize_t)length) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if (offset + length > pager->file_length) {
+    pager->file_length = offset + length;
+  }
+  if (page_num + count > pager->num_pages) {
+    pager->num_pages = page_num + count;
+  }
+}
+
+/*
+ * Waits until everything written to the database file is on disk.
+ */
+void pager_sync_file(Pager *pager) {
+  if (fsync(pager->file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Cuts the database file back to NUM_PAGES pages, dropping pages written by
+ * pager_write_pages that will not be used after all.
+ */
+void pager_truncate(Pager *pager, uint32_t num_pages) {
+  off_t length = (off_t)num_pages * PAGE_SIZE;
+  if (length < pager->file_length) {
+    if (ftruncate(pager->file_descriptor, length) == -1) {
+      printf("Error truncating db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->file_length = length;
+  }
+  pager->num_pages = num_pages;
+}
+
+/*
+ * Writes the PAGE_NUM of PAGER to file, after the log record of its latest
+ * change.
+ */
+void pager_flush(Pager *pager, uint32_t page_num) {
+  pager_lock(pager);
+  int32_t frame_index = page_table_lookup(pager, page_num);
+  if (frame_index == -1) {
+    printf("Tried to flush null page.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (pager->frames[frame_index].uncommitted) {
+    printf("Tried to flush page %d before it was committed.\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  wal_flush_to(pager->wal, pager->frames[frame_index].lsn);
+
+  off_t offset = (off_t)page_num * PAGE_SIZE;
+  ssize_t bytes_written = pwrite(pager->file_descriptor,
+                                 pager->frames[frame_index].data, PAGE_SIZE,
+                                 offset);
+
+  if (bytes_written == -1) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if (offset + PAGE_SIZE > pager->file_length) {
+    pager->file_length = offset + PAGE_SIZE;
+  }
+
+  if (pager->frames[frame_index].dirty) {
+    pager->frames[frame_index].dirty = false;
+    pager->num_dirty--;
+  }
+  pager_unlock(pager);
+}
+
+static int compare_frame_page_nums(const void *a, const void *b) {
+  uint32_t page_a = (*(Frame **)a)->page_num;
+  uint32_t page_b = (*(Frame **)b)->page_num;
+  return (page_a > page_b) - (page_a < page_b);
+}
+
+/*
+ * Writes every committed dirty page of PAGER to file.
+ * The dirty pages are sorted by page number and each run of adjacent pages is
+ * written with a single vectored write. The writes are queued on the I/O ring
+ * together, and the function returns once all of them are done.
+ */
+void pager_flush_dirty(Pager *pager) {
+  pager_lock(pager);
+  if (pager->num_dirty == 0) {
+    pager_unlock(pager);
+    return;
+  }
+
+  uint32_t num_dirty = 0;
+  Frame **dirty = malloc(pager->num_dirty * sizeof(Frame *));
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    if (pager->frames[i].dirty && !pager->frames[i].uncommitted) {
+      dirty[num_dirty++] = &pager->frames[i];
+      wal_flush_to(pager->wal, pager->frames[i].lsn);
+    }
+  }
+  qsort(dirty, num_dirty, sizeof(Frame *), compare_frame_page_nums);
+
+  struct iovec *iov = malloc(num_dirty * sizeof(struct iovec));
+  uint32_t run_start = 0;
+  while (run_start < num_dirty) {
+    uint32_t run_length = 1;
+    while (run_start + run_length < num_dirty && run_length < PAGER_MAX_IOVECS &&
+           dirty[run_start + run_length]->page_num ==
+               dirty[run_start]->page_num + run_length) {
+      run_length++;
+    }
+
+    for (uint32_t i = run_start; i < run_start + run_length; i++) {
+      iov[i].iov_base = dirty[i]->data;
+      iov[i].iov_len = PAGE_SIZE;
+    }
+
+    while (io_is_full(pager->io)) {
+      pager_reap_io(pager, true);
+    }
+    off_t offset = (off_t)dirty[run_start]->page_num * PAGE_SIZE;
+    io_writev(pager->io, pager->file_descriptor, iov + run_start, run_length,
+              offset, pager_io_user_data(PAGER_IO_WRITE, run_length));
+
+    off_t run_end = offset + (off_t)run_length * PAGE_SIZE;
+    if (run_end > pager->file_length) {
+      pager->file_length = run_end;
+    }
+    for (uint32_t i = 0; i < run_length; i++) {
+      dirty[run_start + i]->dirty = false;
+    }
+    pager->num_dirty -= run_length;
+    run_start += run_length;
+  }
+  pager_wait_io(pager);
+
+  free(iov);
+  free(dirty);
+  pager_unlock(pager);
+}
+
+/*
+ * Writes the dirty pages once they make up too large a part of the pool, and
+ * checkpoints once the log has grown too long.
+ * Meant to be called between statements, when no page is half modified.
+ */
+void pager_flush_if_needed(Pager *pager) {
+  pager_lock(pager);
+  Wal *wal = pager->wal;
+  if (wal->file_length + wal->buffer_length > WAL_CHECKPOINT_SIZE) {
+    pager_checkpoint(pager);
+  } else if (pager->num_dirty * PAGER_DIRTY_FLUSH_RATIO > pager->num_frames) {
+    pager_flush_dirty(pager);
+  }
+  pager_unlock(pager);
+}
+
+/*
+ * Ends the running statement, or the transaction it is part of. The images of
+ * the pages it modified are appended to the log, followed by a commit record.
+ * The statement is durable once the log is synced, which happens in groups
+ * (see wal_commit).
+ */
+void pager_commit(Pager *pager) {
+  pager_lock(pager);
+  pager->in_transaction = false;
+  if (pager->num_uncommitted == 0 && pager->num_uncommitted_spills == 0) {
+    pager_unlock(pager);
+    return;
+  }
+
+  for (uint32_t i = 0; i < pager->num_uncommitted; i++) {
+    Frame *frame = &pager->frames[pager->uncommitted_frames[i]];
+    frame->lsn = wal_append(pager->wal, WAL_RECORD_PAGE, frame->page_num,
+                            frame->data, PAGE_SIZE);
+    frame->uncommitted = false;
+  }
+  pager->num_uncommitted = 0;
+  pager->num_uncommitted_spills = 0;
+
+  wal_commit(pager->wal);
+  pager->commit_lsn = pager->wal->next_lsn;
+
+  /* Snapshots taken from now on see the statement. */
+  pager->commit_ts++;
+  pager_collect_versions(pager);
+  pager_unlock(pager);
+}
+
+/*
+ * Makes every committed statement durable.
+ */
+void pager_sync(Pager *pager) {
+  pager_lock(pager);
+  wal_sync(pager->wal);
+  pager_unlock(pager);
+}
+
+/*
+ * Writes all committed dirty pages, waits until they are stored on disk and
+ * then empties the log, which no longer holds anything that is not in the
+ * database file.
+ * Committed pages that were spilled are copied from the log.
+ * While a statement is running, a page it modified may have its last committed
+ * image only in the log, so the log is kept until the next checkpoint.
+ */
+void pager_checkpoint(Pager *pager) {
+  pager_lock(pager);
+  wal_sync(pager->wal);
+  pager_flush_dirty(pager);
+
+  SpillMap *spilled = &pager->spilled;
+  if (spilled->count > 0) {
+    void *page = malloc(PAGE_SIZE);
+    for (uint32_t i = 0; i < spilled->capacity; i++) {
+      uint32_t page_num = spilled->page_nums[i];
+      if (page_num == INVALID_PAGE_NUM || spilled->lsns[i] > pager->commit_lsn) {
+        continue;
+      }
+
+      wal_read(pager->wal, spilled->lsns[i], page, PAGE_SIZE);
+      off_t offset = (off_t)page_num * PAGE_SIZE;
+      if (pwrite(pager->file_descriptor, page, PAGE_SIZE, offset) != PAGE_SIZE) {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      if (offset + PAGE_SIZE > pager->file_length) {
+        pager->file_length = offset + PAGE_SIZE;
+      }
+
+      /* Removing shifts a later entry into slot i, so look at it again. */
+      spill_map_remove(spilled, page_num);
+      i--;
+    }
+    free(page);
+  }
+
+  pager_sync_file(pager);
+  if (pager->num_uncommitted == 0 && spilled->count == 0) {
+    wal_truncate(pager->wal);
+  }
+  pager_unlock(pager);
+}
@@ -0,0 +1,311 @@
+/********************************************************************************
+ * pager.h : Buffer pool that caches the pages of the database file
+ ********************************************************************************/
+#ifndef _PAGER_H
+#define _PAGER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io.h"
+#include "wal.h"
+
+/*
+ * Bounds for the size of the pages of a database file, which is chosen when
+ * the file is created. It has to be a power of two.
+ */
+#define PAGER_DEFAULT_PAGE_SIZE 4096
+#define PAGER_MIN_PAGE_SIZE 4096
+#define PAGER_MAX_PAGE_SIZE 65536
+
+/* Identifies a simpledb database file. */
+#define PAGER_FILE_MAGIC "SimpleDB"
+
+/* Number of frames in the buffer pool when none is requested. */
+#define PAGER_DEFAULT_FRAMES 256
+
+/* The tree code keeps at most this many pages pinned at the same time. */
+#define PAGER_MIN_FRAMES 4
+
+/*
+ * Dirty pages are written out once more than 1/PAGER_DIRTY_FLUSH_RATIO of the
+ * frames are dirty, so that eviction rarely has to write a page on its own.
+ */
+#define PAGER_DIRTY_FLUSH_RATIO 2
+
+/*
+ * In mmap mode this much address space is reserved for the database file up
+ * front, and the file is mapped into it PAGER_MMAP_CHUNK_SIZE bytes at a time.
+ */
+#define PAGER_MMAP_RESERVE ((size_t)1 << 40)
+#define PAGER_MMAP_CHUNK_SIZE (64 * 1024 * 1024)
+
+/* At most 1/PAGER_READ_AHEAD_SHARE of the frames wait for a read ahead. */
+#define PAGER_READ_AHEAD_SHARE 4
+
+/*
+ * With threads, each of them may keep this many pages pinned at a time. The
+ * writer holds the nodes above a split on top of the pages the split pins.
+ */
+#define PAGER_FRAMES_PER_THREAD 16
+
+/* Marks a frame that does not hold any page. */
+#define INVALID_PAGE_NUM UINT32_MAX
+
+/*
+ * A Frame is a slot in the buffer pool that can hold one page.
+ * A pinned frame (pin_count > 0) is in use and will never be evicted.
+ * A dirty frame has been modified since it was read and must be written back
+ * before it is reused. An uncommitted frame was modified by the statement or
+ * transaction that is running and has not been logged yet, so it cannot be
+ * written back to the database file. If it has to be evicted anyway, it is
+ * spilled to the log.
+ * LSN is the log record holding the latest logged image of the page.
+ * Frames that hash to the same page table bucket are chained by hash_next.
+ * In mmap mode DATA points into the mapping of the file, unless the page is
+ * new or comes from the log. Modifying a mapped page gives the process a
+ * private copy of it (private_copy), which is dropped when the frame is
+ * reused so the mapping follows the file again.
+ * A frame with io_pending is still being read into. It holds a pin until the
+ * read completes. read_ahead is set until a page that was read ahead is
+ * asked for with get_page.
+ * When threads share the pager, LATCH guards the contents of the page.
+ * Readers hold it shared while they read the page, and the writer holds it
+ * exclusively while it reads or changes it. A latch is only held on a pinned
+ * frame. The writer can latch a page it holds again, and exclusive_depth
+ * counts how many times it does.
+ * VERSION lets threads read a page without pinning or latching it, see
+ * pager_read_begin. It is odd while the writer holds the page exclusively or
+ * the frame is being filled with another page, and grows with every change.
+ * BUFFER is the memory of the frame, which DATA points to unless the page is
+ * mapped. COMMIT_TS is the commit timestamp of the statement that changed the
+ * page last, see PageVersion.
+ */
+typedef struct {
+  uint32_t page_num;
+  uint32_t pin_count;
+  bool referenced; /* Reference bit for the CLOCK eviction policy, which
+                      pager_read_begin sets without the pool lock */
+  bool dirty;
+  bool uncommitted;
+  bool private_copy;
+  bool io_pending;
+  bool read_ahead;
+  uint64_t lsn;
+  int32_t hash_next;
+  void* data;
+  void* buffer;
+  pthread_rwlock_t latch;
+  uint32_t exclusive_depth;
+  uint64_t version;
+  uint64_t commit_ts;
+} Frame;
+
+/* Where an optimistic read of a page started, see pager_read_begin. */
+typedef struct {
+  uint32_t frame_index;
+  uint64_t version;
+  uint64_t rollback_version;
+} PageRead;
+
+/*
+ * The content a page had before the statement with commit timestamp
+ * COMMIT_TS changed it. Every statement that commits gets the next
+ * timestamp, and a reader that takes a snapshot (see pager_begin_snapshot)
+ * reads the oldest version of a page that is newer than its snapshot, or the
+ * page itself if there is none.
+ * Versions of pages that hash to the same bucket of the version table are
+ * chained by hash_next, and the newer version of a page comes first. NEXT
+ * chains all of them in the order they were made, so the oldest ones, which
+ * are the first that no snapshot needs anymore, are at the front.
+ */
+typedef struct PageVersion {
+  uint32_t page_num;
+  uint64_t commit_ts;
+  void* data;
+  struct PageVersion* hash_next;
+  struct PageVersion* next;
+} PageVersion;
+
+/* How a page is latched, see Frame. */
+typedef enum {
+  LATCH_SHARED,
+  LATCH_EXCLUSIVE
+} LatchMode;
+
+/*
+ * Maps page numbers to the LSN of the log record holding their latest image,
+ * for pages that were spilled to the log. Open addressing with linear probing.
+ */
+typedef struct {
+  uint32_t* page_nums;
+  uint64_t* lsns;
+  uint32_t capacity;
+  uint32_t count;
+} SpillMap;
+
+/*
+ * Where a page stands in the buffer pool, as reported by pager_page_status.
+ */
+typedef enum {
+  PAGE_NOT_CACHED,
+  PAGE_READING,    /* A read ahead of the page has not finished yet */
+  PAGE_READ_AHEAD, /* Read ahead and not used since */
+  PAGE_CACHED
+} PageStatus;
+
+/*
+ * How a pager is set up. use_mmap reads pages through a private memory
+ * mapping of the file instead of copying them into the buffer pool. sync_io
+ * turns off io_uring, so all reads and writes are blocking calls. page_size
+ * is only used when the file is created; 0 picks PAGER_DEFAULT_PAGE_SIZE.
+ */
+typedef struct {
+  uint32_t num_frames;
+  bool use_mmap;
+  bool sync_io;
+  uint32_t page_size;
+} PagerOptions;
+
+/*
+ * Page 0 of a database file starts with this header. It records the size of
+ * the pages, which every other offset in the file depends on, and the page of
+ * the catalog, which lists the tables in the file. catalog_page_num is 0
+ * until the catalog is created.
+ * Pages that are no longer used are kept in the free list, so they can be
+ * handed out again instead of growing the file. first_free_trunk is the
+ * first page of the list, or 0 if it is empty.
+ */
+typedef struct {
+  char magic[8];
+  uint32_t page_size;
+  uint32_t catalog_page_num;
+  uint32_t first_free_trunk;
+  uint32_t num_free_pages;
+} FileHeader;
+
+/*
+ * A page of the free list. It holds the numbers of up to
+ * FREE_TRUNK_MAX_ENTRIES other free pages and links to the next trunk. The
+ * trunk page is free as well, and is handed out once its entries are gone.
+ */
+typedef struct {
+  uint32_t next_trunk;
+  uint32_t num_entries;
+  uint32_t entries[];
+} FreeTrunk;
+
+#define FREE_TRUNK_MAX_ENTRIES \
+  ((PAGE_SIZE - sizeof(FreeTrunk)) / sizeof(uint32_t))
+
+/*
+ * Pager manages the pages of the table.
+ * Only num_frames pages are kept in memory at a time. The page table maps a
+ * page number to the frame holding it, and the clock hand sweeps the frames
+ * looking for a victim when a page has to be brought in.
+ * Changes are logged to the write-ahead log when a statement commits, and a
+ * dirty page only reaches the database file after its log record did.
+ * A page that was spilled is read back from the log until the next checkpoint
+ * copies it to the database file. Log records up to commit_lsn are committed.
+ * In mmap mode the first map_length bytes of the file are mapped at map.
+ * Batches of reads and writes go through the I/O ring, and
+ * num_reads_in_flight frames are waiting for a read. num_wasted_reads counts
+ * the pages that were read ahead and evicted again before anyone used them.
+ * Once threaded is set (see pager_enable_threads), MUTEX guards the buffer
+ * pool, the log and the I/O ring, and the frame latches guard the pages.
+ * WRITER_MUTEX lets one thread at a time change pages.
+ * Statements up to commit_ts are committed. The versions of pages that
+ * readers with older snapshots may still need are kept from oldest_version
+ * to newest_version, and the ones let go of are kept in free_versions for
+ * reuse. SNAPSHOTS holds the timestamps of the snapshots that are taken.
+ * While the writer runs a transaction (in_transaction), its statements commit
+ * together, and the versions it keeps of the pages it changes are what
+ * pager_rollback puts back. transaction_num_pages is num_pages when it began.
+ * A rollback changes many pages at once, so readers that do not take a
+ * snapshot hold ROLLBACK_LATCH shared while they hold any latch on a page,
+ * and rollback_version is odd while it runs, like the version of a Frame.
+ */
+typedef struct Pager {
+  int file_descriptor;
+  uint32_t file_length;
+  uint32_t num_pages;
+  uint32_t num_frames;
+  uint32_t num_dirty;
+  uint32_t num_uncommitted;
+  uint32_t* uncommitted_frames;
+  uint32_t num_uncommitted_spills;
+  SpillMap spilled;
+  uint64_t commit_lsn;
+  Frame* frames;
+  int32_t* page_table;
+  uint32_t page_table_mask;
+  uint32_t clock_hand;
+  void* map;
+  size_t map_length;
+  IoRing* io;
+  uint32_t num_reads_in_flight;
+  uint64_t num_wasted_reads;
+  Wal* wal;
+  bool threaded;
+  pthread_mutex_t mutex;
+  pthread_mutex_t writer_mutex;
+  uint64_t commit_ts;
+  PageVersion** version_table;
+  PageVersion* oldest_version;
+  PageVersion* newest_version;
+  PageVersion* free_versions;
+  uint64_t* snapshots;
+  uint32_t num_snapshots;
+  uint32_t snapshots_capacity;
+  bool in_transaction;
+  uint32_t transaction_num_pages;
+  pthread_rwlock_t rollback_latch;
+  uint64_t rollback_version;
+  struct Pager* next_open;
+} Pager;
+
+/*
+ * The page size of the open database files. It is set by pager_open, and all
+ * files open at the same time must agree on it.
+ */
+extern uint32_t PAGE_SIZE;
+
+Pager* pager_open(const char* filename, PagerOptions options);
+void pager_close(Pager* pager);
+void* get_page(Pager* pager, uint32_t page_num);
+void unpin_page(Pager* pager, uint32_t page_num);
+void* get_page_latched(Pager* pager, uint32_t page_num, LatchMode mode);
+void* try_get_page_latched(Pager* pager, uint32_t page_num);
+void unlatch_page(Pager* pager, uint32_t page_num);
+void pager_enable_threads(Pager* pager, uint32_t num_threads);
+void pager_begin_write(Pager* pager);
+void pager_end_write(Pager* pager);
+bool pager_is_writer(Pager* pager);
+void pager_begin_transaction(Pager* pager);
+bool pager_in_transaction(Pager* pager);
+void pager_rollback(Pager* pager);
+bool pager_begin_snapshot(Pager* pager);
+void pager_end_snapshot(Pager* pager);
+uint64_t pager_wasted_reads(Pager* pager);
+void* pager_read_begin(Pager* pager, uint32_t page_num, PageRead* read);
+bool pager_read_validate(Pager* pager, PageRead* read);
+void mark_page_dirty(Pager* pager, uint32_t page_num);
+PageStatus pager_page_status(Pager* pager, uint32_t page_num);
+void pager_mark_cold(Pager* pager, uint32_t page_num);
+uint32_t pager_read_pages(Pager* pager, uint32_t* page_nums, uint32_t count);
+uint32_t get_unused_page_num(Pager* pager, uint32_t near_page_num);
+void pager_free_page(Pager* pager, uint32_t page_num);
+void pager_write_pages(Pager* pager, uint32_t page_num, void* pages,
+                       uint32_t count);
+void pager_sync_file(Pager* pager);
+void pager_truncate(Pager* pager, uint32_t num_pages);
+void pager_flush(Pager* pager, uint32_t page_num);
+void pager_flush_dirty(Pager* pager);
+void pager_flush_if_needed(Pager* pager);
+void pager_commit(Pager* pager);
+void pager_sync(Pager* pager);
+void pager_checkpoint(Pager* pager);
+
+#endif
@@ -3,42 +3,133 @@
  ********************************************************************************/
 #include "processor.h"
 
+#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "catalog.h"
+#include "index.h"
+#include "loader.h"
 #include "results.h"
 
 /*
  * Executes the meta command in a given InputBuffer.
  */
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
+MetaCommandResult do_meta_command(InputBuffer* input_buffer,
+                                  Database* database) {
   if (strcmp(input_buffer->buffer, ".exit") == 0) {
-    db_close(table);
+    db_close(database);
     exit(EXIT_SUCCESS);
   } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
     printf("SimpleDB constants:\n");
     print_constants();
     return META_COMMAND_SUCCESS;
-  } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
+  } else if (strcmp(input_buffer->buffer, ".checkpoint") == 0) {
+    pager_checkpoint(database->pager);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".load ", 6) == 0) {
+    if (pager_in_transaction(database->pager)) {
+      printf("Error: A transaction is open.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    return do_load_command(input_buffer, database);
+  } else if (strcmp(input_buffer->buffer, ".tables") == 0) {
+    for (uint32_t i = 0; i < database->num_tables; i++) {
+      printf("%s\n", database->tables[i]->name);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".btree") == 0 ||
+             strncmp(input_buffer->buffer, ".btree ", 7) == 0) {
+    char* name = input_buffer->buffer[6] == ' ' ? input_buffer->buffer + 7
+                                                 : DEFAULT_TABLE_NAME;
+    Table* table = db_find_table(database, name);
+    if (table == NULL) {
+      printf("Error: Table not found.\n");
+      return META_COMMAND_SUCCESS;
+    }
     printf("SimpleDB Tree:\n");
-    print_tree(table->pager, 0, 0);
+    print_tree(table->pager, table->root_page_num, 0);
     return META_COMMAND_SUCCESS;
   } else {
     return META_COMMAND_UNRECOGNIZED_COMMAND;
   }
 }
 
+/*
+ * Executes ".load <file> [fill percent]", which bulk loads the rows in the
+ * file into the empty default table.
+ */
+MetaCommandResult do_load_command(InputBuffer* input_buffer,
+                                  Database* database) {
+  strtok(input_buffer->buffer, " ");
+  char* filename = strtok(NULL, " ");
+  char* fill_string = strtok(NULL, " ");
+
+  int fill_percent = LOAD_DEFAULT_FILL_PERCENT;
+  if (fill_string != NULL) {
+    fill_percent = atoi(fill_string);
+  }
+  if (filename == NULL || fill_percent < 1 || fill_percent > 100) {
+    printf("Usage: .load <file> [fill percent]\n");
+    return META_COMMAND_SUCCESS;
+  }
+  Table* table = db_find_table(database, DEFAULT_TABLE_NAME);
+  if (table == NULL) {
+    printf("Error: Table not found.\n");
+    return META_COMMAND_SUCCESS;
+  }
+
+  LoadSummary summary;
+  LoadResult result = load_file(table, filename, fill_percent,
+                                LOAD_DEFAULT_SORT_MEMORY, &summary);
+  print_load_result(result, &summary);
+  return META_COMMAND_SUCCESS;
+}
+
 /*
  * Detects the statement type and prepares a Statement for execution.
  */
 PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
+  strcpy(statement->table_name, DEFAULT_TABLE_NAME);
+
   if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
     return prepare_insert(input_buffer, statement);
   }
 
-  if (strcmp(input_buffer->buffer, "select") == 0) {
-    statement->type = STATEMENT_SELECT;
+  if (strncmp(input_buffer->buffer, "select", 6) == 0) {
+    return prepare_select(input_buffer, statement);
+  }
+
+  if (strncmp(input_buffer->buffer, "delete", 6) == 0) {
+    return prepare_delete(input_buffer, statement);
+  }
+
+  if (strncmp(input_buffer->buffer, "update", 6) == 0) {
+    return prepare_update(input_buffer, statement);
+  }
+
+  if (strncmp(input_buffer->buffer, "create", 6) == 0) {
+    return prepare_create(input_buffer, statement);
+  }
+
+  if (strncmp(input_buffer->buffer, "drop", 4) == 0) {
+    return prepare_drop(input_buffer, statement);
+  }
+
+  if (strcmp(input_buffer->buffer, "begin") == 0) {
+    statement->type = STATEMENT_BEGIN;
+    return PREPARE_SUCCESS;
+  }
+
+  if (strcmp(input_buffer->buffer, "commit") == 0) {
+    statement->type = STATEMENT_COMMIT;
+    return PREPARE_SUCCESS;
+  }
+
+  if (strcmp(input_buffer->buffer, "rollback") == 0) {
+    statement->type = STATEMENT_ROLLBACK;
     return PREPARE_SUCCESS;
   }
 
@@ -46,14 +137,376 @@ PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement)
 }
 
 /*
- * Prepares an insert statement for execution.
- * Tokenizes the query parameters and does validation for size and range.
+ * Checks that NAME can name a table and sets it as the table of the
+ * Statement. Table names start with a letter, which keeps them apart from
+ * ids.
+ */
+static PrepareResult prepare_table_name(char* name, Statement* statement) {
+  if (name == NULL || !isalpha((unsigned char)name[0])) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  for (char* c = name; *c != '\0'; c++) {
+    if (!isalnum((unsigned char)*c) && *c != '_') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  if (strlen(name) > TABLE_NAME_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  strcpy(statement->table_name, name);
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * Parses an optional "from <table>" at TOKEN, the next token of the statement
+ * being tokenized. TOKEN is moved on to the token after it.
+ */
+static PrepareResult prepare_from(Statement* statement, char** token) {
+  if (*token == NULL || strcmp(*token, "from") != 0) {
+    return PREPARE_SUCCESS;
+  }
+  PrepareResult result = prepare_table_name(strtok(NULL, " "), statement);
+  *token = strtok(NULL, " ");
+  return result;
+}
+
+/*
+ * Prepares an insert statement for execution, which is in the form
+ * "insert [into <table>] <id> <username> <email>".
  * Populates the Statement->row_to_insert member.
  */
 PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
   statement->type = STATEMENT_INSERT;
+  char* arguments = input_buffer->buffer + strlen("insert");
+  if (strncmp(arguments, " into ", 6) == 0) {
+    PrepareResult result =
+        prepare_table_name(strtok(arguments + 6, " "), statement);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    arguments = strtok(NULL, "");
+    if (arguments == NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  return prepare_row(arguments, &(statement->row_to_insert));
+}
+
+/*
+ * Prepares a select statement for execution, which is in the form
+ * "select [from <table>] [where ...]".
+ * A bare "select" covers the whole table, otherwise a where clause narrows it
+ * down.
+ */
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_SELECT;
+  char* keyword = strtok(input_buffer->buffer, " ");
+  if (strcmp(keyword, "select") != 0) {
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
+  char* token = strtok(NULL, " ");
+  PrepareResult result = prepare_from(statement, &token);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  return prepare_where(statement, token);
+}
+
+/*
+ * Prepares a delete statement for execution. Like a select, it can name its
+ * table with "from <table>". It takes the same where clause as a select,
+ * except for conditions on the username or email, and a bare "delete" empties
+ * the table.
+ */
+PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_DELETE;
+  char* keyword = strtok(input_buffer->buffer, " ");
+  if (strcmp(keyword, "delete") != 0) {
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
+  char* token = strtok(NULL, " ");
+  PrepareResult result = prepare_from(statement, &token);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  result = prepare_where(statement, token);
+  if (result == PREPARE_SUCCESS && statement->match_column) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return result;
+}
+
+/*
+ * Finds the Column called NAME. Returns false if there is none, or it is the
+ * id.
+ */
+static bool parse_column(char* name, Column* column) {
+  if (strcmp(name, "username") == 0) {
+    *column = COLUMN_USERNAME;
+  } else if (strcmp(name, "email") == 0) {
+    *column = COLUMN_EMAIL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Prepares a create statement for execution, which is either
+ * "create table <table>" or "create index on [<table>] <column>", where
+ * column is username or email.
+ */
+PrepareResult prepare_create(InputBuffer* input_buffer, Statement* statement) {
+  char* keyword = strtok(input_buffer->buffer, " ");
+  char* kind = strtok(NULL, " ");
+  if (strcmp(keyword, "create") != 0) {
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
+  if (kind != NULL && strcmp(kind, "table") == 0) {
+    statement->type = STATEMENT_CREATE_TABLE;
+    PrepareResult result = prepare_table_name(strtok(NULL, " "), statement);
+    if (result == PREPARE_SUCCESS && strtok(NULL, " ") != NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    return result;
+  }
+
+  statement->type = STATEMENT_CREATE_INDEX;
+  char* on = strtok(NULL, " ");
+  char* column = strtok(NULL, " ");
+  char* table_column = strtok(NULL, " ");
+  if (kind == NULL || strcmp(kind, "index") != 0 || on == NULL ||
+      strcmp(on, "on") != 0 || column == NULL || strtok(NULL, " ") != NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (table_column != NULL) {
+    PrepareResult result = prepare_table_name(column, statement);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    column = table_column;
+  }
+  if (!parse_column(column, &statement->column)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * Prepares a "drop table <table>" statement for execution.
+ */
+PrepareResult prepare_drop(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_DROP_TABLE;
+  char* keyword = strtok(input_buffer->buffer, " ");
+  char* kind = strtok(NULL, " ");
+  if (strcmp(keyword, "drop") != 0) {
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
+  if (kind == NULL || strcmp(kind, "table") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  PrepareResult result = prepare_table_name(strtok(NULL, " "), statement);
+  if (result == PREPARE_SUCCESS && strtok(NULL, " ") != NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return result;
+}
+
+/*
+ * Parses the decimal id in STRING into ID. Ids go up to UINT64_MAX.
+ */
+static PrepareResult parse_id(char* string, uint64_t* id) {
+  if (string[0] == '-') {
+    return PREPARE_NEGATIVE_ID;
+  }
+  if (!isdigit((unsigned char)string[0])) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  char* end;
+  errno = 0;
+  *id = strtoull(string, &end, 10);
+  if (*end != '\0' || errno == ERANGE) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * Prepares an update statement for execution, which is in the form
+ * "update [<table>] <id> set <column>=<value> [<column>=<value>]". The
+ * columns are username and email. The new values go to
+ * Statement->row_to_insert.
+ */
+PrepareResult prepare_update(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_UPDATE;
+  statement->set_username = false;
+  statement->set_email = false;
+
   char* keyword = strtok(input_buffer->buffer, " ");
   char* id_string = strtok(NULL, " ");
+  if (strcmp(keyword, "update") != 0) {
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
+  if (id_string != NULL && isalpha((unsigned char)id_string[0])) {
+    PrepareResult name_result = prepare_table_name(id_string, statement);
+    if (name_result != PREPARE_SUCCESS) {
+      return name_result;
+    }
+    id_string = strtok(NULL, " ");
+  }
+  char* set = strtok(NULL, " ");
+  if (id_string == NULL || set == NULL || strcmp(set, "set") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  PrepareResult id_result = parse_id(id_string, &statement->row_to_insert.id);
+  if (id_result != PREPARE_SUCCESS) {
+    return id_result;
+  }
+
+  char* assignment;
+  while ((assignment = strtok(NULL, " ")) != NULL) {
+    char* value = strchr(assignment, '=');
+    if (value == NULL || value[1] == '\0') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    *value++ = '\0';
+
+    if (strcmp(assignment, "username") == 0) {
+      if (strlen(value) > COLUMN_USERNAME_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+      }
+      strcpy(statement->row_to_insert.username, value);
+      statement->set_username = true;
+    } else if (strcmp(assignment, "email") == 0) {
+      if (strlen(value) > COLUMN_EMAIL_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+      }
+      strcpy(statement->row_to_insert.email, value);
+      statement->set_email = true;
+    } else {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+
+  if (!statement->set_username && !statement->set_email) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * Parses the rest of a "<column> = <value>" condition on Statement->column,
+ * of which OPERATOR and VALUE have been read. The value goes to its column in
+ * Statement->row_to_insert.
+ */
+static PrepareResult prepare_column_match(Statement* statement,
+                                          char* operator, char* value) {
+  if (strcmp(operator, "=") != 0 || strtok(NULL, " ") != NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  Row* row = &statement->row_to_insert;
+  if (statement->column == COLUMN_USERNAME) {
+    if (strlen(value) > COLUMN_USERNAME_SIZE) {
+      return PREPARE_STRING_TOO_LONG;
+    }
+    strcpy(row->username, value);
+  } else {
+    if (strlen(value) > COLUMN_EMAIL_SIZE) {
+      return PREPARE_STRING_TOO_LONG;
+    }
+    strcpy(row->email, value);
+  }
+  statement->match_column = true;
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * Parses the rest of the statement being tokenized, which is either empty or
+ * a where clause starting at WHERE, the next token. "where" takes one or two
+ * conditions on the id joined by "and", each in the form "id <op> <number>"
+ * where op is one of =, <, <=, > and >=. They are narrowed down to the
+ * Statement->min_key and Statement->max_key range.
+ * Instead, "where" can take a single condition "<column> = <value>" on the
+ * username or email, which sets Statement->match_column.
+ */
+PrepareResult prepare_where(Statement* statement, char* where) {
+  statement->min_key = 0;
+  statement->max_key = UINT64_MAX;
+  statement->match_column = false;
+
+  if (where == NULL) {
+    return PREPARE_SUCCESS;
+  }
+  if (strcmp(where, "where") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  uint64_t min_key = 0;
+  uint64_t max_key = UINT64_MAX;
+  bool empty = false;
+  for (int i = 0; i < 2; i++) {
+    char* column = strtok(NULL, " ");
+    char* operator = strtok(NULL, " ");
+    char* value_string = strtok(NULL, " ");
+    if (column == NULL || operator == NULL || value_string == NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (i == 0 && parse_column(column, &statement->column)) {
+      return prepare_column_match(statement, operator, value_string);
+    }
+    if (strcmp(column, "id") != 0) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    uint64_t value;
+    PrepareResult value_result = parse_id(value_string, &value);
+    if (value_result != PREPARE_SUCCESS) {
+      return value_result;
+    }
+
+    if (strcmp(operator, "=") == 0) {
+      min_key = value > min_key ? value : min_key;
+      max_key = value < max_key ? value : max_key;
+    } else if (strcmp(operator, ">=") == 0) {
+      min_key = value > min_key ? value : min_key;
+    } else if (strcmp(operator, ">") == 0) {
+      /* There is no key above the largest one, or below 0. */
+      empty = empty || value == UINT64_MAX;
+      min_key = value + 1 > min_key ? value + 1 : min_key;
+    } else if (strcmp(operator, "<=") == 0) {
+      max_key = value < max_key ? value : max_key;
+    } else if (strcmp(operator, "<") == 0) {
+      empty = empty || value == 0;
+      max_key = value - 1 < max_key ? value - 1 : max_key;
+    } else {
+      return PREPARE_SYNTAX_ERROR;
+    }
+
+    char* conjunction = strtok(NULL, " ");
+    if (conjunction == NULL) {
+      break;
+    }
+    if (strcmp(conjunction, "and") != 0 || i == 1) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+
+  if (empty || min_key > max_key) {
+    /* Nothing can match, seek past the last key and find nothing there. */
+    statement->min_key = UINT64_MAX;
+    statement->max_key = 0;
+  } else {
+    statement->min_key = min_key;
+    statement->max_key = max_key;
+  }
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * Tokenizes the "id username email" fields in ARGUMENTS into ROW.
+ * Does validation for size and range. ARGUMENTS is modified.
+ */
+PrepareResult prepare_row(char* arguments, Row* row) {
+  char* id_string = strtok(arguments, " ");
   char* username = strtok(NULL, " ");
   char* email = strtok(NULL, " ");
 
@@ -61,9 +514,9 @@ PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
     return PREPARE_SYNTAX_ERROR;
   }
 
-  int id = atoi(id_string);
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
+  PrepareResult id_result = parse_id(id_string, &row->id);
+  if (id_result != PREPARE_SUCCESS) {
+    return id_result;
   }
   if (strlen(username) > COLUMN_USERNAME_SIZE) {
     return PREPARE_STRING_TOO_LONG;
@@ -72,21 +525,131 @@ PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
     return PREPARE_STRING_TOO_LONG;
   }
 
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
+  strcpy(row->username, username);
+  strcpy(row->email, email);
 
   return PREPARE_SUCCESS;
 }
 
+/*
+ * Executes begin, commit and rollback, IN_TRANSACTION telling whether one was
+ * begun. A transaction keeps the calling thread the writer of the pager from
+ * begin to its end, so other threads that write wait for it, and its
+ * statements are logged with a single commit. Rollback puts back the pages
+ * they changed. The leaves the tables cached may be gone then, so they are
+ * forgotten.
+ */
+static ExecuteResult execute_transaction(Statement* statement,
+                                         Database* database,
+                                         bool in_transaction) {
+  Pager* pager = database->pager;
+  if (statement->type == STATEMENT_BEGIN) {
+    if (in_transaction) {
+      return EXECUTE_TRANSACTION_OPEN;
+    }
+    pager_begin_transaction(pager);
+    return EXECUTE_SUCCESS;
+  }
+  if (!in_transaction) {
+    return EXECUTE_NO_TRANSACTION;
+  }
+
+  if (statement->type == STATEMENT_COMMIT) {
+    pager_commit(pager);
+  } else {
+    pager_rollback(pager);
+    for (uint32_t i = 0; i < database->num_tables; i++) {
+      Table* table = database->tables[i];
+      table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+      for (uint32_t j = 0; j < NUM_INDEXED_COLUMNS; j++) {
+        if (table->indexes[j] != NULL) {
+          table->indexes[j]->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+        }
+      }
+    }
+  }
+  return EXECUTE_SUCCESS;
+}
+
 /*
  * Calls the relevant execution function according to the Statement type.
+ * Statements other than create and drop table need their table to exist.
+ * Rows a statement returns go to WRITER.
+ * Every statement but a select changes pages, so it runs as the writer of the
+ * pager (see pager_begin_write) and commits before it lets the next one in,
+ * unless it is part of a transaction, which commits as a whole. Tables and
+ * indexes cannot be created or dropped in a transaction.
+ * Selects only read, and threads may run them alongside the writer. Each
+ * reads a snapshot of the pages taken when it starts (see
+ * pager_begin_snapshot), so it sees whole statements and neither waits for
+ * the writer nor holds it up. In a transaction a select sees its changes.
  */
-ExecuteResult execute_statement(Statement* statement, Table* table) {
+ExecuteResult execute_statement(Statement* statement, Database* database,
+                                ResultWriter* writer) {
+  bool in_transaction = pager_in_transaction(database->pager);
+  if (in_transaction && (statement->type == STATEMENT_CREATE_INDEX ||
+                         statement->type == STATEMENT_CREATE_TABLE ||
+                         statement->type == STATEMENT_DROP_TABLE)) {
+    return EXECUTE_TRANSACTION_OPEN;
+  }
+
+  bool controls_transaction = statement->type == STATEMENT_BEGIN ||
+                              statement->type == STATEMENT_COMMIT ||
+                              statement->type == STATEMENT_ROLLBACK;
+  Table* table = db_find_table(database, statement->table_name);
+  if (table == NULL && statement->type != STATEMENT_CREATE_TABLE &&
+      statement->type != STATEMENT_DROP_TABLE && !controls_transaction) {
+    return EXECUTE_TABLE_NOT_FOUND;
+  }
+
+  bool writes = statement->type != STATEMENT_SELECT;
+  if (!writes) {
+    pager_begin_snapshot(database->pager);
+  } else if (!in_transaction) {
+    pager_begin_write(database->pager);
+  }
+
+  ExecuteResult result;
   switch (statement->type) {
     case (STATEMENT_INSERT):
-      return execute_insert(statement, table);
+      result = execute_insert(statement, table);
+      break;
     case (STATEMENT_SELECT):
-      return execute_select(statement, table);
+      result = execute_select(statement, table, writer);
+      break;
+    case (STATEMENT_DELETE):
+      result = execute_delete(statement, table);
+      break;
+    case (STATEMENT_UPDATE):
+      result = execute_update(statement, table);
+      break;
+    case (STATEMENT_CREATE_INDEX):
+      result = execute_create_index(statement, table);
+      if (result == EXECUTE_SUCCESS) {
+        catalog_save(database);
+      }
+      break;
+    case (STATEMENT_CREATE_TABLE):
+      result = execute_create_table(statement, database);
+      break;
+    case (STATEMENT_DROP_TABLE):
+      result = execute_drop_table(statement, database);
+      break;
+    case (STATEMENT_BEGIN):
+    case (STATEMENT_COMMIT):
+    case (STATEMENT_ROLLBACK):
+      result = execute_transaction(statement, database, in_transaction);
+      break;
+  }
+
+  /* Pages are consistent between statements, so this is when they are logged
+   * and written. A transaction may have begun or ended in the meantime. */
+  if (!writes) {
+    pager_end_snapshot(database->pager);
+  } else if (!pager_in_transaction(database->pager)) {
+    pager_commit(database->pager);
+    pager_flush_if_needed(database->pager);
+    pager_end_write(database->pager);
   }
+  return result;
 }
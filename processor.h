@@ -4,14 +4,26 @@
 #ifndef _PROCESSOR_H
 #define _PROCESSOR_H
 
+#include "catalog.h"
 #include "interface.h"
 #include "internals.h"
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table);
+MetaCommandResult do_meta_command(InputBuffer* input_buffer,
+                                  Database* database);
+MetaCommandResult do_load_command(InputBuffer* input_buffer,
+                                  Database* database);
 
 PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement);
 PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement);
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement);
+PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement);
+PrepareResult prepare_update(InputBuffer* input_buffer, Statement* statement);
+PrepareResult prepare_create(InputBuffer* input_buffer, Statement* statement);
+PrepareResult prepare_drop(InputBuffer* input_buffer, Statement* statement);
+PrepareResult prepare_where(Statement* statement, char* where);
+PrepareResult prepare_row(char* arguments, Row* row);
 
-ExecuteResult execute_statement(Statement* statement, Table* table);
+ExecuteResult execute_statement(Statement* statement, Database* database,
+                                ResultWriter* writer);
 
 #endif
@@ -20,7 +20,22 @@ typedef enum {
 typedef enum {
   EXECUTE_TABLE_FULL,
   EXECUTE_SUCCESS,
-  EXECUTE_DUPLICATE_KEY
+  EXECUTE_DUPLICATE_KEY,
+  EXECUTE_KEY_NOT_FOUND,
+  EXECUTE_INDEX_EXISTS,
+  EXECUTE_TABLE_EXISTS,
+  EXECUTE_TABLE_NOT_FOUND,
+  EXECUTE_CATALOG_FULL,
+  EXECUTE_TRANSACTION_OPEN,
+  EXECUTE_NO_TRANSACTION
 } ExecuteResult;
 
+typedef enum {
+  LOAD_SUCCESS,
+  LOAD_CANNOT_OPEN_FILE,
+  LOAD_INVALID_ROW,
+  LOAD_DUPLICATE_KEY,
+  LOAD_TABLE_NOT_EMPTY
+} LoadResult;
+
 #endif
@@ -0,0 +1,427 @@
+/********************************************************************************
+ * sdbbench.c : Runs readers alongside a writer on a simpledb database and
+ * checks what the readers see.
+ ********************************************************************************/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "catalog.h"
+#include "internals.h"
+#include "processor.h"
+
+#define BENCH_DEFAULT_READERS 4
+#define BENCH_DEFAULT_ROWS 10000
+#define BENCH_DEFAULT_OPERATIONS 20000
+
+/* A reader scans instead of looking a row up once in this many operations. */
+#define BENCH_SCAN_RATIO 16
+#define BENCH_SCAN_LENGTH 100
+
+/* With batches, the writer rolls back one transaction in this many. */
+#define BENCH_ROLLBACK_RATIO 4
+
+/* The writer updates an even id instead of an odd one once in this many
+ * writes. */
+#define BENCH_UPDATE_RATIO 8
+
+/*
+ * The default table holds the even ids from 2 to 2 * num_rows, which the
+ * readers look for, while the writer inserts and deletes odd ids in between.
+ * The writer also updates the email of even ids to a long or a short form,
+ * so a reader may see either.
+ * Readers take a snapshot for each operation unless use_snapshots is off.
+ * With a batch_size, the writer runs its writes in transactions of that many.
+ * Each thread counts what it did and the errors it saw.
+ */
+typedef struct {
+  Database* database;
+  Table* table;
+  uint32_t num_rows;
+  uint32_t num_operations;
+  bool use_snapshots;
+  uint32_t batch_size;
+  unsigned int seed;
+  uint64_t num_lookups;
+  uint64_t num_scans;
+  uint64_t num_inserts;
+  uint64_t num_deletes;
+  uint64_t num_updates;
+  uint64_t num_errors;
+} BenchThread;
+
+/*
+ * Fills ROW with ID and the username and email that go with it.
+ */
+static void bench_row(Row* row, uint64_t id) {
+  row->id = id;
+  sprintf(row->username, "user%lu", id);
+  sprintf(row->email, "user%lu@example.com", id);
+}
+
+/*
+ * Sets the email of ROW to the long form of its id, which takes up more
+ * room than the one bench_row gives it.
+ */
+static void bench_row_lengthen(Row* row) {
+  sprintf(row->email, "user%lu.updated.by.the.writer@example.com", row->id);
+}
+
+/*
+ * Tells whether the serialized row at SOURCE is the one bench_row makes.
+ */
+static bool bench_row_is_valid(void* source) {
+  char expected[COLUMN_USERNAME_SIZE + 1];
+  sprintf(expected, "user%lu", serialized_row_id(source));
+  uint32_t length;
+  char* username = serialized_row_username(source, &length);
+  return length == strlen(expected) && memcmp(username, expected, length) == 0;
+}
+
+/*
+ * Looks up a random even id, which must be there with the email it had
+ * before or after the writer last updated it.
+ */
+static void bench_lookup(BenchThread* thread) {
+  uint64_t id = 2 * (1 + rand_r(&thread->seed) % thread->num_rows);
+  Row row;
+  Row expected;
+  Row lengthened;
+  bench_row(&expected, id);
+  bench_row(&lengthened, id);
+  bench_row_lengthen(&lengthened);
+  if (!table_lookup(thread->table, id, &row) || row.id != id ||
+      strcmp(row.username, expected.username) != 0 ||
+      (strcmp(row.email, expected.email) != 0 &&
+       strcmp(row.email, lengthened.email) != 0)) {
+    thread->num_errors++;
+  }
+  thread->num_lookups++;
+}
+
+/*
+ * Scans up to BENCH_SCAN_LENGTH rows from the even id EXPECTED and stores
+ * their ids in IDS. Whatever the writer does, every even id must show up in
+ * order, with nothing but odd ids between them. Returns how many rows were
+ * read, or 0 if they were not right.
+ */
+static uint32_t bench_scan_rows(BenchThread* thread, uint64_t expected,
+                                uint64_t* ids) {
+  uint64_t last_id = expected - 1;
+  uint32_t count = 0;
+  Cursor* cursor = table_seek(thread->table, expected);
+  for (; count < BENCH_SCAN_LENGTH && !cursor->end_of_table; count++) {
+    void* row = cursor_value(cursor);
+    uint64_t id = serialized_row_id(row);
+    bool valid = bench_row_is_valid(row);
+    unpin_page(thread->table->pager, cursor->page_num);
+
+    if (!valid || id <= last_id || (id % 2 == 0 && id != expected) ||
+        (id % 2 == 1 && id > expected)) {
+      count = 0;
+      break;
+    }
+    if (id == expected) {
+      expected += 2;
+    }
+    ids[count] = id;
+    last_id = id;
+    cursor_advance(cursor);
+  }
+  if (cursor->end_of_table && expected <= 2 * (uint64_t)thread->num_rows) {
+    count = 0;
+  }
+  cursor_close(cursor);
+  return count;
+}
+
+/*
+ * Scans from a random even id. In a snapshot (IN_SNAPSHOT), scanning again
+ * must read the same rows, however many the writer changed in between.
+ */
+static void bench_scan(BenchThread* thread, bool in_snapshot) {
+  uint64_t start = 2 * (1 + rand_r(&thread->seed) % thread->num_rows);
+  uint64_t ids[BENCH_SCAN_LENGTH];
+  uint32_t count = bench_scan_rows(thread, start, ids);
+  if (count == 0) {
+    thread->num_errors++;
+  } else if (in_snapshot) {
+    uint64_t ids_again[BENCH_SCAN_LENGTH];
+    if (bench_scan_rows(thread, start, ids_again) != count ||
+        memcmp(ids, ids_again, count * sizeof(uint64_t)) != 0) {
+      thread->num_errors++;
+    }
+  }
+  thread->num_scans++;
+}
+
+static void* bench_reader(void* argument) {
+  BenchThread* thread = argument;
+  Pager* pager = thread->database->pager;
+  for (uint32_t i = 0; i < thread->num_operations; i++) {
+    bool in_snapshot = thread->use_snapshots && pager_begin_snapshot(pager);
+    if (rand_r(&thread->seed) % BENCH_SCAN_RATIO == 0) {
+      bench_scan(thread, in_snapshot);
+    } else {
+      bench_lookup(thread);
+    }
+    if (in_snapshot) {
+      pager_end_snapshot(pager);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Begins a transaction if the writer is at the start of a batch, or ends the
+ * one it is in at the end of a batch (AT_END). Every BENCH_ROLLBACK_RATIO-th
+ * batch is rolled back.
+ */
+static void bench_batch(BenchThread* thread, uint32_t operation, bool at_end) {
+  uint32_t batch_size = thread->batch_size;
+  Statement statement;
+  memset(&statement, 0, sizeof(Statement));
+  strcpy(statement.table_name, DEFAULT_TABLE_NAME);
+  if (!at_end && operation % batch_size == 0) {
+    statement.type = STATEMENT_BEGIN;
+  } else if (at_end && ((operation + 1) % batch_size == 0 ||
+                        operation + 1 == thread->num_operations)) {
+    statement.type = (operation / batch_size) % BENCH_ROLLBACK_RATIO ==
+                             BENCH_ROLLBACK_RATIO - 1
+                         ? STATEMENT_ROLLBACK
+                         : STATEMENT_COMMIT;
+  } else {
+    return;
+  }
+  if (execute_statement(&statement, thread->database, NULL) !=
+      EXECUTE_SUCCESS) {
+    thread->num_errors++;
+  }
+}
+
+/*
+ * Updates a random even id to the long or the short form of its email.
+ */
+static ExecuteResult bench_update(BenchThread* thread, Statement* statement) {
+  uint64_t id = 2 * (1 + rand_r(&thread->seed) % thread->num_rows);
+  statement->type = STATEMENT_UPDATE;
+  statement->set_username = false;
+  statement->set_email = true;
+  bench_row(&statement->row_to_insert, id);
+  if (rand_r(&thread->seed) % 2 == 0) {
+    bench_row_lengthen(&statement->row_to_insert);
+  }
+  thread->num_updates++;
+  return execute_statement(statement, thread->database, NULL);
+}
+
+/*
+ * Inserts a random odd id, or deletes it if it is there already.
+ */
+static ExecuteResult bench_insert_or_delete(BenchThread* thread,
+                                            Statement* statement) {
+  uint64_t id = 2 * (rand_r(&thread->seed) % thread->num_rows) + 1;
+  statement->type = STATEMENT_INSERT;
+  bench_row(&statement->row_to_insert, id);
+  ExecuteResult result = execute_statement(statement, thread->database, NULL);
+  if (result == EXECUTE_DUPLICATE_KEY) {
+    statement->type = STATEMENT_DELETE;
+    statement->min_key = id;
+    statement->max_key = id;
+    result = execute_statement(statement, thread->database, NULL);
+    thread->num_deletes++;
+  } else {
+    thread->num_inserts++;
+  }
+  return result;
+}
+
+/*
+ * Writes with bench_insert_or_delete, and once in BENCH_UPDATE_RATIO writes
+ * with bench_update instead.
+ */
+static void* bench_writer(void* argument) {
+  BenchThread* thread = argument;
+  Statement statement;
+  memset(&statement, 0, sizeof(Statement));
+  strcpy(statement.table_name, DEFAULT_TABLE_NAME);
+  for (uint32_t i = 0; i < thread->num_operations; i++) {
+    if (thread->batch_size > 0) {
+      bench_batch(thread, i, false);
+    }
+    ExecuteResult result;
+    if (rand_r(&thread->seed) % BENCH_UPDATE_RATIO == 0) {
+      result = bench_update(thread, &statement);
+    } else {
+      result = bench_insert_or_delete(thread, &statement);
+    }
+    if (result != EXECUTE_SUCCESS) {
+      thread->num_errors++;
+    }
+    if (thread->batch_size > 0) {
+      bench_batch(thread, i, true);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Adds the even ids to an empty table.
+ */
+static void bench_preload(Database* database, uint32_t num_rows) {
+  Statement statement;
+  memset(&statement, 0, sizeof(Statement));
+  statement.type = STATEMENT_INSERT;
+  strcpy(statement.table_name, DEFAULT_TABLE_NAME);
+  for (uint32_t i = 1; i <= num_rows; i++) {
+    bench_row(&statement.row_to_insert, 2 * (uint64_t)i);
+    execute_statement(&statement, database, NULL);
+  }
+}
+
+/*
+ * Counts the rows of TABLE, and the ones that are not in order or do not
+ * look like bench_row made them.
+ */
+static uint64_t bench_count_rows(Table* table, uint64_t* num_errors) {
+  uint64_t count = 0;
+  uint64_t last_id = 0;
+  Cursor* cursor = table_start(table);
+  while (!cursor->end_of_table) {
+    void* row = cursor_value(cursor);
+    uint64_t id = serialized_row_id(row);
+    if (id <= last_id || !bench_row_is_valid(row)) {
+      (*num_errors)++;
+    }
+    last_id = id;
+    count++;
+    unpin_page(table->pager, cursor->page_num);
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+  return count;
+}
+
+/*
+ * Entry point for the sdbbench program.
+ *
+ * Usage: sdbbench <db file> [options]
+ * An empty default table is filled with the even ids first. Then the readers
+ * look up and scan even ids, while one writer inserts and deletes odd ones
+ * and updates even ones.
+ * The counts it prints only depend on the options, the time it took does not.
+ * Options:
+ *   --readers N       number of reader threads (default 4)
+ *   --rows N          number of even ids to load (default 10000)
+ *   --operations N    lookups or scans per reader, and writes (default 20000)
+ *   --frames N        number of pages the buffer pool keeps in memory
+ *   --mmap            read pages through a memory mapping of the file
+ *   --page-size N     size of the pages of a new database file, in bytes
+ *   --no-snapshots    readers latch the pages they read instead of taking
+ *                     a snapshot
+ *   --batch N         the writer commits N writes at a time, and rolls back
+ *                     every fourth batch instead
+ */
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("Usage: sdbbench <db file> [--readers N] [--rows N] "
+           "[--operations N] [--frames N] [--mmap] [--page-size N] "
+           "[--no-snapshots] [--batch N]\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t num_readers = BENCH_DEFAULT_READERS;
+  uint32_t num_rows = BENCH_DEFAULT_ROWS;
+  uint32_t num_operations = BENCH_DEFAULT_OPERATIONS;
+  bool use_snapshots = true;
+  uint32_t batch_size = 0;
+  PagerOptions options = {.num_frames = PAGER_DEFAULT_FRAMES};
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--readers") == 0 && i + 1 < argc) {
+      num_readers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+      num_rows = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--operations") == 0 && i + 1 < argc) {
+      num_operations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      options.num_frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options.use_mmap = true;
+    } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+      options.page_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--no-snapshots") == 0) {
+      use_snapshots = false;
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_size = atoi(argv[++i]);
+    } else {
+      printf("Unknown option '%s'. Quitting..\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (num_rows == 0) {
+    printf("There must be at least one row. Quitting..\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Database* database = db_open(argv[1], options);
+  Table* table = db_find_table(database, DEFAULT_TABLE_NAME);
+  if (table == NULL) {
+    printf("Error: Table not found.\n");
+    db_close(database);
+    exit(EXIT_FAILURE);
+  }
+  uint64_t num_errors = 0;
+  if (bench_count_rows(table, &num_errors) == 0) {
+    bench_preload(database, num_rows);
+  }
+  pager_enable_threads(database->pager, num_readers + 1);
+
+  uint32_t num_threads = num_readers + 1;
+  BenchThread* threads = calloc(num_threads, sizeof(BenchThread));
+  pthread_t* thread_ids = malloc(num_threads * sizeof(pthread_t));
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < num_threads; i++) {
+    threads[i].database = database;
+    threads[i].table = table;
+    threads[i].num_rows = num_rows;
+    threads[i].num_operations = num_operations;
+    threads[i].use_snapshots = use_snapshots;
+    threads[i].batch_size = batch_size;
+    threads[i].seed = i + 1;
+    pthread_create(&thread_ids[i], NULL, i == 0 ? bench_writer : bench_reader,
+                   &threads[i]);
+  }
+
+  uint64_t num_lookups = 0;
+  uint64_t num_scans = 0;
+  for (uint32_t i = 0; i < num_threads; i++) {
+    pthread_join(thread_ids[i], NULL);
+    num_lookups += threads[i].num_lookups;
+    num_scans += threads[i].num_scans;
+    num_errors += threads[i].num_errors;
+  }
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  uint64_t num_final_rows = bench_count_rows(table, &num_errors);
+  printf("Readers: %u, lookups: %lu, scans: %lu\n", num_readers, num_lookups,
+         num_scans);
+  printf("Writer: %lu inserts, %lu deletes, %lu updates\n",
+         threads[0].num_inserts, threads[0].num_deletes,
+         threads[0].num_updates);
+  printf("Rows: %lu\n", num_final_rows);
+  printf("Errors: %lu\n", num_errors);
+  printf("Took %.3f s, %.0f operations per second\n", seconds,
+         (num_lookups + num_scans + num_operations) / seconds);
+
+  free(threads);
+  free(thread_ids);
+  db_close(database);
+  return num_errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,72 @@
+/********************************************************************************
+ * sdbload.c : Bulk loads rows from a text file into a new simpledb database.
+ ********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "catalog.h"
+#include "internals.h"
+#include "loader.h"
+
+/*
+ * Entry point for the sdbload program.
+ *
+ * Usage: sdbload <db file> <input file> [options]
+ * The input has one "id username email" row per line, in any order. The
+ * rows go to the default table.
+ * Options:
+ *   --fill N          percentage of each node to fill (default 90)
+ *   --sort-memory N   megabytes of rows to sort in memory at a time
+ *   --frames N        number of pages the buffer pool keeps in memory
+ *   --mmap            read pages through a memory mapping of the file
+ *   --page-size N     size of the pages of a new database file, in bytes
+ */
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    printf("Usage: sdbload <db file> <input file> [--fill N] "
+           "[--sort-memory N] [--frames N] [--mmap] [--page-size N]\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int fill_percent = LOAD_DEFAULT_FILL_PERCENT;
+  size_t sort_memory = LOAD_DEFAULT_SORT_MEMORY;
+  PagerOptions options = {.num_frames = PAGER_DEFAULT_FRAMES};
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--fill") == 0 && i + 1 < argc) {
+      fill_percent = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--sort-memory") == 0 && i + 1 < argc) {
+      sort_memory = (size_t)atoi(argv[++i]) * 1024 * 1024;
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      options.num_frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options.use_mmap = true;
+    } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+      options.page_size = atoi(argv[++i]);
+    } else {
+      printf("Unknown option '%s'. Quitting..\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (fill_percent < 1 || fill_percent > 100) {
+    printf("Fill percentage must be between 1 and 100. Quitting..\n");
+    exit(EXIT_FAILURE);
+  }
+
+  Database* database = db_open(argv[1], options);
+  Table* table = db_find_table(database, DEFAULT_TABLE_NAME);
+  if (table == NULL) {
+    printf("Error: Table not found.\n");
+    db_close(database);
+    exit(EXIT_FAILURE);
+  }
+  LoadSummary summary;
+  LoadResult result =
+      load_file(table, argv[2], fill_percent, sort_memory, &summary);
+  print_load_result(result, &summary);
+  db_close(database);
+
+  return result == LOAD_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,538 @@
+/********************************************************************************
+ * server.c : Serving the default table to clients over a socket
+ *
+ * One thread runs an epoll loop over the listening socket and the connections
+ * of the clients, none of which block. In each turn it reads what the clients
+ * sent and handles their requests one after the other, as the REPL would.
+ * Then, like the REPL does for piped input, it syncs the log once for the
+ * inserts of all the clients before it sends any response.
+ ********************************************************************************/
+#define _GNU_SOURCE
+#include "server.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "processor.h"
+
+/* Set by SIGINT and SIGTERM, which stop the server. */
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int signal_number) {
+  (void)signal_number;
+  stop_requested = 1;
+}
+
+static uint16_t get_uint16(const char *source) {
+  const unsigned char *bytes = (const unsigned char *)source;
+  return bytes[0] | (bytes[1] << 8);
+}
+
+static uint32_t get_uint32(const char *source) {
+  const unsigned char *bytes = (const unsigned char *)source;
+  uint32_t value = 0;
+  for (int i = 3; i >= 0; i--) {
+    value = (value << 8) | bytes[i];
+  }
+  return value;
+}
+
+static uint64_t get_uint64(const char *source) {
+  const unsigned char *bytes = (const unsigned char *)source;
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--) {
+    value = (value << 8) | bytes[i];
+  }
+  return value;
+}
+
+/*
+ * Opens the socket the server listens on. An ADDRESS with a slash in it is
+ * the path of a Unix socket, which replaces whatever is there. Anything else
+ * is a TCP port on the loopback interface.
+ */
+static void server_listen(Server *server, const char *address) {
+  int fd;
+  int result;
+  if (strchr(address, '/') != NULL) {
+    struct sockaddr_un unix_address = {.sun_family = AF_UNIX};
+    if (strlen(address) >= sizeof(unix_address.sun_path)) {
+      printf("Socket path too long: %s\n", address);
+      exit(EXIT_FAILURE);
+    }
+    strcpy(unix_address.sun_path, address);
+    unlink(address);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    result = fd == -1 ? -1
+                      : bind(fd, (struct sockaddr *)&unix_address,
+                             sizeof(unix_address));
+    server->unix_path = strdup(address);
+  } else {
+    char *end;
+    long port = strtol(address, &end, 10);
+    if (end == address || *end != '\0' || port <= 0 || port > 65535) {
+      printf("Invalid address '%s'. Quitting..\n", address);
+      exit(EXIT_FAILURE);
+    }
+    struct sockaddr_in inet_address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    result = fd == -1 ? -1
+                      : setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                                   sizeof(reuse));
+    if (result != -1) {
+      result = bind(fd, (struct sockaddr *)&inet_address,
+                    sizeof(inet_address));
+    }
+    server->unix_path = NULL;
+  }
+
+  if (result == -1 || listen(fd, SOMAXCONN) == -1) {
+    printf("Error listening on %s: %d\n", address, errno);
+    exit(EXIT_FAILURE);
+  }
+  server->listen_fd = fd;
+}
+
+/*
+ * Accepts the clients that are waiting to connect.
+ */
+static void server_accept(Server *server) {
+  while (true) {
+    int fd = accept4(server->listen_fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      return;
+    }
+    if (server->unix_path == NULL) {
+      /* Responses are small and the client waits for them. */
+      int no_delay = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    }
+
+    Connection *connection = malloc(sizeof(Connection));
+    connection->fd = fd;
+    connection->input = malloc(SERVER_INPUT_BUFFER_SIZE);
+    connection->input_length = 0;
+    connection->output = result_writer_open(fd, RESULT_BINARY);
+    connection->input_closed = false;
+    connection->scanning = false;
+    connection->events = EPOLLIN;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      printf("Error watching connection: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/*
+ * Drops CONNECTION along with the responses it did not send yet.
+ */
+static void connection_close(Connection *connection) {
+  close(connection->fd);
+  connection->output->length = 0;
+  result_writer_close(connection->output);
+  free(connection->input);
+  free(connection);
+}
+
+/*
+ * Reads the requests that arrived on CONNECTION into its input, as far as
+ * they fit. Returns false if the connection failed. A client that closed its
+ * end may still wait for responses, so the end of input only sets
+ * input_closed.
+ */
+static bool connection_read(Connection *connection) {
+  size_t room = SERVER_INPUT_BUFFER_SIZE - connection->input_length;
+  if (room == 0) {
+    return true;
+  }
+  ssize_t count =
+      read(connection->fd, connection->input + connection->input_length, room);
+  if (count == -1) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+  connection->input_length += count;
+  if (count == 0) {
+    connection->input_closed = true;
+  }
+  return true;
+}
+
+/*
+ * Tells whether AVAILABLE bytes of input starting at REQUEST hold a whole
+ * request, or a length no request has. Either can be handled right away.
+ */
+static bool request_is_ready(const char *request, size_t available) {
+  if (available < 4) {
+    return false;
+  }
+  uint32_t length = get_uint32(request);
+  return length == 0 || length > REQUEST_MAX_SIZE || available >= 4 + length;
+}
+
+/*
+ * Tells whether the output of CONNECTION has room for another response, or
+ * for more rows of a scan.
+ */
+static bool connection_has_room(Connection *connection) {
+  return RESULT_BUFFER_SIZE - connection->output->length >=
+         SERVER_RESPONSE_RESERVE;
+}
+
+static void response_begin(Connection *connection, ResponseStatus status) {
+  ResultWriter *output = connection->output;
+  output->buffer[output->length++] = status;
+}
+
+/*
+ * Adds the rows of the scan CONNECTION is in to its output, until the scan
+ * is done or the output is full. The next call goes on from the row after
+ * the last one added, so rows that other clients inserted or deleted in
+ * between may or may not show up, but each row comes at most once and in
+ * order.
+ */
+static void connection_scan(Server *server, Connection *connection) {
+  Table *table = server->table;
+  Cursor *cursor;
+  if (connection->scan_key == 0) {
+    cursor = table_start(table);
+  } else {
+    cursor = table_seek(table, connection->scan_key);
+  }
+  cursor->cold_scan = true;
+
+  bool done = true;
+  while (!cursor->end_of_table) {
+    void *value = cursor_value(cursor);
+    uint64_t id = serialized_row_id(value);
+    if (id > connection->scan_max_key) {
+      unpin_page(table->pager, cursor->page_num);
+      break;
+    }
+    if (!connection_has_room(connection)) {
+      unpin_page(table->pager, cursor->page_num);
+      connection->scan_key = id;
+      done = false;
+      break;
+    }
+    uint32_t username_length;
+    uint32_t email_length;
+    char *username = serialized_row_username(value, &username_length);
+    char *email = serialized_row_email(value, &email_length);
+    result_writer_add_row(connection->output, id, username, username_length,
+                          email, email_length);
+    unpin_page(table->pager, cursor->page_num);
+    if (id == connection->scan_max_key) {
+      break;
+    }
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+
+  if (done) {
+    result_writer_add_end(connection->output);
+    connection->scanning = false;
+  }
+}
+
+/*
+ * Inserts the row in the ARGUMENTS of an insert request, which are LENGTH
+ * bytes long. Returns false if they cannot be parsed.
+ */
+static bool request_insert(Server *server, Connection *connection,
+                           const char *arguments, uint32_t length) {
+  if (length < 8 + 2) {
+    return false;
+  }
+  uint32_t username_length = get_uint16(arguments + 8);
+  const char *username = arguments + 8 + 2;
+  uint32_t username_end = 8 + 2 + username_length;
+  if (length < username_end + 2) {
+    return false;
+  }
+  uint32_t email_length = get_uint16(arguments + username_end);
+  const char *email = arguments + username_end + 2;
+  if (length != username_end + 2 + email_length) {
+    return false;
+  }
+  if (username_length > COLUMN_USERNAME_SIZE ||
+      email_length > COLUMN_EMAIL_SIZE) {
+    response_begin(connection, RESPONSE_STRING_TOO_LONG);
+    return true;
+  }
+
+  Statement statement;
+  memset(&statement, 0, sizeof(Statement));
+  statement.type = STATEMENT_INSERT;
+  strcpy(statement.table_name, server->table->name);
+  statement.row_to_insert.id = get_uint64(arguments);
+  memcpy(statement.row_to_insert.username, username, username_length);
+  memcpy(statement.row_to_insert.email, email, email_length);
+
+  ExecuteResult result = execute_statement(&statement, server->database, NULL);
+  if (result == EXECUTE_SUCCESS) {
+    response_begin(connection, RESPONSE_SUCCESS);
+  } else if (result == EXECUTE_DUPLICATE_KEY) {
+    response_begin(connection, RESPONSE_DUPLICATE_KEY);
+  } else {
+    response_begin(connection, RESPONSE_FAILED);
+  }
+  return true;
+}
+
+/*
+ * Handles the ready request at REQUEST. A get and a scan read the table
+ * directly rather than through execute_statement, whose rows would be
+ * written out with blocking calls. Returns the size of the request, or 0 if
+ * it cannot be parsed.
+ */
+static size_t request_handle(Server *server, Connection *connection,
+                             const char *request) {
+  uint32_t length = get_uint32(request);
+  if (length == 0 || length > REQUEST_MAX_SIZE) {
+    return 0;
+  }
+  const char *arguments = request + 5;
+  uint32_t arguments_length = length - 1;
+
+  switch (request[4]) {
+    case (REQUEST_INSERT):
+      if (!request_insert(server, connection, arguments, arguments_length)) {
+        return 0;
+      }
+      break;
+    case (REQUEST_GET):
+      if (arguments_length != 8) {
+        return 0;
+      }
+      response_begin(connection, RESPONSE_SUCCESS);
+      Row row;
+      if (table_lookup(server->table, get_uint64(arguments), &row)) {
+        result_writer_add_row(connection->output, row.id, row.username,
+                              strlen(row.username), row.email,
+                              strlen(row.email));
+      }
+      result_writer_add_end(connection->output);
+      break;
+    case (REQUEST_SCAN):
+      if (arguments_length != 16) {
+        return 0;
+      }
+      response_begin(connection, RESPONSE_SUCCESS);
+      connection->scanning = true;
+      connection->scan_key = get_uint64(arguments);
+      connection->scan_max_key = get_uint64(arguments + 8);
+      if (connection->scan_key > connection->scan_max_key) {
+        result_writer_add_end(connection->output);
+        connection->scanning = false;
+      }
+      break;
+    default:
+      return 0;
+  }
+  return 4 + length;
+}
+
+/*
+ * Handles the requests CONNECTION sent, for as long as their responses fit
+ * in its output. Returns false if one of them cannot be parsed.
+ */
+static bool connection_process(Server *server, Connection *connection) {
+  size_t offset = 0;
+  bool valid = true;
+  while (connection_has_room(connection)) {
+    if (connection->scanning) {
+      connection_scan(server, connection);
+      continue;
+    }
+    char *request = connection->input + offset;
+    if (!request_is_ready(request, connection->input_length - offset)) {
+      break;
+    }
+    size_t length = request_handle(server, connection, request);
+    if (length == 0) {
+      valid = false;
+      break;
+    }
+    offset += length;
+  }
+
+  memmove(connection->input, connection->input + offset,
+          connection->input_length - offset);
+  connection->input_length -= offset;
+  return valid;
+}
+
+/*
+ * Sends the responses of CONNECTION, as far as the socket takes them.
+ * Returns false if the client is gone.
+ */
+static bool connection_send(Connection *connection) {
+  ResultWriter *output = connection->output;
+  size_t sent = 0;
+  while (sent < output->length) {
+    ssize_t count = send(connection->fd, output->buffer + sent,
+                         output->length - sent, MSG_NOSIGNAL);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return false;
+    }
+    sent += count;
+  }
+
+  memmove(output->buffer, output->buffer + sent, output->length - sent);
+  output->length -= sent;
+  return true;
+}
+
+/*
+ * Tells whether the client of CONNECTION closed its end and got the responses
+ * to every whole request it sent.
+ */
+static bool connection_is_done(Connection *connection) {
+  return connection->input_closed && connection->output->length == 0 &&
+         !connection->scanning &&
+         !request_is_ready(connection->input, connection->input_length);
+}
+
+/*
+ * Makes the event loop wait for what CONNECTION can do next: read while its
+ * input is open and has room, and write while it has responses to send or
+ * requests that wait for room in its output. Level triggered EPOLLOUT comes
+ * back right away once the output is empty, so those requests are handled
+ * next turn.
+ */
+static void connection_watch(Server *server, Connection *connection) {
+  uint32_t events = 0;
+  if (!connection->input_closed &&
+      connection->input_length < SERVER_INPUT_BUFFER_SIZE) {
+    events |= EPOLLIN;
+  }
+  if (connection->output->length > 0 || connection->scanning ||
+      request_is_ready(connection->input, connection->input_length)) {
+    events |= EPOLLOUT;
+  }
+  if (events == connection->events) {
+    return;
+  }
+  struct epoll_event event = {.events = events, .data.ptr = connection};
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) ==
+      -1) {
+    printf("Error watching connection: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  connection->events = events;
+}
+
+/*
+ * Serves the default table of DATABASE on ADDRESS (see server_listen) until
+ * the process gets SIGINT or SIGTERM.
+ * All inserts handled in a turn of the loop share one log sync, which comes
+ * before any of their responses is sent, so an insert is never acknowledged
+ * before it is durable.
+ */
+void server_run(Database *database, const char *address) {
+  Server server = {.database = database};
+  server.table = db_find_table(database, DEFAULT_TABLE_NAME);
+  if (server.table == NULL) {
+    printf("Error: Table not found.\n");
+    db_close(database);
+    exit(EXIT_FAILURE);
+  }
+  server_listen(&server, address);
+
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = NULL};
+  if (server.epoll_fd == -1 ||
+      epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd,
+                &listen_event) == -1) {
+    printf("Error creating event loop: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  /* The stop signals are only let through while the loop waits, so one that
+   * comes while it is busy ends the wait right after. */
+  struct sigaction action = {.sa_handler = request_stop};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  sigset_t stop_signals;
+  sigset_t wait_mask;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &stop_signals, &wait_mask);
+
+  printf("Listening on %s\n", address);
+  fflush(stdout);
+
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  Connection *ready[SERVER_MAX_EVENTS];
+  while (!stop_requested) {
+    int count = epoll_pwait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1,
+                            &wait_mask);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error waiting for events: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+
+    uint32_t num_ready = 0;
+    for (int i = 0; i < count; i++) {
+      Connection *connection = events[i].data.ptr;
+      if (connection == NULL) {
+        server_accept(&server);
+        continue;
+      }
+      bool alive = (events[i].events & EPOLLERR) == 0;
+      if (alive && (events[i].events & (EPOLLIN | EPOLLHUP))) {
+        alive = connection_read(connection);
+      }
+      if (alive) {
+        alive = connection_process(&server, connection);
+      }
+      if (alive) {
+        ready[num_ready++] = connection;
+      } else {
+        connection_close(connection);
+      }
+    }
+
+    pager_sync(database->pager);
+    for (uint32_t i = 0; i < num_ready; i++) {
+      if (connection_send(ready[i]) && !connection_is_done(ready[i])) {
+        connection_watch(&server, ready[i]);
+      } else {
+        connection_close(ready[i]);
+      }
+    }
+  }
+
+  close(server.epoll_fd);
+  close(server.listen_fd);
+  if (server.unix_path != NULL) {
+    unlink(server.unix_path);
+    free(server.unix_path);
+  }
+}
@@ -0,0 +1,97 @@
+/********************************************************************************
+ * server.h : Serving the default table to clients over a socket
+ ********************************************************************************/
+#ifndef _SERVER_H
+#define _SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "catalog.h"
+#include "output.h"
+
+/*
+ * A request is a frame made of a 32 bit length of the rest of the frame, a
+ * byte with the RequestType, and its arguments:
+ *   REQUEST_INSERT  the 64 bit id, and the username and the email, each as a
+ *                   16 bit length followed by that many bytes
+ *   REQUEST_GET     the 64 bit id
+ *   REQUEST_SCAN    the 64 bit smallest and largest id, both included
+ * Integers are little endian, as in output.h. A client may send requests
+ * without waiting for the responses, which come back in the same order.
+ */
+typedef enum {
+  REQUEST_INSERT = 1,
+  REQUEST_GET = 2,
+  REQUEST_SCAN = 3
+} RequestType;
+
+/* The largest request there is: an insert of the longest strings. */
+#define REQUEST_MAX_SIZE (1 + 8 + 2 + COLUMN_USERNAME_SIZE + 2 + COLUMN_EMAIL_SIZE)
+
+/*
+ * A response starts with a byte with the ResponseStatus. A get or a scan is
+ * followed by the rows it found, in the binary format of output.h, ending
+ * with the frame of length 0. An insert is acknowledged once it is durable.
+ * A request that cannot be parsed closes the connection.
+ */
+typedef enum {
+  RESPONSE_SUCCESS,
+  RESPONSE_DUPLICATE_KEY,
+  RESPONSE_STRING_TOO_LONG,
+  RESPONSE_FAILED
+} ResponseStatus;
+
+/* Bytes of requests a connection holds before it stops reading more. */
+#define SERVER_INPUT_BUFFER_SIZE (64 * 1024)
+
+/*
+ * A request is only started with this much room left in the output buffer,
+ * and a scan stops adding rows below it: the largest row, the frame that
+ * ends the rows and the status byte fit in it.
+ */
+#define SERVER_RESPONSE_RESERVE 512
+
+/* Most events handled in one turn of the event loop. */
+#define SERVER_MAX_EVENTS 64
+
+/*
+ * A client. INPUT holds input_length bytes of requests that were read but not
+ * handled yet, and input_closed is set once the client sent all it will.
+ * OUTPUT collects the responses, which are sent once the inserts they
+ * acknowledge are durable.
+ * A scan is sent a buffer at a time. While one is in progress (scanning), the
+ * rows from scan_key to scan_max_key are still to come, and the requests
+ * after it wait.
+ * EVENTS are the epoll events the connection waits for.
+ */
+typedef struct {
+  int fd;
+  char* input;
+  size_t input_length;
+  bool input_closed;
+  ResultWriter* output;
+  bool scanning;
+  uint64_t scan_key;
+  uint64_t scan_max_key;
+  uint32_t events;
+} Connection;
+
+/*
+ * Clients of DATABASE connect to LISTEN_FD, and the event loop on EPOLL_FD
+ * serves all of them from one thread, so they share the buffer pool and
+ * every request sees the ones before it. UNIX_PATH is the path of the
+ * socket if it is a Unix one, or NULL.
+ */
+typedef struct {
+  Database* database;
+  Table* table;
+  int listen_fd;
+  int epoll_fd;
+  char* unix_path;
+} Server;
+
+void server_run(Database* database, const char* address);
+
+#endif
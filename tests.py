@@ -1,20 +1,40 @@
+import os
+import random
+import signal
+import socket
+import struct
+import threading
 import unittest
 from subprocess import Popen, PIPE, run
 
 class TestDatabase(unittest.TestCase):
     TESTING_DB_FILENAME = 'simpledbtesting.sdb'
+    TESTING_LOAD_FILENAME = 'simpledbtesting.txt'
+    TESTING_SOCKET_PATH = './simpledbtesting.sock'
 
     def setUp(self):
         pass
 
     def tearDown(self):
-        run(['rm', "-f", self.TESTING_DB_FILENAME])
+        run(['rm', "-f", self.TESTING_DB_FILENAME, self.TESTING_DB_FILENAME + ".wal", self.TESTING_LOAD_FILENAME,
+             self.TESTING_SOCKET_PATH])
 
-    def run_db(self, commands):
+    def write_load_file(self, ids):
+        with open(self.TESTING_LOAD_FILENAME, 'w') as load_file:
+            for i in ids:
+                load_file.write("{0} user{0} user{0}@email.com\n".format(i))
+
+    def full_row_insert(self, i):
+        """
+        An insert of the largest row there is. 13 of them fill a leaf.
+        """
+        return "insert {0} {1} {2}".format(i, "u" * 32, "e" * 254 + str(i % 10))
+
+    def run_db(self, commands, options=[]):
         commands = '\n'.join(commands)
         commands += '\n'
 
-        dbproc = Popen(["./bin/simpledb", self.TESTING_DB_FILENAME], stdin=PIPE, stdout=PIPE, text=True)
+        dbproc = Popen(["./bin/simpledb", self.TESTING_DB_FILENAME] + options, stdin=PIPE, stdout=PIPE, text=True)
         results = dbproc.communicate(commands)[0]
         return results.split("\n")
 
@@ -46,12 +66,13 @@ class TestDatabase(unittest.TestCase):
         commands = ['.constants', '.exit']
         results = self.run_db(commands)
         expectedResults = [
-            'ROW_SIZE: 293',
+            'ROW_MAX_SIZE: 297',
             'COMMON_NODE_HEADER_SIZE: 6',
-            'LEAF_NODE_HEADER_SIZE: 14',
-            'LEAF_NODE_CELL_SIZE: 297',
-            'LEAF_NODE_SPACE_FOR_CELLS: 4082',
-            'LEAF_NODE_MAX_CELLS: 13'
+            'LEAF_NODE_HEADER_SIZE: 18',
+            'LEAF_NODE_CELL_POINTER_SIZE: 2',
+            'LEAF_NODE_SPACE_FOR_CELLS: 4078',
+            'LEAF_NODE_MAX_CELLS: 291',
+            'INTERNAL_NODE_MAX_CELLS: 338'
         ]
         for eres in expectedResults:
             self.assertIn(eres, results)
@@ -75,16 +96,24 @@ class TestDatabase(unittest.TestCase):
         for eres in expectedResults:
             self.assertIn(eres, results)
 
+    def test_packsShortRowsIntoOneLeaf(self):
+        commands = []
+        for i in range(1, 101):
+            commands.append("insert {0} user{0} user{0}@email.com".format(i))
+        commands.extend(['.btree', '.exit'])
+        results = self.run_db(commands)
+        self.assertIn("- leaf (size 100)", results)
+
     def test_printBtreeWithMultipleNodes(self):
         commands = []
         for i in range(1, 15):
-            commands.append("insert {0} user{0} user{0}@email.com".format(i))
+            commands.append(self.full_row_insert(i))
         commands.append(".btree")
         results = self.run_db(commands)
         expectedResults = [
             "db > SimpleDB Tree:",
             "- internal (size 1)",
-            "    - leaf (size 7)",
+            "    - leaf (size 13)",
             "        -1",
             "        -2",
             "        -3",
@@ -92,14 +121,14 @@ class TestDatabase(unittest.TestCase):
             "        -5",
             "        -6",
             "        -7",
-            "    - key 7",
-            "    - leaf (size 7)",
             "        -8",
             "        -9",
             "        -10",
             "        -11",
             "        -12",
             "        -13",
+            "    - key 13",
+            "    - leaf (size 1)",
             "        -14",
         ]
         for eres in expectedResults:
@@ -121,6 +150,673 @@ class TestDatabase(unittest.TestCase):
         for eres in expectedResults:
             self.assertIn(eres, results)
 
+    def test_selectsRowsInKeyRange(self):
+        commands = []
+        for i in range(1, 201):
+            commands.append("insert {0} user{0} user{0}@email.com".format(i * 2))
+        commands.extend(["select where id >= 25 and id < 61", ".exit"])
+        results = self.run_db(commands)
+
+        rows = [r for r in results if r.endswith("@email.com")]
+        self.assertEqual(18, len(rows))
+        self.assertEqual("db > 26 user26 user26@email.com", rows[0])
+        self.assertEqual("60 user60 user60@email.com", rows[-1])
+
+    def test_deletesRowsByKeyAndRange(self):
+        commands = []
+        for i in range(1, 21):
+            commands.append("insert {0} user{0} user{0}@email.com".format(i))
+        commands.extend(["delete where id = 5", "delete where id > 15",
+                         "delete where id >= 8 and id < 10", "delete where id = 30",
+                         "select", ".exit"])
+        results = self.run_db(commands)
+
+        ids = [int(r.replace("db > ", "").split(" ")[0])
+               for r in results if r.endswith("@email.com")]
+        self.assertEqual([1, 2, 3, 4, 6, 7, 10, 11, 12, 13, 14, 15], ids)
+
+    def test_deleteMergesLeavesAndShrinksTree(self):
+        """
+        Deleting all but the first leaf worth of rows merges the leaves until
+        the root is a leaf again.
+        """
+        commands = []
+        for i in range(1, 131):
+            commands.append(self.full_row_insert(i))
+        commands.extend(["delete where id > 10", "delete where id = 3", ".btree",
+                         ".exit"])
+        results = self.run_db(commands)
+        self.assertIn("- leaf (size 9)", results)
+        self.assertNotIn("- internal (size 1)", "\n".join(results))
+
+    def test_deleteBorrowsFromSibling(self):
+        """
+        A leaf that is almost empty takes rows from its full sibling when the
+        two do not fit in one leaf.
+        """
+        commands = []
+        for i in range(1, 27):
+            commands.append(self.full_row_insert(i))
+        commands.extend(["delete where id >= 14 and id <= 23", ".btree", ".exit"])
+        results = self.run_db(commands)
+        self.assertIn("    - leaf (size 8)", results)
+        self.assertIn("    - leaf (size 8)", results[results.index("    - leaf (size 8)") + 1:])
+        self.assertIn("    - key 8", results)
+
+    def test_deletedPagesAreReused(self):
+        commands = []
+        for i in range(1, 131):
+            commands.append(self.full_row_insert(i))
+        commands.extend(["delete", ".exit"])
+        self.run_db(commands)
+        size = os.path.getsize(self.TESTING_DB_FILENAME)
+
+        commands = []
+        for i in range(1, 131):
+            commands.append(self.full_row_insert(i))
+        commands.extend(["select", ".exit"])
+        results = self.run_db(commands)
+        self.assertEqual(130, len([r for r in results if " uuu" in r]))
+        self.assertEqual(size, os.path.getsize(self.TESTING_DB_FILENAME))
+
+    def test_freePagesAreReusedAfterReopen(self):
+        """
+        The pages freed by a delete stay on the free list in the file header,
+        so inserts in a later session take them instead of growing the file.
+        """
+        commands = [self.full_row_insert(i) for i in range(1, 1301)]
+        commands.append('.exit')
+        self.run_db(commands)
+        self.run_db(['delete where id <= 1000', '.exit'])
+        size = os.path.getsize(self.TESTING_DB_FILENAME)
+
+        commands = [self.full_row_insert(i) for i in range(2001, 2901)]
+        commands.extend(['select where id >= 1001', '.exit'])
+        results = self.run_db(commands)
+        self.assertEqual(1200, len([r for r in results if " uuu" in r]))
+        self.assertEqual(size, os.path.getsize(self.TESTING_DB_FILENAME))
+
+    def test_updatesRowInPlace(self):
+        commands = ["insert 1 user1 user1@email.com", "insert 2 user2 user2@email.com",
+                    "update 1 set email=new@email.com",
+                    "update 2 set username=other email=a@b.c",
+                    "update 3 set email=x@y.z", "select", ".exit"]
+        results = self.run_db(commands)
+        self.assertIn("db > Error: Key not found.", results)
+        self.assertIn("db > 1 user1 new@email.com", results)
+        self.assertIn("2 other a@b.c", results)
+
+    def test_updateSplitsLeafWhenRowOutgrowsIt(self):
+        """
+        14 rows of 289 bytes nearly fill a leaf. The first row to grow by 4
+        bytes still fits, the second one has to move.
+        """
+        commands = []
+        for i in range(1, 15):
+            commands.append("insert {0} {1} {2}".format(i, "u" * 32, "e" * 250 + str(i % 10)))
+        commands.extend(["update 3 set email=" + "f" * 255,
+                         "update 9 set email=" + "g" * 255, ".btree", "select", ".exit"])
+        results = self.run_db(commands)
+        self.assertIn("- internal (size 1)", results)
+        rows = [r.replace("db > ", "") for r in results if " uuu" in r]
+        self.assertEqual(14, len(rows))
+        self.assertEqual("3 " + "u" * 32 + " " + "f" * 255, rows[2])
+        self.assertEqual("9 " + "u" * 32 + " " + "g" * 255, rows[8])
+
+    def test_selectsRowByKey(self):
+        commands = []
+        for i in range(1, 101):
+            commands.append("insert {0} user{0} user{0}@email.com".format(i))
+        commands.extend(["select where id = 42", "select where id = 101", ".exit"])
+        results = self.run_db(commands)
+
+        self.assertIn("db > 42 user42 user42@email.com", results)
+        self.assertEqual(1, len([r for r in results if r.endswith("@email.com")]))
+        self.assertEqual("db > Executed.", results[-2])
+
+    def test_selectsRowsByEmailThroughIndex(self):
+        """
+        The index is built from the rows already there and follows the
+        inserts, updates and deletes after it, also once the file is reopened.
+        """
+        commands = []
+        for i in range(1, 301):
+            commands.append("insert {0} user{0} user{1}@email.com".format(i, i % 50))
+        commands.extend(["create index on email", "insert 301 late user7@email.com",
+                         "update 57 set email=moved@email.com", "update 8 set username=renamed",
+                         "delete where id >= 100 and id <= 199", ".exit"])
+        self.run_db(commands)
+        results = self.run_db(["select where email = user7@email.com",
+                               "select where email = moved@email.com",
+                               "select where email = nobody@email.com", ".exit"])
+        rows = [r.replace("db > ", "") for r in results if "@email.com" in r]
+        self.assertEqual(["7 user7 user7@email.com", "207 user207 user7@email.com",
+                          "257 user257 user7@email.com", "301 late user7@email.com",
+                          "57 user57 moved@email.com"], rows)
+
+    def test_selectsRowsByUsernameWithoutIndex(self):
+        commands = ["insert 1 alice a@x.com", "insert 2 bob b@x.com", "insert 3 alice c@x.com",
+                    "select where username = alice", "create index on username",
+                    "create index on username", "select where username = alice", ".exit"]
+        results = self.run_db(commands)
+        self.assertEqual(2, results.count("db > 1 alice a@x.com"))
+        self.assertEqual(2, results.count("3 alice c@x.com"))
+        self.assertIn("db > Error: Index already exists.", results)
+
+    def test_bulkLoadFillsIndexes(self):
+        self.write_load_file(range(1, 1001))
+        commands = ['create index on email', '.load {}'.format(self.TESTING_LOAD_FILENAME),
+                    'select where email = user500@email.com', '.exit']
+        results = self.run_db(commands)
+        self.assertIn("db > 500 user500 user500@email.com", results)
+
+    def test_keysAreSixtyFourBits(self):
+        big = 2 ** 32
+        commands = []
+        for i in [big + 1, 5, 2 ** 64 - 1, big, big - 1]:
+            commands.append("insert {0} user{0} user{0}@email.com".format(i))
+        commands.extend(["select where id >= 4294967296",
+                         "delete where id > 18446744073709551614",
+                         "update 4294967296 set username=big", "select", ".exit"])
+        results = self.run_db(commands)
+
+        rows = [r.replace("db > ", "") for r in results if r.endswith("@email.com")]
+        self.assertEqual([
+            "4294967296 user4294967296 user4294967296@email.com",
+            "4294967297 user4294967297 user4294967297@email.com",
+            "18446744073709551615 user18446744073709551615 user18446744073709551615@email.com",
+            "5 user5 user5@email.com",
+            "4294967295 user4294967295 user4294967295@email.com",
+            "4294967296 big user4294967296@email.com",
+            "4294967297 user4294967297 user4294967297@email.com",
+        ], rows)
+
+    def test_writesRowsInBinaryFormat(self):
+        self.run_db(['insert 2 bob bob@email.com', 'insert 1 al al@email.com', '.exit'])
+        dbproc = Popen(["./bin/simpledb", self.TESTING_DB_FILENAME, "--binary"], stdin=PIPE, stdout=PIPE)
+        output = dbproc.communicate(b'select\n.exit\n')[0]
+
+        rows = []
+        position = output.index(b'db > ') + len(b'db > ')
+        while True:
+            (length,) = struct.unpack_from('<I', output, position)
+            position += 4
+            if length == 0:
+                break
+            (row_id, username_length) = struct.unpack_from('<QH', output, position)
+            username = output[position + 10:position + 10 + username_length]
+            (email_length,) = struct.unpack_from('<H', output, position + 10 + username_length)
+            email_start = position + 12 + username_length
+            rows.append((row_id, username, output[email_start:email_start + email_length]))
+            position += length
+        self.assertEqual([(1, b'al', b'al@email.com'), (2, b'bob', b'bob@email.com')], rows)
+        self.assertTrue(output[position:].startswith(b'Executed.\n'))
+
+    def test_evictsPagesWhenBufferPoolIsSmall(self):
+        """
+        27 rows take 5 pages, which does not fit in a pool of 4 frames.
+        """
+        commands = []
+        for i in range(27, 0, -1):
+            commands.append("insert {0} user{0} user{0}@email.com".format(i))
+        commands.append(".exit")
+        self.run_db(commands, ["--frames", "4"])
+
+        results = self.run_db(["select", ".exit"], ["--frames", "4"])
+        expectedResults = ["db > 1 user1 user1@email.com",]
+        for i in range(2, 28):
+            expectedResults.append("{0} user{0} user{0}@email.com".format(i))
+        for eres in expectedResults:
+            self.assertIn(eres, results)
+
+    def test_checkpointPersistsDataWithoutExit(self):
+        """
+        Input ends without .exit, so only pages written by .checkpoint survive.
+        """
+        self.run_db(['insert 1 user user@email.com', '.checkpoint'])
+        results = self.run_db(['select', '.exit'])
+        self.assertIn('db > 1 user user@email.com', results)
+
+    def test_acknowledgedInsertsSurviveCrash(self):
+        dbproc = Popen(["./bin/simpledb", self.TESTING_DB_FILENAME], stdin=PIPE, stdout=PIPE, text=True)
+        for i in range(1, 11):
+            dbproc.stdin.write("insert {0} user{0} user{0}@email.com\n".format(i))
+        dbproc.stdin.flush()
+
+        acknowledged = 0
+        while acknowledged < 10:
+            acknowledged += dbproc.stdout.readline().count("Executed.")
+        dbproc.kill()
+        dbproc.wait()
+
+        results = self.run_db(['select', '.exit'])
+        expectedResults = ["db > 1 user1 user1@email.com",]
+        for i in range(2, 11):
+            expectedResults.append("{0} user{0} user{0}@email.com".format(i))
+        for eres in expectedResults:
+            self.assertIn(eres, results)
+
+    def test_acknowledgementsWaitForSyncWhenOutputFills(self):
+        """
+        The inserts are piped in faster than they are executed, so their
+        acknowledgements fill the stdout buffer more than once before the
+        input runs dry. Each one must still only be released after a sync.
+        """
+        dbproc = Popen(["./bin/simpledb", self.TESTING_DB_FILENAME], stdin=PIPE, stdout=PIPE, text=True)
+        inserts = "".join("insert {0} user{0} user{0}@email.com\n".format(i) for i in range(1, 20001))
+
+        def feed():
+            try:
+                dbproc.stdin.write(inserts)
+                dbproc.stdin.flush()
+            except BrokenPipeError:
+                pass
+        feeder = threading.Thread(target=feed)
+        feeder.start()
+
+        acknowledged = 0
+        while acknowledged < 6000:
+            acknowledged += dbproc.stdout.readline().count("Executed.")
+        dbproc.kill()
+        dbproc.wait()
+        feeder.join()
+        dbproc.stdin.close()
+        dbproc.stdout.close()
+
+        results = self.run_db(['select where id <= {0}'.format(acknowledged), '.exit'])
+        self.assertEqual("db > 1 user1 user1@email.com", results[0])
+        self.assertIn("{0} user{0} user{0}@email.com".format(acknowledged), results)
+        self.assertEqual(acknowledged, len([line for line in results if "@email.com" in line]))
+
+    def test_splitsInternalNodes(self):
+        """
+        An internal node holds 338 keys of full width, so 4000 rows spread
+        over more leaves than a single internal node can point to.
+        Descending keys split every node in half.
+        """
+        commands = []
+        for i in range(4000, 0, -1):
+            commands.append(self.full_row_insert(i))
+        commands.extend(['.btree', 'select', '.exit'])
+        results = self.run_db(commands, ['--frames', '8'])
+        self.assertIn("    - internal (size 169)", results)
+        rows = [r for r in results if " uuu" in r]
+        self.assertEqual(4000, len(rows))
+        self.assertEqual("db > " + self.full_row_insert(1)[len("insert "):], rows[0])
+        for i in range(2, 4001):
+            self.assertEqual(self.full_row_insert(i)[len("insert "):], rows[i - 1])
+
+    def test_internalNodesWithNarrowFencesHoldMoreKeys(self):
+        """
+        The first child of the root only covers keys up to about 9000, so
+        its keys take 2 bytes and it grows past 338 keys without a split.
+        """
+        commands = []
+        for i in range(2, 13301, 2):
+            commands.append(self.full_row_insert(i))
+        for i in range(1, 1601, 2):
+            commands.append(self.full_row_insert(i))
+        commands.extend(['.btree', 'select where id <= 1600', '.exit'])
+        results = self.run_db(commands)
+        self.assertIn("    - internal (size 461)", results)
+        rows = [r for r in results if " uuu" in r]
+        self.assertEqual(1600, len(rows))
+
+    def test_appendsFillLeavesCompletely(self):
+        """
+        Increasing keys leave every leaf but the last one full, so 130 rows
+        take 10 leaves, the root, the catalog and the file header.
+        """
+        commands = []
+        for i in range(1, 131):
+            commands.append(self.full_row_insert(i))
+        commands.extend(['.btree', '.exit'])
+        results = self.run_db(commands)
+        self.assertEqual(10, results.count("    - leaf (size 13)"))
+        self.assertEqual(13 * 4096, os.path.getsize(self.TESTING_DB_FILENAME))
+
+    def test_pageSizeIsChosenWhenFileIsCreated(self):
+        """
+        A page of 16K holds four times the rows of a 4K one. Reopening the
+        file keeps its page size whatever is asked for.
+        """
+        commands = []
+        for i in range(1, 131):
+            commands.append(self.full_row_insert(i))
+        commands.append('.exit')
+        self.run_db(commands, ['--page-size', '16384'])
+        results = self.run_db(['.constants', '.btree', 'select', '.exit'],
+                              ['--page-size', '4096'])
+        self.assertIn('LEAF_NODE_SPACE_FOR_CELLS: 16366', results)
+        self.assertEqual(2, results.count("    - leaf (size 54)"))
+        self.assertIn("    - leaf (size 22)", results)
+        self.assertEqual(130, len([r for r in results if " uuu" in r]))
+        self.assertEqual(6 * 16384, os.path.getsize(self.TESTING_DB_FILENAME))
+
+    def test_rejectsInvalidPageSize(self):
+        results = self.run_db(['.exit'], ['--page-size', '5000'])
+        self.assertIn('Page size must be a power of two from 4096 to 65536.',
+                      results)
+
+    def test_mmapModeReadsAndWritesRows(self):
+        commands = []
+        for i in range(60, 0, -1):
+            commands.append("insert {0} user{0} user{0}@email.com".format(i))
+        commands.append(".exit")
+        self.run_db(commands, ["--mmap", "--frames", "4"])
+
+        expectedResults = ["db > 1 user1 user1@email.com",]
+        for i in range(2, 61):
+            expectedResults.append("{0} user{0} user{0}@email.com".format(i))
+        for options in [[], ["--mmap"]]:
+            results = self.run_db(['select', '.exit'], options)
+            for eres in expectedResults:
+                self.assertIn(eres, results)
+
+    def test_blockingIoReadsAndWritesRows(self):
+        """
+        --sync-io takes the fallback path that is used where io_uring is
+        not available.
+        """
+        commands = []
+        for i in range(60, 0, -1):
+            commands.append("insert {0} user{0} user{0}@email.com".format(i))
+        commands.extend(['select', '.exit'])
+        results = self.run_db(commands, ["--sync-io", "--frames", "4"])
+
+        expectedResults = ["db > 1 user1 user1@email.com",]
+        for i in range(2, 61):
+            expectedResults.append("{0} user{0} user{0}@email.com".format(i))
+        for eres in expectedResults:
+            self.assertIn(eres, results)
+
+    def test_bulkLoadsRowsFromFile(self):
+        ids = list(range(1, 2001))
+        random.shuffle(ids)
+        self.write_load_file(ids)
+        commands = ['.load {} 50'.format(self.TESTING_LOAD_FILENAME), '.btree', '.exit']
+        results = self.run_db(commands)
+        self.assertIn("db > Loaded 2000 rows.", results)
+        self.assertIn("- internal (size 36)", results)
+
+        results = self.run_db(['insert 2001 user2001 user2001@email.com', 'select', '.exit'])
+        rows = [r for r in results if r.endswith("@email.com")]
+        self.assertEqual(2001, len(rows))
+        self.assertTrue(rows[0].endswith("1 user1 user1@email.com"))
+        for i in range(2, 2002):
+            self.assertEqual("{0} user{0} user{0}@email.com".format(i), rows[i - 1])
+
+    def test_scanReadsLeavesAheadAcrossParents(self):
+        """
+        At 1% fill a leaf holds a row or two and an internal node 3 children,
+        so a scan reads ahead across many parents with a small pool.
+        """
+        ids = list(range(1, 3001))
+        random.shuffle(ids)
+        self.write_load_file(ids)
+        self.run_db(['.load {} 1'.format(self.TESTING_LOAD_FILENAME), '.exit'])
+
+        results = self.run_db(['select', '.exit'], ['--frames', '8'])
+        rows = [r for r in results if r.endswith("@email.com")]
+        self.assertEqual(3000, len(rows))
+        for i in range(2, 3001):
+            self.assertEqual("{0} user{0} user{0}@email.com".format(i), rows[i - 1])
+
+    def test_bulkLoaderMergesSortedRuns(self):
+        """
+        With 1 MB of sort memory the input is sorted in several runs.
+        """
+        ids = list(range(1, 10001))
+        random.shuffle(ids)
+        self.write_load_file(ids)
+        loader = run(["./bin/sdbload", self.TESTING_DB_FILENAME, self.TESTING_LOAD_FILENAME,
+                      "--sort-memory", "1"], stdout=PIPE, text=True)
+        self.assertEqual("Loaded 10000 rows.\n", loader.stdout)
+
+        results = self.run_db(['select', '.exit'])
+        rows = [r for r in results if r.endswith("@email.com")]
+        self.assertEqual(10000, len(rows))
+        for i in range(2, 10001):
+            self.assertEqual("{0} user{0} user{0}@email.com".format(i), rows[i - 1])
+
+    def test_bulkLoadRejectsDuplicateKeys(self):
+        self.write_load_file([3, 1, 2, 1])
+        commands = ['.load {}'.format(self.TESTING_LOAD_FILENAME), 'select', '.exit']
+        results = self.run_db(commands)
+        self.assertIn("db > Error: Key 1 appears more than once.", results)
+        self.assertNotIn("1 user1 user1@email.com", "\n".join(results))
+
+    def test_bulkLoadNeedsAnEmptyTable(self):
+        self.write_load_file([1, 2, 3])
+        commands = ['insert 5 user5 user5@email.com', '.load {}'.format(self.TESTING_LOAD_FILENAME), '.exit']
+        results = self.run_db(commands)
+        self.assertIn("db > Error: Bulk load needs an empty table.", results)
+
+    def test_keepsTablesApartInOneFile(self):
+        commands = ['create table users', 'create table logins',
+                    'insert 1 user1 user1@email.com',
+                    'insert into users 1 alice alice@email.com',
+                    'insert into logins 1 bob bob@email.com',
+                    'create index on users email', '.exit']
+        self.run_db(commands)
+
+        results = self.run_db(['.tables', 'select from users',
+                               'select from logins where id = 1',
+                               'select from users where email = alice@email.com',
+                               'select', '.exit'])
+        self.assertEqual(["db > main", "users", "logins",
+                          "db > 1 alice alice@email.com", "Executed.",
+                          "db > 1 bob bob@email.com", "Executed.",
+                          "db > 1 alice alice@email.com", "Executed.",
+                          "db > 1 user1 user1@email.com", "Executed.", "db > "], results)
+
+    def test_droppedTablePagesAreReused(self):
+        commands = ['create table users']
+        for i in range(1, 201):
+            commands.append('insert into users {0} user{0} user{0}@email.com'.format(i))
+        commands.extend(['create index on users username', 'drop table users', '.exit'])
+        self.run_db(commands)
+        size = os.path.getsize(self.TESTING_DB_FILENAME)
+
+        commands = ['.tables', 'create table logins']
+        for i in range(1, 201):
+            commands.append('insert into logins {0} user{0} user{0}@email.com'.format(i))
+        commands.append('.exit')
+        results = self.run_db(commands)
+        self.assertEqual("db > main", results[0])
+        self.assertEqual(size, os.path.getsize(self.TESTING_DB_FILENAME))
+
+    def test_readersRunAlongsideWriter(self):
+        """
+        Readers look up and scan the even ids while the writer inserts and
+        deletes odd ones, splitting and merging leaves under them.
+        """
+        bench = run(["./bin/sdbbench", self.TESTING_DB_FILENAME, "--readers", "4",
+                     "--rows", "3000", "--operations", "5000", "--frames", "160"],
+                    stdout=PIPE, text=True)
+        lines = bench.stdout.split("\n")
+        self.assertEqual(0, bench.returncode)
+        self.assertEqual("Errors: 0", lines[3])
+
+        results = self.run_db(['select where id = 6000', '.exit'])
+        self.assertEqual("db > 6000 user6000 user6000@example.com", results[0])
+
+    def test_lookupsWithoutSnapshotsSeeWholeRows(self):
+        """
+        Readers without snapshots look rows up without latching the pages on
+        the way, while the writer splits and merges leaves and lengthens or
+        shortens the rows they look for. Each lookup has to see a row as it
+        was either before or after an update.
+        """
+        bench = run(["./bin/sdbbench", self.TESTING_DB_FILENAME, "--readers", "4",
+                     "--rows", "3000", "--operations", "5000", "--frames", "160",
+                     "--no-snapshots"], stdout=PIPE, text=True)
+        lines = bench.stdout.split("\n")
+        self.assertEqual(0, bench.returncode)
+        self.assertIn("updates", lines[1])
+        self.assertEqual("Errors: 0", lines[3])
+
+    def test_snapshotsOutliveEvictedPages(self):
+        """
+        The table does not fit in the pool, so pages that changed after a
+        snapshot are evicted and read in again while the snapshot still needs
+        their old versions.
+        """
+        bench = run(["./bin/sdbbench", self.TESTING_DB_FILENAME, "--readers", "3",
+                     "--rows", "20000", "--operations", "3000", "--frames", "96"],
+                    stdout=PIPE, text=True)
+        lines = bench.stdout.split("\n")
+        self.assertEqual(0, bench.returncode)
+        self.assertEqual("Errors: 0", lines[3])
+
+    def test_rollbackUndoesTransaction(self):
+        """
+        The inserts split leaves and are spilled from a small pool before the
+        rollback, which still has to put back every page they changed.
+        """
+        commands = ['insert 1 user1 person1@example.com', 'begin']
+        commands += [self.full_row_insert(i) for i in range(2, 60)]
+        commands += ['rollback', 'insert 2 user2 person2@example.com', '.exit']
+        self.run_db(commands, ["--frames", "5"])
+
+        results = self.run_db(['select', '.btree', '.exit'])
+        self.assertEqual("db > 1 user1 person1@example.com", results[0])
+        self.assertEqual("2 user2 person2@example.com", results[1])
+        self.assertEqual("db > SimpleDB Tree:", results[3])
+        self.assertEqual("- leaf (size 2)", results[4])
+
+    def test_committedTransactionPersists(self):
+        commands = ['begin', 'insert 1 user1 person1@example.com',
+                    'insert 2 user2 person2@example.com', 'commit',
+                    'begin', 'insert 3 user3 person3@example.com', '.exit']
+        self.run_db(commands)
+
+        results = self.run_db(['select', '.exit'])
+        self.assertEqual(["db > 1 user1 person1@example.com",
+                          "2 user2 person2@example.com", "Executed."], results[0:3])
+
+    def test_readersRunAlongsideBatchedWriter(self):
+        """
+        The writer groups its operations into transactions and rolls some of
+        them back, while readers with and without snapshots look on.
+        """
+        for options in [[], ["--no-snapshots"]]:
+            bench = run(["./bin/sdbbench", self.TESTING_DB_FILENAME, "--readers", "3",
+                         "--rows", "3000", "--operations", "2000", "--frames", "96",
+                         "--batch", "25"] + options, stdout=PIPE, text=True)
+            lines = bench.stdout.split("\n")
+            self.assertEqual(0, bench.returncode)
+            self.assertEqual("Errors: 0", lines[3])
+            run(['rm', "-f", self.TESTING_DB_FILENAME, self.TESTING_DB_FILENAME + ".wal"])
+
+    def start_server(self):
+        """
+        Starts serving the test database on a Unix socket, and returns the
+        server process once it listens.
+        """
+        server = Popen(["./bin/simpledb", self.TESTING_DB_FILENAME, "--serve",
+                        self.TESTING_SOCKET_PATH], stdout=PIPE, text=True)
+        self.addCleanup(server.kill)
+        self.assertEqual("Listening on " + self.TESTING_SOCKET_PATH + "\n",
+                         server.stdout.readline())
+        return server
+
+    def connect(self):
+        client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        client.connect(self.TESTING_SOCKET_PATH)
+        return client
+
+    def insert_request(self, i, username, email):
+        username = username.encode()
+        email = email.encode()
+        body = struct.pack("<BQH", 1, i, len(username)) + username + \
+            struct.pack("<H", len(email)) + email
+        return struct.pack("<I", len(body)) + body
+
+    def receive(self, client, length):
+        data = b""
+        while len(data) < length:
+            chunk = client.recv(length - len(data))
+            self.assertNotEqual(b"", chunk)
+            data += chunk
+        return data
+
+    def receive_rows(self, client):
+        """
+        Reads a response with rows, and returns its status and the rows.
+        """
+        status = self.receive(client, 1)[0]
+        rows = []
+        while True:
+            length = struct.unpack("<I", self.receive(client, 4))[0]
+            if length == 0:
+                return status, rows
+            frame = self.receive(client, length)
+            i, username_length = struct.unpack("<QH", frame[0:10])
+            username = frame[10:10 + username_length].decode()
+            email = frame[12 + username_length:].decode()
+            rows.append((i, username, email))
+
+    def test_servesClientsOverSocket(self):
+        """
+        Two clients send requests without waiting for the responses. The scan
+        is larger than the output buffer of a connection, so it is streamed.
+        """
+        server = self.start_server()
+        first = self.connect()
+        second = self.connect()
+        first.sendall(b"".join(self.insert_request(i, "user{0}".format(i), "e" * 250)
+                               for i in range(1, 2001, 2)))
+        second.sendall(b"".join(self.insert_request(i, "user{0}".format(i), "e" * 250)
+                                for i in range(2, 2001, 2)))
+        self.assertEqual(bytes(1000), self.receive(first, 1000))
+        self.assertEqual(bytes(1000), self.receive(second, 1000))
+
+        second.sendall(self.insert_request(7, "again", "again@example.com") +
+                       self.insert_request(3000, "u" * 33, "long@example.com") +
+                       struct.pack("<IBQ", 9, 2, 7) + struct.pack("<IBQ", 9, 2, 2001))
+        self.assertEqual(bytes([1, 2]), self.receive(second, 2))
+        self.assertEqual((0, [(7, "user7", "e" * 250)]), self.receive_rows(second))
+        self.assertEqual((0, []), self.receive_rows(second))
+
+        first.sendall(struct.pack("<IBQQ", 17, 3, 0, 1999))
+        status, rows = self.receive_rows(first)
+        self.assertEqual(0, status)
+        self.assertEqual(list(range(1, 2000)), [row[0] for row in rows])
+
+        second.sendall(struct.pack("<IB", 1, 9))
+        self.assertEqual(b"", second.recv(1))
+        first.close()
+        second.close()
+        server.send_signal(signal.SIGTERM)
+        self.assertEqual(0, server.wait())
+        server.stdout.close()
+        self.assertFalse(os.path.exists(self.TESTING_SOCKET_PATH))
+
+        results = self.run_db(['select where id = 2000', '.exit'])
+        self.assertEqual("db > 2000 user2000 " + "e" * 250, results[0])
+
+    def test_serverAnswersClientThatClosedItsEnd(self):
+        """
+        A client that sends its requests and then shuts down its end of the
+        connection still gets every response before the server closes it.
+        """
+        server = self.start_server()
+        client = self.connect()
+        client.sendall(b"".join(self.insert_request(i, "user{0}".format(i), "e" * 250)
+                                for i in range(1, 1001)) +
+                       struct.pack("<IBQQ", 17, 3, 1, 1000))
+        client.shutdown(socket.SHUT_WR)
+        self.assertEqual(bytes(1000), self.receive(client, 1000))
+        status, rows = self.receive_rows(client)
+        self.assertEqual(0, status)
+        self.assertEqual(list(range(1, 1001)), [row[0] for row in rows])
+        self.assertEqual(b"", client.recv(1))
+        client.close()
+        server.send_signal(signal.SIGTERM)
+        self.assertEqual(0, server.wait())
+        server.stdout.close()
+
 class TestErrors(unittest.TestCase):
     TESTING_DB_FILENAME = 'simpledbtesting.sdb'
 
@@ -128,7 +824,7 @@ class TestErrors(unittest.TestCase):
         pass
 
     def tearDown(self):
-        run(['rm', "-f", self.TESTING_DB_FILENAME])
+        run(['rm', "-f", self.TESTING_DB_FILENAME, self.TESTING_DB_FILENAME + ".wal"])
 
     def run_db(self, commands):
         commands = '\n'.join(commands)
@@ -153,17 +849,40 @@ class TestErrors(unittest.TestCase):
         results = self.run_db(commands)
         self.assertIn("db > Unrecognized keyword at start of 'not-a-statement'", results)
 
-    def test_detectsWhenTableIsFull(self):
-        """
-        Currently a page can hold 15 rows.
-        A table has 100 pages. Therefore total rows in the table = 15*100 = 1500
-        """
-        commands = []
-        for i in range(0, 1501):
-            commands.append("insert {0} user{0} user{0}@email.com".format(i))
-        commands.append(".exit")
+    def test_detectsSyntaxErrorsInSelect(self):
+        commands = ['select where name = 1', 'select where id ~ 1',
+                    'select where id > 1 and id < 5 and id = 3',
+                    'select where id = 18446744073709551616', '.exit']
+        results = self.run_db(commands)
+        self.assertEqual(4, results.count("db > Syntax error. Could not parse statement."))
+
+    def test_detectsSyntaxErrorsInDelete(self):
+        commands = ['delete id = 1', 'delete where id ~ 1', 'delete where email = a@b.c', '.exit']
         results = self.run_db(commands)
-        self.assertIn("db > Need to implement splitting internal node", results)
+        self.assertEqual(3, results.count("db > Syntax error. Could not parse statement."))
+
+    def test_detectsSyntaxErrorsInCreateIndex(self):
+        commands = ['create index email', 'create index on id', 'create index on email now',
+                    'select where email > a@b.c', 'select where email = a@b.c and id = 1', '.exit']
+        results = self.run_db(commands)
+        self.assertEqual(5, results.count("db > Syntax error. Could not parse statement."))
+
+    def test_detectsErrorsInTableStatements(self):
+        commands = ['create table 1users', 'create table us-ers', 'drop users',
+                    'insert into users', 'create table ' + 'a'*33,
+                    'create table users', 'create table users', 'select from logins',
+                    'drop table logins', 'update logins 1 set email=a', '.exit']
+        results = self.run_db(commands)
+        self.assertEqual(4, results.count("db > Syntax error. Could not parse statement."))
+        self.assertIn("db > Maximum string length exceeded.", results)
+        self.assertIn("db > Error: Table already exists.", results)
+        self.assertEqual(3, results.count("db > Error: Table not found."))
+
+    def test_detectsSyntaxErrorsInUpdate(self):
+        commands = ['update 1 email=a', 'update 1 set', 'update 1 set id=2',
+                    'update 1 set email=', '.exit']
+        results = self.run_db(commands)
+        self.assertEqual(4, results.count("db > Syntax error. Could not parse statement."))
 
     def test_detectsWhenStringsAreTooLong(self):
         long_username = "a"*33
@@ -183,5 +902,12 @@ class TestErrors(unittest.TestCase):
         results = self.run_db(commands)
         self.assertIn("db > Error: Key already exits.", results)
 
+    def test_detectsErrorsInTransactions(self):
+        commands = ['commit', 'begin', 'begin', 'create table users', '.load rows.txt',
+                    'rollback', 'rollback', '.exit']
+        results = self.run_db(commands)
+        self.assertEqual(2, results.count("db > Error: No transaction is open."))
+        self.assertEqual(3, results.count("db > Error: A transaction is open."))
+
 if __name__ == "__main__":
     unittest.main()
@@ -0,0 +1,292 @@
+/********************************************************************************
+ * wal.c : Write-ahead log that makes committed statements durable
+ ********************************************************************************/
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define WAL_INITIAL_BUFFER_SIZE (64 * 1024)
+
+/* Anything longer than this can only be a corrupted header. */
+#define WAL_MAX_RECORD_LENGTH (1024 * 1024)
+
+/*
+ * A page image read back from the log during replay.
+ */
+typedef struct {
+  uint32_t page_num;
+  uint32_t length;
+  void* data;
+} WalPageImage;
+
+/*
+ * FNV-1a hash of LENGTH bytes at DATA, continuing from HASH.
+ */
+static uint32_t wal_checksum(uint32_t hash, const void *data, uint32_t length) {
+  const uint8_t *bytes = data;
+  for (uint32_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t wal_record_checksum(WalRecordHeader header, const void *data) {
+  header.checksum = 0;
+  uint32_t hash = wal_checksum(2166136261u, &header, sizeof(header));
+  return wal_checksum(hash, data, header.length);
+}
+
+/*
+ * Opens the log that belongs to DB_FILENAME, creating it if needed.
+ * The log lives next to the database file, with ".wal" appended to its name.
+ */
+Wal *wal_open(const char *db_filename) {
+  Wal *wal = malloc(sizeof(Wal));
+  wal->filename = malloc(strlen(db_filename) + strlen(".wal") + 1);
+  strcpy(wal->filename, db_filename);
+  strcat(wal->filename, ".wal");
+
+  wal->file_descriptor =
+      open(wal->filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  if (wal->file_descriptor == -1) {
+    printf("Unable to open log file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  wal->file_length = lseek(wal->file_descriptor, 0, SEEK_END);
+  wal->buffer_capacity = WAL_INITIAL_BUFFER_SIZE;
+  wal->buffer = malloc(wal->buffer_capacity);
+  wal->buffer_length = 0;
+  wal->next_lsn = wal->file_length;
+  wal->flushed_lsn = wal->file_length;
+  wal->pending_commits = 0;
+
+  return wal;
+}
+
+/*
+ * Syncs and closes the log. An empty log is removed, so a database that was
+ * closed cleanly is a single file again.
+ */
+void wal_close(Wal *wal) {
+  wal_sync(wal);
+  close(wal->file_descriptor);
+  if (wal->file_length == 0) {
+    unlink(wal->filename);
+  }
+
+  free(wal->buffer);
+  free(wal->filename);
+  free(wal);
+}
+
+/*
+ * Appends a record to the log buffer and returns its LSN. The record is not
+ * durable until the log is synced.
+ */
+uint64_t wal_append(Wal *wal, WalRecordType type, uint32_t page_num,
+                    void *data, uint32_t length) {
+  uint32_t record_length = sizeof(WalRecordHeader) + length;
+  if (wal->buffer_length + record_length > wal->buffer_capacity) {
+    while (wal->buffer_length + record_length > wal->buffer_capacity) {
+      wal->buffer_capacity *= 2;
+    }
+    wal->buffer = realloc(wal->buffer, wal->buffer_capacity);
+  }
+
+  WalRecordHeader header;
+  header.type = type;
+  header.page_num = page_num;
+  header.length = length;
+  header.checksum = wal_record_checksum(header, data);
+
+  void *destination = wal->buffer + wal->buffer_length;
+  memcpy(destination, &header, sizeof(header));
+  memcpy(destination + sizeof(header), data, length);
+  wal->buffer_length += record_length;
+  wal->next_lsn += record_length;
+
+  return wal->next_lsn;
+}
+
+/*
+ * Ends a unit of work. Commits are grouped, and the log is only synced once
+ * WAL_GROUP_COMMIT_SIZE of them have piled up or someone asks for wal_sync.
+ */
+void wal_commit(Wal *wal) {
+  wal_append(wal, WAL_RECORD_COMMIT, 0, NULL, 0);
+  wal->pending_commits++;
+  if (wal->pending_commits >= WAL_GROUP_COMMIT_SIZE) {
+    wal_sync(wal);
+  }
+}
+
+/*
+ * Gives up the unit of work that is running. The page records it appended
+ * are skipped by replay, even once later units commit.
+ */
+void wal_abort(Wal *wal) {
+  wal_append(wal, WAL_RECORD_ABORT, 0, NULL, 0);
+}
+
+/*
+ * Writes the buffered records to the log file and waits until they are on
+ * disk. All commits made so far become durable with a single fsync.
+ */
+void wal_sync(Wal *wal) {
+  if (wal->buffer_length == 0) {
+    return;
+  }
+
+  ssize_t bytes_written = pwrite(wal->file_descriptor, wal->buffer,
+                                 wal->buffer_length, wal->file_length);
+  if (bytes_written != wal->buffer_length) {
+    printf("Error writing log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  if (fdatasync(wal->file_descriptor) == -1) {
+    printf("Error syncing log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  wal->file_length += wal->buffer_length;
+  wal->buffer_length = 0;
+  wal->flushed_lsn = wal->next_lsn;
+  wal->pending_commits = 0;
+}
+
+/*
+ * Makes sure the log is on disk at least up to LSN. A page may only be written
+ * to the database file once the records describing it are durable.
+ */
+void wal_flush_to(Wal *wal, uint64_t lsn) {
+  if (lsn > wal->flushed_lsn) {
+    wal_sync(wal);
+  }
+}
+
+/*
+ * Reads back the LENGTH bytes of payload of the record that ends at LSN. The
+ * record may still be in the buffer.
+ */
+void wal_read(Wal *wal, uint64_t lsn, void *data, uint32_t length) {
+  uint64_t log_start_lsn =
+      wal->next_lsn - wal->file_length - wal->buffer_length;
+  uint64_t position = lsn - log_start_lsn - length;
+
+  if (position >= wal->file_length) {
+    memcpy(data, wal->buffer + (position - wal->file_length), length);
+    return;
+  }
+
+  if (pread(wal->file_descriptor, data, length, position) != length) {
+    printf("Error reading log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Copies the pages of every committed unit in the log to the database file,
+ * then empties the log. Records after the last intact commit record belong to
+ * a statement that never finished and are ignored, like the ones an abort
+ * record voids.
+ * Returns the number of page images that were applied.
+ */
+uint32_t wal_replay(Wal *wal, int db_file_descriptor) {
+  uint32_t num_applied = 0;
+  uint32_t num_images = 0;
+  uint32_t images_capacity = 16;
+  WalPageImage *images = malloc(images_capacity * sizeof(WalPageImage));
+
+  off_t offset = 0;
+  while (true) {
+    WalRecordHeader header;
+    ssize_t bytes_read =
+        pread(wal->file_descriptor, &header, sizeof(header), offset);
+    if (bytes_read != sizeof(header) || header.type > WAL_RECORD_ABORT ||
+        header.length > WAL_MAX_RECORD_LENGTH) {
+      break;
+    }
+
+    void *data = malloc(header.length);
+    bytes_read = pread(wal->file_descriptor, data, header.length,
+                       offset + sizeof(header));
+    if (bytes_read != header.length ||
+        wal_record_checksum(header, data) != header.checksum) {
+      free(data);
+      break;
+    }
+    offset += sizeof(header) + header.length;
+
+    if (header.type == WAL_RECORD_PAGE) {
+      if (num_images == images_capacity) {
+        images_capacity *= 2;
+        images = realloc(images, images_capacity * sizeof(WalPageImage));
+      }
+      images[num_images].page_num = header.page_num;
+      images[num_images].length = header.length;
+      images[num_images].data = data;
+      num_images++;
+      continue;
+    }
+
+    free(data);
+    if (header.type == WAL_RECORD_ABORT) {
+      for (uint32_t i = 0; i < num_images; i++) {
+        free(images[i].data);
+      }
+      num_images = 0;
+      continue;
+    }
+    for (uint32_t i = 0; i < num_images; i++) {
+      off_t page_offset = (off_t)images[i].page_num * images[i].length;
+      if (pwrite(db_file_descriptor, images[i].data, images[i].length,
+                 page_offset) != images[i].length) {
+        printf("Error replaying log: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      free(images[i].data);
+    }
+    num_applied += num_images;
+    num_images = 0;
+  }
+
+  for (uint32_t i = 0; i < num_images; i++) {
+    free(images[i].data);
+  }
+  free(images);
+
+  if (num_applied > 0 && fsync(db_file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  wal_truncate(wal);
+
+  return num_applied;
+}
+
+/*
+ * Empties the log. Only safe once every page it describes is in the database
+ * file and synced.
+ */
+void wal_truncate(Wal *wal) {
+  wal->buffer_length = 0;
+  wal->pending_commits = 0;
+  wal->flushed_lsn = wal->next_lsn;
+
+  if (ftruncate(wal->file_descriptor, 0) == -1 ||
+      fsync(wal->file_descriptor) == -1) {
+    printf("Error truncating log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  wal->file_length = 0;
+}
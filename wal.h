@@ -0,0 +1,63 @@
+/********************************************************************************
+ * wal.h : Write-ahead log that makes committed statements durable
+ ********************************************************************************/
+#ifndef _WAL_H
+#define _WAL_H
+
+#include <stdint.h>
+
+/* The log is synced at least once every WAL_GROUP_COMMIT_SIZE commits. */
+#define WAL_GROUP_COMMIT_SIZE 128
+
+/* The log is checkpointed and truncated once it grows past this size. */
+#define WAL_CHECKPOINT_SIZE (16 * 1024 * 1024)
+
+typedef enum {
+  WAL_RECORD_PAGE,   /* Image of a page after it was modified */
+  WAL_RECORD_COMMIT, /* All page records before it belong to a finished unit */
+  WAL_RECORD_ABORT   /* The page records since the last commit are void */
+} WalRecordType;
+
+/*
+ * Every record starts with this header and is followed by LENGTH bytes of
+ * payload. The checksum covers the header (with checksum 0) and the payload,
+ * so a record that was only partly written when the process died is detected.
+ */
+typedef struct {
+  uint32_t type;
+  uint32_t page_num;
+  uint32_t length;
+  uint32_t checksum;
+} WalRecordHeader;
+
+/*
+ * Records are collected in BUFFER and written to the log file by wal_sync.
+ * LSNs (log sequence numbers) grow with every byte appended and are never
+ * reused, even after the file is truncated. Everything below flushed_lsn is
+ * on disk.
+ */
+typedef struct {
+  int file_descriptor;
+  char* filename;
+  uint32_t file_length;
+  void* buffer;
+  uint32_t buffer_length;
+  uint32_t buffer_capacity;
+  uint64_t next_lsn;
+  uint64_t flushed_lsn;
+  uint32_t pending_commits;
+} Wal;
+
+Wal* wal_open(const char* db_filename);
+void wal_close(Wal* wal);
+uint64_t wal_append(Wal* wal, WalRecordType type, uint32_t page_num,
+                    void* data, uint32_t length);
+void wal_commit(Wal* wal);
+void wal_abort(Wal* wal);
+void wal_sync(Wal* wal);
+void wal_flush_to(Wal* wal, uint64_t lsn);
+void wal_read(Wal* wal, uint64_t lsn, void* data, uint32_t length);
+uint32_t wal_replay(Wal* wal, int db_file_descriptor);
+void wal_truncate(Wal* wal);
+
+#endif